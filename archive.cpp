@@ -0,0 +1,135 @@
+/**
+ * Appending frames to an archive (the format is in archive.h).
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <sys/uio.h>
+#include "archive.h"
+
+using namespace std;
+
+/* Creates the archive, or with append opens an existing one to add to it, after the frames it */
+/* holds whole (those after an append that was cut short are dropped, and its index is written */
+/* again after them). Returns false if the file can't be written or, to append to, isn't an */
+/* archive. */
+bool ArchiveWriter::
+open(const char *filename, bool append)
+{
+   close();
+   index.clear();
+   blocks.clear();
+   end=sizeof(ArchiveHeader);
+   if(append && access(filename, F_OK)==0){
+      FrameArchive existing;
+      if(!existing.open(filename)) return false;
+      if(existing.recovered)
+         printf("%s was cut short: kept the %d whole frames\n", filename, (int)existing.entries.size());
+      index=existing.entries;
+      end=existing.end;
+      fd=::open(filename, O_WRONLY);
+      if(fd<0) return false;
+      // a new chain of index blocks, after the frames kept (the old blocks are skipped over)
+      bool ok=ftruncate(fd, end)==0;
+      for(size_t e=0; e<index.size() && ok; e+=ARCHIVE_INDEX_ENTRIES)
+         ok=add_block();
+      for(int b=0; b<(int)blocks.size() && ok; ++b){
+         const int first=b*ARCHIVE_INDEX_ENTRIES, n=min((int)index.size()-first, ARCHIVE_INDEX_ENTRIES);
+         const ssize_t bytes=n*sizeof(ArchiveEntry);
+         ok=pwrite(fd, &index[first], bytes, blocks[b]+sizeof(ArchiveIndexBlock))==bytes && write_block(b);
+      }
+      if(!ok){
+         close();
+         return false;
+      }
+   }else{
+      fd=::open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+      if(fd<0) return false;
+   }
+   if(!write_header() || fdatasync(fd)!=0){
+      close();
+      return false;
+   }
+   return true;
+}
+
+/* Appends a frame (a FrameHeader and the rest of the frame, raw or compressed) and flushes it */
+/* to the disk, then writes its entry in the index and the header and flushes them too. */
+bool ArchiveWriter::
+append(const char *data, size_t size)
+{
+   static const char padding[FRAME_ALIGN]={0};
+   if(fd<0 || size<sizeof(FrameHeader) || memcmp(data, FRAME_MAGIC, 8)) return false;
+   if(index.size()==blocks.size()*ARCHIVE_INDEX_ENTRIES && !add_block()) return false;
+   FrameHeader header;
+   memcpy(&header, data, sizeof header);
+   ArchiveRecord record;
+   memset(&record, 0, sizeof record);
+   memcpy(record.magic, ARCHIVE_RECORD_MAGIC, 8);
+   record.size=size;
+   record.checksum=archive_checksum(data, size);
+   struct iovec io[3]={{&record, sizeof record}, {(void *)data, size},
+                       {(void *)padding, archive_record_bytes(size)-sizeof record-size}};
+   // the frame is on the disk before anything points to it, so a crash can't index a torn frame
+   if(lseek(fd, end, SEEK_SET)!=(off_t)end || !write_all(fd, io, 3) || fdatasync(fd)!=0) return false;
+
+   const int e=index.size(), b=e/ARCHIVE_INDEX_ENTRIES;
+   index.push_back(archive_entry(header, end+sizeof record, size));
+   end+=archive_record_bytes(size);
+   const off_t at=blocks[b]+sizeof(ArchiveIndexBlock)+(e%ARCHIVE_INDEX_ENTRIES)*sizeof(ArchiveEntry);
+   if(pwrite(fd, &index[e], sizeof(ArchiveEntry), at)!=sizeof(ArchiveEntry) || !write_block(b)
+      || !write_header() || fdatasync(fd)!=0){
+      index.pop_back();
+      end-=archive_record_bytes(size);
+      return false;
+   }
+   return true;
+}
+
+/* Writes an empty index block at the end and links the last block to it. */
+bool ArchiveWriter::
+add_block(void)
+{
+   static const char empty[ARCHIVE_INDEX_ENTRIES*sizeof(ArchiveEntry)]={0};
+   ArchiveIndexBlock block;
+   memset(&block, 0, sizeof block);
+   memcpy(block.magic, ARCHIVE_INDEX_MAGIC, 8);
+   block.checksum=archive_checksum(0, 0);
+   struct iovec io[2]={{&block, sizeof block}, {(void *)empty, sizeof empty}};
+   if(lseek(fd, end, SEEK_SET)!=(off_t)end || !write_all(fd, io, 2)) return false;
+   blocks.push_back(end);
+   end+=ARCHIVE_INDEX_BYTES;
+   return blocks.size()<2 || write_block(blocks.size()-2);
+}
+
+/* Rewrites the head of index block b: the next block, and the checksum of its entries so far. */
+bool ArchiveWriter::
+write_block(int b)
+{
+   ArchiveIndexBlock block;
+   memset(&block, 0, sizeof block);
+   memcpy(block.magic, ARCHIVE_INDEX_MAGIC, 8);
+   block.next=(b+1<(int)blocks.size()) ? blocks[b+1] : 0;
+   const int first=b*ARCHIVE_INDEX_ENTRIES, n=max(0, min((int)index.size()-first, ARCHIVE_INDEX_ENTRIES));
+   block.checksum=archive_checksum((const char *)(index.data()+first), n*sizeof(ArchiveEntry));
+   return pwrite(fd, &block, sizeof block, blocks[b])==sizeof block;
+}
+
+bool ArchiveWriter::
+write_header(void)
+{
+   ArchiveHeader header;
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, ARCHIVE_MAGIC, 8);
+   header.index=blocks.empty() ? 0 : blocks[0];
+   header.count=index.size();
+   header.end=end;
+   return pwrite(fd, &header, sizeof header, 0)==sizeof header;
+}
+
+void ArchiveWriter::
+close(void)
+{
+   if(fd>=0) ::close(fd);
+   fd=-1;
+}
@@ -0,0 +1,278 @@
+/**
+ * Frame archives: every frame of a run in one append-only file, instead of a file per frame. The
+ * archive starts with an ArchiveHeader, then holds the frames (raw or compressed, as in frame.h
+ * and codec.h) one after another, each behind an ArchiveRecord with its size and checksum and
+ * padded to FRAME_ALIGN bytes, so the columns of a raw frame stay aligned in a mapped archive.
+ * The index, an ArchiveEntry per frame, is a chain of blocks of ARCHIVE_INDEX_ENTRIES entries
+ * among the frames: the header locates the first block and holds the count of frames and where
+ * the archive's contents end, and each block the next and the checksum of its entries so far.
+ *
+ * A frame is appended at the end, a block before it when the last is full, and then only its
+ * entry, its block's checksum and the header are rewritten, so an append costs the same however
+ * long the archive is. The frame is flushed to the disk before its entry is written, so the
+ * index never holds a frame the disk hasn't. An append cut short by a crash leaves the header
+ * and the index at odds: the reader then rebuilds the index from the records, keeping those that
+ * are whole and match their checksums, so the archive loses at most the frame being appended.
+ *
+ * The reader maps the archive and hands out the frames and the columns of raw frames where they
+ * are in the map, without copying them. Like frame.h it needs only the standard library and
+ * POSIX, so the viewer can include it on its own; the writer is in archive.cpp.
+ */
+
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "frame.h"
+
+#define ARCHIVE_MAGIC "FLIPARC1"
+#define ARCHIVE_RECORD_MAGIC "FLIPREC1"
+#define ARCHIVE_INDEX_MAGIC "FLIPIDX1"
+
+#define ARCHIVE_INDEX_ENTRIES 64 // entries in a block of the index
+
+struct ArchiveHeader{
+   char magic[8];
+   unsigned long long index; // offset of the first block of the index, or 0 before the first frame
+   unsigned long long count; // frames in the index
+   unsigned long long end; // bytes of the archive up to the end of the last frame or index block
+   char reserved[FRAME_ALIGN-32];
+};
+
+/* before each frame */
+struct ArchiveRecord{
+   char magic[8];
+   unsigned long long size; // bytes of the frame, before its padding
+   unsigned long long checksum; // of those bytes
+   char reserved[FRAME_ALIGN-24];
+};
+
+/* a frame in the index */
+struct ArchiveEntry{
+   unsigned long long offset; // of the frame in the archive (after its record)
+   unsigned long long size;
+   int frame;
+   int np;
+   double time;
+   int codec; // of the frame: RAW_FRAME or COMPRESSED_FRAME
+   int keyframe; // compressed frames that decode on their own (raw frames all do)
+};
+
+/* before each block of the index */
+struct ArchiveIndexBlock{
+   char magic[8];
+   unsigned long long next; // offset of the next block, or 0 for the last
+   unsigned long long checksum; // of the block's entries in the index, up to the header's count
+   char reserved[FRAME_ALIGN-24];
+};
+
+#define ARCHIVE_INDEX_BYTES (sizeof(ArchiveIndexBlock)+ARCHIVE_INDEX_ENTRIES*sizeof(ArchiveEntry))
+
+static_assert(sizeof(ArchiveHeader)==FRAME_ALIGN && sizeof(ArchiveRecord)==FRAME_ALIGN
+              && sizeof(ArchiveIndexBlock)==FRAME_ALIGN && ARCHIVE_INDEX_BYTES%FRAME_ALIGN==0,
+              "the archive's blocks keep the frames aligned");
+
+inline unsigned long long archive_checksum(const char *data, size_t size)
+{
+   unsigned long long sum=0xcbf29ce484222325ULL; // FNV-1a, a word at a time
+   size_t words=size/8;
+   for(size_t w=0; w<words; ++w){
+      unsigned long long word;
+      memcpy(&word, data+8*w, 8);
+      sum=(sum^word)*0x100000001b3ULL;
+   }
+   for(size_t b=8*words; b<size; ++b)
+      sum=(sum^(unsigned char)data[b])*0x100000001b3ULL;
+   return sum;
+}
+
+/* bytes a frame of size bytes takes in the archive, with its record and padding */
+inline unsigned long long archive_record_bytes(unsigned long long size)
+{ return sizeof(ArchiveRecord)+(size+FRAME_ALIGN-1)/FRAME_ALIGN*FRAME_ALIGN; }
+
+/* the index entry of a frame of size bytes at offset, from its header */
+inline ArchiveEntry archive_entry(const FrameHeader &header, unsigned long long offset, unsigned long long size)
+{
+   ArchiveEntry entry;
+   memset(&entry, 0, sizeof entry);
+   entry.offset=offset;
+   entry.size=size;
+   entry.frame=header.frame;
+   entry.np=header.np;
+   entry.time=header.time;
+   entry.codec=header.codec;
+   entry.keyframe=(header.codec==RAW_FRAME || header.keyframe);
+   return entry;
+}
+
+/* A mapped archive, read only. */
+struct FrameArchive{
+   std::vector<ArchiveEntry> entries; // the frames in the order they were appended
+   unsigned long long end; // bytes of the archive up to the end of the last whole frame
+   bool recovered; // the index had to be rebuilt from the records
+
+   FrameArchive()
+      :end(0), recovered(false), map(0), length(0)
+   {}
+
+   ~FrameArchive()
+   { close(); }
+
+   /* Maps the archive and reads its index, or rebuilds it if the header or the index is broken. */
+   /* Returns false if the file can't be mapped or isn't an archive. */
+   bool open(const char *filename)
+   {
+      close();
+      int fd=::open(filename, O_RDONLY);
+      if(fd<0) return false;
+      struct stat status;
+      bool ok=fstat(fd, &status)==0 && status.st_size>=(off_t)sizeof(ArchiveHeader);
+      if(ok){
+         length=status.st_size;
+         map=(const char *)mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+         if(map==MAP_FAILED) map=0;
+         ok=(map!=0) && !memcmp(map, ARCHIVE_MAGIC, 8);
+      }
+      ::close(fd);
+      if(!ok){
+         close();
+         return false;
+      }
+      recovered=!read_index();
+      if(recovered) scan();
+      by_frame.clear();
+      for(unsigned int e=0; e<entries.size(); ++e){
+         if(entries[e].frame<0) continue;
+         if(entries[e].frame>=(int)by_frame.size()) by_frame.resize(entries[e].frame+1, -1);
+         by_frame[entries[e].frame]=e; // a frame appended again, after a restart, replaces the first
+      }
+      return true;
+   }
+
+   void close(void)
+   {
+      if(map) munmap((void *)map, length);
+      map=0;
+      length=0;
+      end=0;
+      entries.clear();
+      by_frame.clear();
+   }
+
+   /* the entry of frame number frame, or -1 if the archive hasn't got it */
+   int find(int frame) const
+   { return (frame>=0 && frame<(int)by_frame.size()) ? by_frame[frame] : -1; }
+
+   /* the bytes of entry e: a FrameHeader and the rest of the frame */
+   const char *data(int e) const
+   { return map+entries[e].offset; }
+
+   const FrameHeader &header(int e) const
+   { return *(const FrameHeader *)data(e); }
+
+   /* column c of the raw frame of entry e, np floats, or null if it's compressed, hasn't got it */
+   /* or doesn't fit the entry (the index is only as good as the disk's ordering of the writes) */
+   const float *column(int e, int c) const
+   {
+      const FrameHeader &h=header(e);
+      if(h.codec!=RAW_FRAME || c<0 || c>=h.ncolumns || h.np!=entries[e].np
+         || sizeof h+(c+1)*frame_column_bytes(h.np)>entries[e].size) return 0;
+      return (const float *)(data(e)+sizeof h+c*frame_column_bytes(h.np));
+   }
+
+   private:
+   const char *map;
+   size_t length;
+   std::vector<int> by_frame; // entry of each frame number, or -1
+
+   bool read_index(void)
+   {
+      ArchiveHeader header;
+      memcpy(&header, map, sizeof header);
+      if(header.end<sizeof header || header.end>length || header.count>header.end/sizeof(ArchiveEntry))
+         return false;
+      entries.clear();
+      unsigned long long block=header.index, previous=0;
+      while(entries.size()<header.count){
+         // the blocks only ever follow one another, which also rules out a cycle
+         if(block<=previous || block<sizeof header || block+ARCHIVE_INDEX_BYTES>header.end) return false;
+         ArchiveIndexBlock index;
+         memcpy(&index, map+block, sizeof index);
+         const size_t n=std::min<unsigned long long>(header.count-entries.size(), ARCHIVE_INDEX_ENTRIES);
+         if(memcmp(index.magic, ARCHIVE_INDEX_MAGIC, 8)
+            || archive_checksum(map+block+sizeof index, n*sizeof(ArchiveEntry))!=index.checksum)
+            return false;
+         const size_t first=entries.size();
+         entries.resize(first+n);
+         memcpy(&entries[first], map+block+sizeof index, n*sizeof(ArchiveEntry));
+         previous=block;
+         block=index.next;
+      }
+      for(unsigned int e=0; e<entries.size(); ++e)
+         if(entries[e].offset<sizeof(ArchiveRecord) || entries[e].offset+entries[e].size>header.end
+            || entries[e].size<sizeof(FrameHeader)) return false;
+      end=header.end;
+      return true;
+   }
+
+   /* rebuilds the index from the records, stepping over the index blocks, up to the first */
+   /* record that isn't whole */
+   void scan(void)
+   {
+      entries.clear();
+      unsigned long long at=sizeof(ArchiveHeader);
+      while(at+sizeof(ArchiveRecord)<=length){
+         ArchiveRecord record;
+         memcpy(&record, map+at, sizeof record);
+         if(!memcmp(record.magic, ARCHIVE_INDEX_MAGIC, 8)){
+            if(at+ARCHIVE_INDEX_BYTES>length) break;
+            at+=ARCHIVE_INDEX_BYTES;
+            continue;
+         }
+         if(memcmp(record.magic, ARCHIVE_RECORD_MAGIC, 8) || record.size<sizeof(FrameHeader)
+            || record.size>length-at-sizeof record
+            || archive_checksum(map+at+sizeof record, record.size)!=record.checksum)
+            break;
+         FrameHeader header;
+         memcpy(&header, map+at+sizeof record, sizeof header);
+         entries.push_back(archive_entry(header, at+sizeof record, record.size));
+         at+=archive_record_bytes(record.size);
+      }
+      end=(at<length) ? at : length;
+   }
+};
+
+/* Appends frames to an archive (archive.cpp). Not thread safe: one thread appends at a time. */
+struct ArchiveWriter{
+   ArchiveWriter()
+      :fd(-1), end(0)
+   {}
+
+   ~ArchiveWriter()
+   { close(); }
+
+   bool open(const char *filename, bool append);
+   bool append(const char *data, size_t size);
+   void close(void);
+
+   int frames(void) const
+   { return (int)index.size(); }
+
+   private:
+   int fd;
+   unsigned long long end; // where the next frame or index block goes
+   std::vector<ArchiveEntry> index;
+   std::vector<unsigned long long> blocks; // offsets of the blocks of the index
+
+   bool add_block(void);
+   bool write_block(int b);
+   bool write_header(void);
+};
+
+#endif
@@ -0,0 +1,102 @@
+/**
+ * The Array1 class: a growable 1D array with cache-line aligned storage, used for the
+ * particle columns so that loops over particles vectorize cleanly.
+ */
+
+#ifndef ARRAY1
+#define ARRAY1
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#define ARRAY1_ALIGNMENT 64
+
+#ifdef _WIN32
+#include <malloc.h>
+inline void *aligned_allocate(size_t bytes) { return _aligned_malloc(bytes, ARRAY1_ALIGNMENT); }
+inline void aligned_free(void *memory) { _aligned_free(memory); }
+#else
+inline void *aligned_allocate(size_t bytes)
+{
+   void *memory=0;
+   if(posix_memalign(&memory, ARRAY1_ALIGNMENT, bytes)) return 0;
+   return memory;
+}
+inline void aligned_free(void *memory) { std::free(memory); }
+#endif
+
+template<class T>
+struct Array1{
+   int n, capacity;
+   T *data;
+
+   Array1()
+      :n(0), capacity(0), data(0)
+   {}
+
+   Array1(int n_)
+      :n(0), capacity(0), data(0)
+   { resize(n_); }
+
+   ~Array1()
+   { delete_memory(); }
+
+   // the storage is owned: swap arrays instead of copying them
+   Array1(const Array1 &)=delete;
+   Array1 &operator=(const Array1 &)=delete;
+
+   void delete_memory()
+   {
+      aligned_free(data); data=0;
+      n=capacity=0;
+   }
+
+   void reserve(int capacity_)
+   {
+      if(capacity_<=capacity) return;
+      void *memory=aligned_allocate((size_t)capacity_*sizeof(T));
+      if(!memory) throw std::bad_alloc();
+      if(n) std::memcpy(memory, data, n*sizeof(T));
+      aligned_free(data);
+      data=(T*)memory;
+      capacity=capacity_;
+   }
+
+   void resize(int n_)
+   {
+      if(n_>capacity) reserve(n_>2*capacity ? n_ : 2*capacity);
+      n=n_;
+   }
+
+   void push_back(const T &value)
+   {
+      if(n==capacity) reserve(capacity ? 2*capacity : 64);
+      data[n++]=value;
+   }
+
+   int size() const
+   { return n; }
+
+   void swap(Array1 &a)
+   {
+      int n_=n, capacity_=capacity; T *data_=data;
+      n=a.n; capacity=a.capacity; data=a.data;
+      a.n=n_; a.capacity=capacity_; a.data=data_;
+   }
+
+   const T &operator[] (int i) const
+   { return data[i]; }
+
+   T &operator[] (int i)
+   { return data[i]; }
+
+   void zero()
+   { std::memset(data, 0, n*sizeof(T)); }
+};
+
+typedef Array1<float> Array1f;
+typedef Array1<int> Array1i;
+typedef Array1<unsigned int> Array1ui;
+
+#endif
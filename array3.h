@@ -4,6 +4,7 @@
 #include <cstdio>
 #include <cmath>
 #include <cstring>
+#include <algorithm>
 
 template<class T>
 struct Array3{
@@ -67,7 +68,7 @@ struct Array3{
     }
 
     void zero()
-    { std::memset(data, 0, size*sizeof(T)); }
+    { std::fill(data, data+size, T()); } // a memset for plain numbers, and right for the Vec2f accumulators too
 
     double dot(const Array3 &a) const
     {
@@ -0,0 +1,864 @@
+/**
+ * Microbenchmarks for the simulation kernels. Run with the names of the benchmarks to run,
+ * or with no arguments to run all of them.
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include "grid.h"
+#include "particles.h"
+#include "eikonal.h"
+#include "util.h"
+#include "archive.h"
+#include "checkpoint.h"
+#include "codec.h"
+#include "fields.h"
+#include "output.h"
+#include "scene.h"
+#include "slices.h"
+#include "shared_main.h"
+#include <omp.h>
+
+using namespace std;
+
+static double now_ms(void)
+{
+   return chrono::duration<double, milli>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static float random_float(float lo, float hi)
+{
+   return lo+(hi-lo)*rand()/(float)RAND_MAX;
+}
+
+/* phi as the scalar fast sweeping computes it, one cell at a time in all eight directions, as */
+/* many times as compute_distance_to_fluid sweeps */
+static void reference_distance(const Grid &grid, Array3f &phi)
+{
+   const float large_distance=phi.nx+phi.ny+phi.nz+2;
+   for(int i=0; i<phi.size; ++i)
+      phi.data[i]=large_distance;
+   for(int j=1; j<phi.ny-1; ++j) for(int i=1; i<phi.nx-1; ++i) for(int k=0; k<phi.nz-1; ++k)
+      if(grid.marker(i,j,k)==FLUIDCELL) phi(i,j,k)=-0.5f;
+   for(int sweep=0; sweep<8; ++sweep)
+      for(int dk=-1; dk<=1; dk+=2) for(int dj=-1; dj<=1; dj+=2) for(int di=-1; di<=1; di+=2){
+         int i0=(di>0) ? 1 : phi.nx-2, i1=(di>0) ? phi.nx : -1;
+         int j0=(dj>0) ? 1 : phi.ny-2, j1=(dj>0) ? phi.ny : -1;
+         int k0=(dk>0) ? 1 : phi.nz-2, k1=(dk>0) ? phi.nz : -1;
+         for(int j=j0; j!=j1; j+=dj) for(int i=i0; i!=i1; i+=di) for(int k=k0; k!=k1; k+=dk)
+            if(grid.marker(i,j,k)!=FLUIDCELL)
+               solve_distance(phi(i-di,j,k), phi(i,j-dj,k), phi(i,j,k-dk), phi(i,j,k));
+      }
+}
+
+/* scalar solve_distance against the branch-free row kernel, over rows of typical grid width, and */
+/* compute_distance_to_fluid against the scalar sweeping everywhere outside the fluid */
+static void bench_eikonal(void)
+{
+   const int n=64, rows=4096, reps=200;
+   vector<float> p(n*rows), q(n*rows), t(n*rows), r0(n*rows), r(n*rows), rs(n*rows);
+   vector<char> marker(n*rows);
+   for(int i=0; i<n*rows; ++i){
+      p[i]=random_float(0, 10);
+      q[i]=random_float(0, 10);
+      t[i]=random_float(0, 10);
+      r0[i]=random_float(0, 12);
+      marker[i]=(rand()%10==0) ? FLUIDCELL : AIRCELL;
+   }
+
+   double start=now_ms();
+   for(int rep=0; rep<reps; ++rep){
+      memcpy(&rs[0], &r0[0], n*rows*sizeof(float));
+      for(int i=0; i<n*rows; ++i)
+         if(marker[i]!=FLUIDCELL)
+            solve_distance(p[i], q[i], t[i], rs[i]);
+   }
+   double scalar=now_ms()-start;
+
+   start=now_ms();
+   for(int rep=0; rep<reps; ++rep){
+      memcpy(&r[0], &r0[0], n*rows*sizeof(float));
+      for(int row=0; row<rows; ++row)
+         solve_distance_row(&p[row*n], &q[row*n], &t[row*n], &marker[row*n], FLUIDCELL, &r[row*n], n);
+   }
+   double simd=now_ms()-start;
+
+   float maxdiff=0;
+   for(int i=0; i<n*rows; ++i)
+      maxdiff=max(maxdiff, fabs(r[i]-rs[i]));
+   double cells=(double)n*rows*reps;
+   printf("eikonal: scalar %.3f ns/cell, row %.3f ns/cell (%.2fx), max difference %g\n",
+          1e6*scalar/cells, 1e6*simd/cells, scalar/simd, maxdiff);
+
+   Grid grid(9.8, 100, 100, 100, 1);
+   for(int k=0; k<grid.marker.nz; ++k) for(int j=0; j<grid.marker.ny; ++j) for(int i=0; i<grid.marker.nx; ++i)
+      if(sqr(i-50)+sqr(j-30)+sqr(k-50)<sqr(20) || j<10) grid.marker(i,j,k)=FLUIDCELL;
+   start=now_ms();
+   grid.compute_distance_to_fluid();
+   printf("eikonal: compute_distance_to_fluid on 100^3 takes %.2f ms\n", now_ms()-start);
+   Array3f reference(grid.phi.nx, grid.phi.ny, grid.phi.nz);
+   start=now_ms();
+   reference_distance(grid, reference);
+   const double scalar_sweeping=now_ms()-start;
+   float far=0;
+   maxdiff=0;
+   for(int i=0; i<reference.size; ++i){
+      maxdiff=max(maxdiff, fabs(grid.phi.data[i]-reference.data[i]));
+      far=max(far, reference.data[i]);
+   }
+   printf("eikonal: the scalar sweeping takes %.2f ms; largest difference from it %g cells, out to %g cells from the fluid, %s\n",
+          scalar_sweeping, maxdiff, far, maxdiff<1e-3f ? "the same" : "DIFFERENT");
+}
+
+/* per-component bary_x/bary_x_centre and Array3::trilerp against the staggered batch sampler */
+static void bench_sampler(void)
+{
+   const int n=1<<16, reps=50;
+   Grid grid(9.8, 64, 64, 64, 1);
+   for(int i=0; i<grid.u.size; ++i) grid.u.data[i]=random_float(-1, 1);
+   for(int i=0; i<grid.v.size; ++i) grid.v.data[i]=random_float(-1, 1);
+   for(int i=0; i<grid.w.size; ++i) grid.w.data[i]=random_float(-1, 1);
+   vector<float> x(n), y(n), z(n), pu(n), pv(n), pw(n), su(n), sv(n), sw(n);
+   for(int p=0; p<n; ++p){
+      x[p]=random_float(1.001*grid.h, grid.lx-1.001*grid.h);
+      y[p]=random_float(1.001*grid.h, grid.ly-1.001*grid.h);
+      z[p]=random_float(1.001*grid.h, grid.lz-1.001*grid.h);
+   }
+
+   double start=now_ms();
+   for(int rep=0; rep<reps; ++rep){
+      for(int p=0; p<n; ++p){
+         int i, j, k;
+         float fx, fy, fz;
+         grid.bary_x(x[p], i, fx); grid.bary_y_centre(y[p], j, fy); grid.bary_z_centre(z[p], k, fz);
+         su[p]=grid.u.trilerp(i, j, k, fx, fy, fz);
+         grid.bary_x_centre(x[p], i, fx); grid.bary_y(y[p], j, fy); grid.bary_z_centre(z[p], k, fz);
+         sv[p]=grid.v.trilerp(i, j, k, fx, fy, fz);
+         grid.bary_x_centre(x[p], i, fx); grid.bary_y_centre(y[p], j, fy); grid.bary_z(z[p], k, fz);
+         sw[p]=grid.w.trilerp(i, j, k, fx, fy, fz);
+      }
+   }
+   double separate=now_ms()-start;
+
+   start=now_ms();
+   for(int rep=0; rep<reps; ++rep)
+      grid.sample_staggered_batch(grid.u, grid.v, grid.w, &x[0], &y[0], &z[0], n, &pu[0], &pv[0], &pw[0]);
+   double batch=now_ms()-start;
+
+   float maxdiff=0;
+   for(int p=0; p<n; ++p)
+      maxdiff=max(maxdiff, max(fabs(pu[p]-su[p]), max(fabs(pv[p]-sv[p]), fabs(pw[p]-sw[p]))));
+   double points=(double)n*reps;
+   printf("sampler: per component %.3f ns/point, staggered batch %.3f ns/point (%.2fx), max difference %g\n",
+          1e6*separate/points, 1e6*batch/points, separate/batch, maxdiff);
+}
+
+/* fills a 64^3 grid's middle with 8 particles per cell, random velocities and C, sorted by cell */
+static void init_transfer_scene(Particles &particles)
+{
+   Grid &grid=particles.grid;
+   for(int k=16; k<48; ++k) for(int j=8; j<40; ++j) for(int i=16; i<48; ++i)
+      for(int q=0; q<8; ++q){
+         Vec3f x((i+random_float(0, 1))*grid.h, (j+random_float(0, 1))*grid.h, (k+random_float(0, 1))*grid.h);
+         particles.add_particle(x, Vec3f(random_float(-1, 1), random_float(-1, 1), random_float(-1, 1)));
+      }
+   if(particles.simType==APIC){
+      for(int a=0; a<9; ++a)
+         for(int p=0; p<particles.np; ++p)
+            particles.c[a][p]=random_float(-0.1f, 0.1f);
+   }
+   particles.sort_by_cell();
+}
+
+/* throughput of the particle to grid and grid to particle transfers for each scheme */
+static void bench_transfer(void)
+{
+   const char *names[3]={"PIC", "FLIP", "APIC"};
+   const SimulationType types[3]={PIC, FLIP, APIC};
+   const int reps=10;
+   for(int t=0; t<3; ++t){
+      Grid grid(9.8, 64, 64, 64, 1);
+      Particles particles(grid, types[t]);
+      grid.track_velocity_change(types[t]==FLIP);
+      srand(1);
+      init_transfer_scene(particles);
+      double p2g=1e30, g2p=1e30;
+      for(int rep=0; rep<reps; ++rep){
+         double start=now_ms();
+         particles.transfer_to_grid();
+         p2g=min(p2g, now_ms()-start);
+         grid.save_velocities();
+         start=now_ms();
+         particles.update_from_grid();
+         g2p=min(g2p, now_ms()-start);
+      }
+      printf("transfer: %-4s %d particles, P2G %.2f ms (%.1f M particles/s), G2P %.2f ms (%.1f M particles/s)\n",
+             names[t], particles.np, p2g, 1e-3*particles.np/p2g, g2p, 1e-3*particles.np/g2p);
+   }
+}
+
+/* APIC transfers with each kernel: the linear kernel's numbers should match the transfer benchmark's */
+static void bench_kernels(void)
+{
+   const char *names[3]={"linear", "quadratic", "cubic"};
+   const TransferKernel kernels[3]={LINEAR_KERNEL, QUADRATIC_KERNEL, CUBIC_KERNEL};
+   const int reps=10;
+   for(int t=0; t<3; ++t){
+      Grid grid(9.8, 64, 64, 64, 1);
+      Particles particles(grid, APIC);
+      particles.kernel=kernels[t];
+      srand(1);
+      init_transfer_scene(particles);
+      double p2g=1e30, g2p=1e30;
+      for(int rep=0; rep<reps; ++rep){
+         double start=now_ms();
+         particles.transfer_to_grid();
+         p2g=min(p2g, now_ms()-start);
+         start=now_ms();
+         particles.update_from_grid();
+         g2p=min(g2p, now_ms()-start);
+      }
+      printf("kernels: %-9s %2d nodes per component, P2G %.2f ms (%.1f M particles/s), G2P %.2f ms (%.1f M particles/s)\n",
+             names[t], (t+2)*(t+2)*(t+2), p2g, 1e-3*particles.np/p2g, g2p, 1e-3*particles.np/g2p);
+   }
+}
+
+/* APIC through the staggered transfers against the MLS engine, with the linear and quadratic */
+/* kernels; the MLS times include its conversions between the faces and the cell centres */
+static void bench_mls(void)
+{
+   const char *names[2]={"staggered", "MLS"};
+   const TransferEngine engines[2]={STAGGERED_ENGINE, MLS_ENGINE};
+   const TransferKernel kernels[2]={LINEAR_KERNEL, QUADRATIC_KERNEL};
+   const int reps=10;
+   for(int t=0; t<2; ++t) for(int e=0; e<2; ++e){
+      Grid grid(9.8, 64, 64, 64, 1);
+      Particles particles(grid, APIC);
+      particles.kernel=kernels[t];
+      particles.engine=engines[e];
+      srand(1);
+      init_transfer_scene(particles);
+      double p2g=1e30, g2p=1e30;
+      for(int rep=0; rep<reps; ++rep){
+         double start=now_ms();
+         particles.transfer_to_grid();
+         p2g=min(p2g, now_ms()-start);
+         start=now_ms();
+         particles.update_from_grid();
+         g2p=min(g2p, now_ms()-start);
+      }
+      printf("mls: %-9s %-9s P2G %.2f ms (%.1f M particles/s), G2P %.2f ms (%.1f M particles/s)\n",
+             t ? "quadratic" : "linear", names[e], p2g, 1e-3*particles.np/p2g, g2p, 1e-3*particles.np/g2p);
+   }
+}
+
+/* fused G2P and advection in calm water with a jet through it: every particle taking the five */
+/* substeps, against adaptive substeps, each sampling the grid at every stage and through local */
+/* affine models (with how far the latter end up from the sampled paths) */
+static void bench_advection(void)
+{
+   const char *names[4]={"fixed", "fixed affine", "adaptive", "adaptive affine"};
+   const int reps=10;
+   Array1f sampled[4];
+   for(int mode=0; mode<4; ++mode){
+      Grid grid(9.8, 64, 64, 64, 1);
+      Particles particles(grid, PIC);
+      srand(1);
+      init_transfer_scene(particles);
+      for(int k=0; k<grid.u.nz; ++k) for(int j=0; j<grid.u.ny; ++j) for(int i=0; i<grid.u.nx; ++i){
+         float r2=sqr(j-24)+sqr(k-32);
+         grid.u(i,j,k)=0.05f+2.f*exp(-r2/16); // a jet along x
+      }
+      for(int i=0; i<grid.v.size; ++i) grid.v.data[i]=0.02f;
+      for(int i=0; i<grid.w.size; ++i) grid.w.data[i]=-0.02f;
+      if(mode<2) particles.substep_cfl=particles.substep_tolerance=1e-6f; // always the most substeps
+      particles.affine_advection=(mode&1);
+      const float dt=grid.h; // the jet crosses two cells per step
+      double best=1e30;
+      Array1f x0(particles.np), y0(particles.np), z0(particles.np);
+      memcpy(x0.data, particles.px.data, particles.np*sizeof(float));
+      memcpy(y0.data, particles.py.data, particles.np*sizeof(float));
+      memcpy(z0.data, particles.pz.data, particles.np*sizeof(float));
+      for(int rep=0; rep<reps; ++rep){
+         memcpy(particles.px.data, x0.data, particles.np*sizeof(float));
+         memcpy(particles.py.data, y0.data, particles.np*sizeof(float));
+         memcpy(particles.pz.data, z0.data, particles.np*sizeof(float));
+         double start=now_ms();
+         particles.update_and_move(dt, 5);
+         best=min(best, now_ms()-start);
+      }
+      printf("advection: %-15s %.2f ms, ", names[mode], best);
+      particles.report_substeps();
+      Array1f *columns[3]={&particles.px, &particles.py, &particles.pz};
+      sampled[mode].resize(3*particles.np);
+      for(int a=0; a<3; ++a)
+         memcpy(&sampled[mode][a*particles.np], columns[a]->data, particles.np*sizeof(float));
+      if(mode&1){
+         float maxdiff=0;
+         for(int i=0; i<sampled[mode].n; ++i)
+            maxdiff=max(maxdiff, fabs(sampled[mode][i]-sampled[mode-1][i]));
+         printf("advection: %s paths end at most %g cells from the sampled ones\n", names[mode], maxdiff*grid.overh);
+      }
+   }
+}
+
+/* the original init_water_drop's projection, through the program's scalar evaluation */
+static void project_serial(const SdfProgram &program, float &x, float &y, float &z, float current, float target)
+{
+   float dpdx=(program.evaluate(x+1e-4, y, z)-program.evaluate(x-1e-4, y, z))/2e-4;
+   float dpdy=(program.evaluate(x, y+1e-4, z)-program.evaluate(x, y-1e-4, z))/2e-4;
+   float dpdz=(program.evaluate(x, y, z+1e-4)-program.evaluate(x, y, z-1e-4))/2e-4;
+   float scale=(target-current)/sqrt(dpdx*dpdx+dpdy*dpdy+dpdz*dpdz);
+   x+=scale*dpdx;
+   y+=scale*dpdy;
+   z+=scale*dpdz;
+}
+
+/* the original init_water_drop: serial, with rand(), a phi evaluation and add_particle per sample */
+static void seed_serial(const SdfProgram &program, Grid &grid, Particles &particles, int na, int nb, int nc)
+{
+   for(int i=1; i<grid.marker.nx-1; ++i) for(int j=1; j<grid.marker.ny-1; ++j) for(int k=1; k<grid.marker.nz-1; ++k)
+      for(int a=0; a<na; ++a) for(int b=0; b<nb; ++b) for(int c=0; c<nc; ++c){
+         float x=(i+(a+0.1+0.8*rand()/(double)RAND_MAX)/na)*grid.h;
+         float y=(j+(b+0.1+0.8*rand()/(double)RAND_MAX)/nb)*grid.h;
+         float z=(k+(c+0.1+0.8*rand()/(double)RAND_MAX)/nc)*grid.h;
+         float phi=program.evaluate(x, y, z);
+         if(phi>-0.25*grid.h/na)
+            continue;
+         else if(phi>-1.5*grid.h/na){
+            project_serial(program, x, y, z, phi, -0.75*grid.h/na);
+            phi=program.evaluate(x, y, z);
+            project_serial(program, x, y, z, phi, -0.75*grid.h/na);
+         }
+         particles.add_particle(Vec3f(x, y, z), Vec3f(0, 0, 0));
+      }
+}
+
+/* the initial seeding of the simulation's default scene on a 128^3 grid, serial against */
+/* Scene::seed_particles, and whether the latter's particles are the same on one thread and on */
+/* four; then a scene with solids, voxelized and seeded, and a round trip through the cache */
+static void bench_seeding(void)
+{
+   Grid grid(9.8, 128, 128, 128, 1);
+   Scene scene;
+   scene.parse(DEFAULT_SCENE, "the default scene");
+   Particles serial(grid, APIC), seeded(grid, APIC), single(grid, APIC);
+   double start=now_ms();
+   seed_serial(scene.seeded, grid, serial, 2, 2, 2);
+   double before=now_ms()-start;
+   start=now_ms();
+   scene.seed_particles(grid, seeded, 2, 2, 2, INIT_SEED);
+   double after=now_ms()-start;
+
+   int threads=omp_get_max_threads();
+   omp_set_num_threads(1);
+   scene.seed_particles(grid, single, 2, 2, 2, INIT_SEED);
+   omp_set_num_threads(4);
+   Particles four(grid, APIC);
+   scene.seed_particles(grid, four, 2, 2, 2, INIT_SEED);
+   omp_set_num_threads(threads);
+   bool same=(single.np==four.np);
+   for(int p=0; same && p<four.np; ++p)
+      same=(single.px[p]==four.px[p] && single.py[p]==four.py[p] && single.pz[p]==four.pz[p]);
+   printf("seeding: serial %.1f ms (%d particles), seed_particles %.1f ms (%d particles, %.1fx), %s on 1 and 4 threads\n",
+          before, serial.np, after, seeded.np, before/after, same ? "identical" : "DIFFERENT");
+
+   Scene obstacles;
+   obstacles.parse("fluid\n"
+                   "box 0 0 0 0.4 0.8 1\n"
+                   "plane 0 1 0 0.1\n"
+                   "solid\n"
+                   "sphere 0.6 0.3 0.5 0.12\n"
+                   "box 0.75 -1 0.2 0.85 0.5 0.8\n"
+                   "cylinder x 0.3 0.5 0.08\n"
+                   "subtract\n", "obstacles");
+   Particles dam(grid, APIC);
+   start=now_ms();
+   obstacles.voxelize_solid(grid);
+   double voxelize=now_ms()-start;
+   start=now_ms();
+   obstacles.seed_particles(grid, dam, 2, 2, 2, INIT_SEED);
+   double seed=now_ms()-start;
+
+   const char *directory="bench_scene_cache";
+   start=now_ms();
+   bool written=write_initial_state(directory, obstacles.hash(), grid, dam);
+   double write=now_ms()-start;
+   Grid cached_grid(9.8, 128, 128, 128, 1);
+   Particles cached(cached_grid, APIC);
+   start=now_ms();
+   bool read=read_initial_state(directory, obstacles.hash(), cached_grid, cached);
+   double load=now_ms()-start;
+   bool restored=written && read && cached.np==dam.np && cached_grid.solid_cells==grid.solid_cells
+                 && !memcmp(cached.px.data, dam.px.data, dam.np*sizeof(float))
+                 && !memcmp(cached_grid.solid.data, grid.solid.data, grid.solid.size);
+   printf("seeding: obstacles voxelized in %.1f ms (%d solid cells), seeded in %.1f ms (%d particles); "
+          "cache written in %.1f ms, read in %.1f ms, %s\n", voxelize, grid.solid_cells, seed, dam.np,
+          write, load, restored ? "identical" : "DIFFERENT");
+}
+
+/* writing a frame of APIC particles: the text export (x and y only) against the binary frame of */
+/* every column, which is read back to check it */
+static void bench_frames(void)
+{
+   Grid grid(9.8, 64, 64, 64, 1);
+   Particles particles(grid, APIC);
+   srand(1);
+   init_transfer_scene(particles);
+   const int reps=5;
+   double text=1e30, binary=1e30;
+   for(int rep=0; rep<reps; ++rep){
+      double start=now_ms();
+      particles.write_to_file("bench_frame.txt");
+      text=min(text, now_ms()-start);
+      start=now_ms();
+      particles.write_frame(0, 0, "bench_frame.bin");
+      binary=min(binary, now_ms()-start);
+   }
+
+   FrameHeader header;
+   vector<float> read[PARTICLE_COLUMNS];
+   vector<float> *columns[PARTICLE_COLUMNS];
+   for(int a=0; a<PARTICLE_COLUMNS; ++a)
+      columns[a]=&read[a];
+   bool same=read_frame_file("bench_frame.bin", header, columns, particles.ncolumns) && header.np==particles.np;
+   for(int a=0; same && a<particles.ncolumns; ++a)
+      same=!memcmp(read[a].data(), particles.columns[a]->data, particles.np*sizeof(float));
+   remove("bench_frame.txt");
+   remove("bench_frame.bin");
+   printf("frames: %d particles, text %.1f ms (2 columns), binary %.1f ms (%d columns, %.0f MB/s, %.1fx), %s when read back\n",
+          particles.np, text, binary, particles.ncolumns, 1e-3*particles.ncolumns*frame_column_bytes(particles.np)/binary,
+          text/binary, same ? "identical" : "DIFFERENT");
+}
+
+/* ten frames of APIC transfers each followed by writing the frame, synchronously and through */
+/* the asynchronous writer: the total and the time the frames held up the simulation */
+static void bench_output(void)
+{
+   Grid grid(9.8, 64, 64, 64, 1);
+   Particles particles(grid, APIC);
+   srand(1);
+   init_transfer_scene(particles);
+   const int frames=10;
+   for(int async=0; async<2; ++async){
+      AsyncWriter *writer=async ? new AsyncWriter(2) : 0;
+      double held=0, start=now_ms();
+      for(int f=0; f<frames; ++f){
+         for(int step=0; step<3; ++step){
+            particles.transfer_to_grid();
+            particles.update_from_grid();
+         }
+         double before=now_ms();
+         if(writer){
+            OutputBuffer *buffer=writer->acquire();
+            buffer->filename="bench_output.bin";
+            particles.snapshot_frame(buffer->data, f, f/30.);
+            writer->submit(buffer);
+         }else
+            particles.write_frame(f, f/30., "bench_output.bin");
+         held+=now_ms()-before;
+      }
+      double waited=writer ? writer->waited_ms : 0;
+      delete writer;
+      double total=now_ms()-start;
+      printf("output: %s, %d frames of %d particles in %.1f ms, held up %.2f ms per frame (%.2f ms waiting for the writer)\n",
+             async ? "asynchronous" : "synchronous", frames, particles.np, total, held/frames, waited/frames);
+   }
+   remove("bench_output.bin");
+}
+
+/* the default scene simulated with APIC on the simulation's 50^3 grid for 30 frames, each */
+/* compressed and decoded: the compressed size against the raw frame of the positions and */
+/* velocities and of every column, the time to encode against writing a raw frame, and the */
+/* largest decoding error in quantization steps, which must stay within half a step and half an */
+/* ulp of the value (the bound codec.h gives) */
+static void bench_codec(void)
+{
+   Grid grid(9.8, 50, 50, 50, 1);
+   Particles particles(grid, APIC);
+   particles.sort_interval=SORT_INTERVAL;
+   particles.sort_locality_threshold=SORT_LOCALITY_THRESHOLD;
+   Scene scene;
+   scene.parse(DEFAULT_SCENE, "the default scene");
+   scene.voxelize_solid(grid);
+   scene.seed_particles(grid, particles, 2, 2, 2, INIT_SEED);
+   const int frames=30;
+   const double frame_time=1./30;
+   FrameEncoder encoder(FRAME_PRECISION, FRAME_VELOCITY_STEP, frame_time, FRAME_KEYFRAME_INTERVAL);
+   FrameDecoder decoder;
+   vector<char> data;
+   vector<float> decoded[CODEC_STREAMS];
+   vector<float> *columns[CODEC_STREAMS];
+   for(int s=0; s<CODEC_STREAMS; ++s)
+      columns[s]=&decoded[s];
+   const Array1f *truth[CODEC_STREAMS]={&particles.px, &particles.py, &particles.pz, &particles.vx, &particles.vy, &particles.vz};
+   double encode=0, raw=0, compressed=0, position_error=0, velocity_error=0;
+   int keyframes=0;
+   bool ok=true;
+   for(int f=0; f<frames; ++f){
+      for(double t=0; t<frame_time; ){
+         double dt=min((double)(2*grid.CFL()), frame_time-t);
+         advance_one_step(grid, particles, dt);
+         t+=dt;
+      }
+      double start=now_ms();
+      particles.write_frame(f, f*frame_time, "bench_codec.bin");
+      raw+=now_ms()-start;
+      start=now_ms();
+      encoder.encode(particles, f, f*frame_time, data);
+      encode+=now_ms()-start;
+      compressed+=data.size();
+      ok=ok && decoder.decode(data.data(), data.size(), columns) && decoder.header.np==particles.np;
+      keyframes+=decoder.header.keyframe;
+      for(int s=0; ok && s<CODEC_STREAMS; ++s){
+         const float step=(s<3 ? decoder.header.quantum : decoder.header.velocity_quantum);
+         double &error=(s<3 ? position_error : velocity_error);
+         for(int p=0; p<particles.np; ++p){
+            double off=fabs(decoded[s][p]-(*truth[s])[p]);
+            error=max(error, off/step);
+            if(off>0.5*step+0.5*fabs((*truth[s])[p])*FLT_EPSILON) ok=false;
+         }
+      }
+   }
+   remove("bench_codec.bin");
+   compressed/=frames;
+   printf("codec: %d particles, %.0f bytes a frame (%d keyframes in %d), %.1fx smaller than the 6 raw columns, "
+          "%.1fx smaller than all %d; encoding %.2f ms a frame against %.2f ms for writing a raw one\n",
+          particles.np, compressed, keyframes, frames, 6*frame_column_bytes(particles.np)/compressed,
+          particles.ncolumns*frame_column_bytes(particles.np)/compressed, particles.ncolumns, encode/frames, raw/frames);
+   printf("codec: largest error %.4f position steps (%g) and %.4f velocity steps (%g), %s\n",
+          position_error, FRAME_PRECISION*grid.h, velocity_error, FRAME_VELOCITY_STEP*FRAME_PRECISION*grid.h/frame_time,
+          ok ? "within half a step and the float rounding" : "OUT OF BOUNDS");
+}
+
+/* a hundred frames of FLIP particles appended to an archive against written a file each, then */
+/* read back in a random order, through the archive's map against opening each file; and an */
+/* archive cut short in its last frame, which must come back with the frames before it */
+static void bench_archive(void)
+{
+   Grid grid(9.8, 32, 32, 32, 1);
+   Particles particles(grid, FLIP);
+   srand(1);
+   const int frames=100, first=particles.add_particles(32768);
+   for(int p=first; p<particles.np; ++p){
+      particles.px[p]=random_float(0.1f, 0.9f);
+      particles.py[p]=random_float(0.1f, 0.9f);
+      particles.pz[p]=random_float(0.1f, 0.9f);
+   }
+   vector<char> data;
+   ArchiveWriter writer;
+   double appended=0, files=0;
+   bool ok=writer.open("bench_archive.archive", false);
+   for(int f=0; f<frames && ok; ++f){
+      particles.px[0]=f; // tells the frames apart when they're read back
+      double start=now_ms();
+      particles.snapshot_frame(data, f, f/30.);
+      ok=writer.append(data.data(), data.size());
+      appended+=now_ms()-start;
+      char name[64];
+      snprintf(name, sizeof name, "bench_archive%04d.bin", f);
+      start=now_ms();
+      particles.write_frame(f, f/30., name);
+      files+=now_ms()-start;
+   }
+   writer.close();
+
+   vector<int> order(frames);
+   for(int f=0; f<frames; ++f)
+      order[f]=rand()%frames;
+   FrameArchive archive;
+   double start=now_ms();
+   ok=ok && archive.open("bench_archive.archive") && (int)archive.entries.size()==frames;
+   double opened=now_ms()-start, sum=0, file_sum=0;
+   start=now_ms();
+   for(int f=0; f<frames && ok; ++f){
+      int e=archive.find(order[f]);
+      const float *px=archive.column(e, 0), *py=archive.column(e, 1);
+      ok=(px[0]==order[f]);
+      for(int p=0; p<archive.entries[e].np; ++p)
+         sum+=px[p]+py[p];
+   }
+   double mapped=now_ms()-start;
+   start=now_ms();
+   for(int f=0; f<frames && ok; ++f){
+      char name[64];
+      snprintf(name, sizeof name, "bench_archive%04d.bin", order[f]);
+      FrameHeader header;
+      vector<float> px, py;
+      vector<float> *columns[2]={&px, &py};
+      ok=read_frame_file(name, header, columns, 2) && px[0]==order[f];
+      for(int p=0; p<header.np; ++p)
+         file_sum+=px[p]+py[p];
+   }
+   double opening=now_ms()-start;
+   archive.close();
+
+   // a crash in the middle of appending the last frame: cut the archive off there
+   struct stat status;
+   stat("bench_archive.archive", &status);
+   truncate("bench_archive.archive", status.st_size-data.size()/2);
+   bool recovered=archive.open("bench_archive.archive") && archive.recovered && (int)archive.entries.size()==frames-1;
+   archive.close();
+   recovered=recovered && writer.open("bench_archive.archive", true) && writer.frames()==frames-1
+             && writer.append(data.data(), data.size());
+   writer.close();
+   recovered=recovered && archive.open("bench_archive.archive") && !archive.recovered
+             && (int)archive.entries.size()==frames && archive.column(frames-1, 0)[0]==frames-1;
+   archive.close();
+   remove("bench_archive.archive");
+   for(int f=0; f<frames; ++f){
+      char name[64];
+      snprintf(name, sizeof name, "bench_archive%04d.bin", f);
+      remove(name);
+   }
+   printf("archive: %d frames of %d particles appended in %.2f ms each (synced) against %.2f ms for a file each; "
+          "opened in %.3f ms, random frames read in %.3f ms each mapped against %.3f ms from their files, %s\n",
+          frames, particles.np, appended/frames, files/frames, opened, mapped/frames, opening/frames,
+          ok && sum==file_sum ? "identical" : "DIFFERENT");
+   printf("archive: cut short in its last frame, %s\n", recovered ? "recovered the frames before it and appended again" : "NOT RECOVERED");
+}
+
+/* a checkpoint of two million APIC particles on a 64^3 grid, written and restored into a fresh */
+/* grid and particles, which must come back identical */
+static void bench_checkpoint(void)
+{
+   Grid grid(9.8, 64, 64, 64, 1);
+   Particles particles(grid, APIC);
+   particles.add_particles(1<<21);
+   for(int a=0; a<particles.ncolumns; ++a)
+      for(int p=0; p<particles.np; ++p)
+         (*particles.columns[a])[p]=p*0.001f+a;
+   for(int c=0; c<grid.u.size; ++c)
+      grid.u.data[c]=c*0.01f;
+   particles.steps_since_sort=7;
+   double start=now_ms();
+   bool ok=write_checkpoint("bench_checkpoint.state", grid, particles, 12, 0.4);
+   double write=now_ms()-start;
+
+   Grid restored_grid(9.8, 64, 64, 64, 1);
+   Particles restored(restored_grid, APIC);
+   CheckpointHeader header;
+   start=now_ms();
+   ok=ok && read_checkpoint("bench_checkpoint.state", restored_grid, restored, header);
+   double read=now_ms()-start;
+   ok=ok && header.frame==12 && restored.np==particles.np && restored.steps_since_sort==7
+        && !memcmp(restored_grid.u.data, grid.u.data, grid.u.size*sizeof(float));
+   for(int a=0; ok && a<particles.ncolumns; ++a)
+      ok=!memcmp(restored.columns[a]->data, particles.columns[a]->data, particles.np*sizeof(float));
+   const double megabytes=1e-6*particles.ncolumns*particles.np*sizeof(float);
+   remove("bench_checkpoint.state");
+   printf("checkpoint: %d particles (%.0f MB), written in %.1f ms (%.0f MB/s), restored in %.1f ms (%.0f MB/s), %s\n",
+          particles.np, megabytes, write, 1e3*megabytes/write, read, 1e3*megabytes/read, ok ? "identical" : "DIFFERENT");
+}
+
+/* the same checkpoint written in place against through a forked snapshot, with the particles */
+/* all changed while the snapshot is written, so each of their pages is copied */
+static void bench_fork(void)
+{
+   Grid grid(9.8, 64, 64, 64, 1);
+   Particles particles(grid, APIC);
+   particles.add_particles(1<<21);
+   for(int a=0; a<particles.ncolumns; ++a)
+      for(int p=0; p<particles.np; ++p)
+         (*particles.columns[a])[p]=p*0.001f+a;
+   double start=now_ms();
+   write_checkpoint("bench_fork.state", grid, particles, 1, 0);
+   double in_place=now_ms()-start;
+
+   ForkCheckpointer checkpointer(2, 1.5f);
+   start=now_ms();
+   bool ok=checkpointer.checkpoint("bench_fork.state", grid, particles, 2, 0);
+   double held=now_ms()-start;
+   for(int a=0; a<particles.ncolumns; ++a)
+      for(int p=0; p<particles.np; ++p)
+         (*particles.columns[a])[p]+=1;
+   checkpointer.finish();
+   CheckpointHeader header;
+   ok=ok && read_checkpoint_header("bench_fork.state", header) && header.frame==2;
+   remove("bench_fork.state");
+   printf("fork: checkpoint of %d particles held up the simulation %.1f ms in place, %.1f ms forked, %s\n",
+          particles.np, in_place, held, ok ? "written" : "NOT WRITTEN");
+}
+
+/* a dump of every field of the default scene after its fluid has fallen for 20 frames, against */
+/* the dense fields as floats, and each field read back, which must match the grid wherever the */
+/* dump has the block and have every block with fluid in it. The run extrapolates like the */
+/* simulation, by BFS, so the dumped phi must have been computed for it: negative in the fluid */
+/* and positive in the air next to it. */
+static void bench_fields(void)
+{
+   Grid grid(9.8, 50, 50, 50, 1);
+   grid.extrapolation=EXTRAPOLATION_TYPE;
+   grid.extrapolation_layers=EXTRAPOLATION_LAYERS;
+   Particles particles(grid, APIC);
+   Scene scene;
+   scene.parse(DEFAULT_SCENE, "the default scene");
+   scene.voxelize_solid(grid);
+   scene.seed_particles(grid, particles, 2, 2, 2, INIT_SEED);
+   for(int f=0; f<20; ++f)
+      advance_one_frame(grid, particles, 1./30);
+   const int fields=FIELD_U | FIELD_V | FIELD_W | FIELD_PRESSURE | FIELD_PHI | FIELD_MARKER;
+   update_phi_for(grid, fields);
+   FieldEncoder encoder;
+   vector<char> data;
+   encoder.encode(grid, fields, 20, 20/30., data);
+   const int repeats=20;
+   double start=now_ms();
+   for(int r=0; r<repeats; ++r)
+      encoder.encode(grid, fields, 20, 20/30., data);
+   double encode=(now_ms()-start)/repeats;
+   const double dense=sizeof(float)*(double)(grid.u.size+grid.v.size+grid.w.size+grid.pressure.size+grid.phi.size+grid.marker.size);
+
+   const GridField order[FIELD_COUNT]={FIELD_U, FIELD_V, FIELD_W, FIELD_PRESSURE, FIELD_PHI, FIELD_MARKER};
+   bool ok=true;
+   Array3f values;
+   for(int f=0; f<FIELD_COUNT; ++f){
+      ok=ok && read_field(data.data(), data.size(), order[f], values, NAN);
+      for(int k=0; ok && k<values.nz; ++k) for(int j=0; j<values.ny; ++j) for(int i=0; i<values.nx; ++i){
+         float truth;
+         switch(order[f]){
+            case FIELD_U: truth=grid.u(i, j, k); break;
+            case FIELD_V: truth=grid.v(i, j, k); break;
+            case FIELD_W: truth=grid.w(i, j, k); break;
+            case FIELD_PRESSURE: truth=(float)grid.pressure(i, j, k); break;
+            case FIELD_PHI: truth=grid.phi(i, j, k); break;
+            default: truth=grid.marker(i, j, k);
+         }
+         const bool fluid=(i<grid.marker.nx && j<grid.marker.ny && k<grid.marker.nz && grid.marker(i, j, k)==FLUIDCELL);
+         if(isnan(values(i, j, k)) ? fluid : values(i, j, k)!=truth) ok=false;
+      }
+   }
+   // the dumped phi across the fluid's surface
+   int surface=0;
+   bool signed_distance=ok && read_field(data.data(), data.size(), FIELD_PHI, values, NAN);
+   const Array3c &marker=grid.marker;
+   for(int k=1; signed_distance && k<marker.nz-1; ++k) for(int j=1; j<marker.ny-1; ++j) for(int i=1; i<marker.nx-1; ++i){
+      if(marker(i, j, k)!=FLUIDCELL) continue;
+      const int neighbour[6][3]={{i-1, j, k}, {i+1, j, k}, {i, j-1, k}, {i, j+1, k}, {i, j, k-1}, {i, j, k+1}};
+      for(int n=0; n<6; ++n){
+         const int a=neighbour[n][0], b=neighbour[n][1], c=neighbour[n][2];
+         if(marker(a, b, c)!=AIRCELL) continue;
+         ++surface;
+         if(!(values(i, j, k)<0 && values(a, b, c)>0)) signed_distance=false;
+      }
+   }
+   ok=ok && signed_distance && surface>0;
+   FieldHeader header;
+   memcpy(&header, data.data(), sizeof header);
+   const int nblocks=((grid.marker.nx+FIELD_BLOCK-1)/FIELD_BLOCK)*((grid.marker.ny+FIELD_BLOCK-1)/FIELD_BLOCK)
+                     *((grid.marker.nz+FIELD_BLOCK-1)/FIELD_BLOCK);
+   printf("fields: %d of %d blocks stored, %.0f KB against %.0f KB dense (%.1fx), encoded in %.2f ms, %s, phi %s across %d surface faces\n",
+          header.nblocks, nblocks, 1e-3*data.size(), 1e-3*dense, dense/data.size(), encode, ok ? "exact" : "DIFFERENT",
+          signed_distance ? "changes sign" : "DOESN'T CHANGE SIGN", surface);
+}
+
+/* the default slices of a 64^3 grid of made-up fields taken and streamed each step, against */
+/* dumping the whole fields they come from, and the latest record read back from the stream, */
+/* which must match the grid; then the stream carried on, which must go on from its last step */
+static void bench_slices(void)
+{
+   Grid grid(9.8, 64, 64, 64, 1);
+   for(int c=0; c<grid.u.size; ++c)
+      grid.u.data[c]=c*0.01f;
+   for(int c=0; c<grid.v.size; ++c)
+      grid.v.data[c]=-c*0.01f;
+   for(int c=0; c<grid.pressure.size; ++c)
+      grid.pressure.data[c]=c*0.001;
+   for(int c=0; c<grid.phi.size; ++c)
+      grid.phi.data[c]=c%97-48.f;
+   for(int c=0; c<grid.marker.size; ++c)
+      grid.marker.data[c]=FLUIDCELL; // so the dumps have every block
+   SliceStream stream;
+   const int steps=200;
+   bool ok=stream.open("bench_slices.stream", grid, SLICES, 64, false);
+   double start=now_ms();
+   for(int s=0; ok && s<steps; ++s)
+      ok=stream.record(grid, 0.01);
+   double sliced=(now_ms()-start)/steps;
+
+   FieldEncoder encoder;
+   vector<char> data;
+   const int dumps=10;
+   start=now_ms();
+   for(int d=0; d<dumps; ++d){
+      encoder.encode(grid, FIELD_U | FIELD_V | FIELD_PRESSURE | FIELD_PHI, d, d, data);
+      ok=ok && write_whole_file("bench_slices.fields", data.data(), data.size());
+   }
+   double dumped=(now_ms()-start)/dumps;
+
+   SliceStreamHeader header;
+   vector<SliceInfo> info;
+   SliceRecord record;
+   vector<float> values;
+   ok=ok && read_latest_slices("bench_slices.stream", header, info, record, values) && record.step==steps-1;
+   size_t at=0;
+   for(unsigned int s=0; ok && s<info.size(); ++s){
+      const SliceInfo &slice=info[s];
+      for(int b=0; b<slice.height; ++b) for(int a=0; a<slice.width; ++a){
+         int ijk[3];
+         ijk[slice.axis]=slice.index;
+         ijk[slice.axis==0 ? 1 : 0]=a;
+         ijk[slice.axis==2 ? 1 : 2]=b;
+         float truth;
+         switch(slice.field){
+            case FIELD_U: truth=grid.u(ijk[0], ijk[1], ijk[2]); break;
+            case FIELD_V: truth=grid.v(ijk[0], ijk[1], ijk[2]); break;
+            case FIELD_W: truth=grid.w(ijk[0], ijk[1], ijk[2]); break;
+            case FIELD_PRESSURE: truth=(float)grid.pressure(ijk[0], ijk[1], ijk[2]); break;
+            case FIELD_PHI: truth=grid.phi(ijk[0], ijk[1], ijk[2]); break;
+            default: truth=grid.marker(ijk[0], ijk[1], ijk[2]);
+         }
+         if(values[at++]!=truth) ok=false;
+      }
+   }
+   // carried on as by a resumed run, after the steps it holds
+   stream.close();
+   SliceStream resumed;
+   ok=ok && resumed.open("bench_slices.stream", grid, SLICES, 64, true) && resumed.step==steps && resumed.record(grid, 0.01)
+        && read_latest_slices("bench_slices.stream", header, info, record, values) && record.step==steps;
+   resumed.close();
+   remove("bench_slices.stream");
+   remove("bench_slices.fields");
+   printf("slices: %d slices (%.0f KB) taken and streamed in %.3f ms a step, against %.1f ms to dump their fields, %s\n",
+          (int)info.size(), 1e-3*values.size()*sizeof(float), sliced, dumped, ok ? "identical" : "DIFFERENT");
+}
+
+struct Benchmark{
+   const char *name;
+   void (*run)(void);
+};
+
+static Benchmark benchmarks[]={
+   {"eikonal", bench_eikonal},
+   {"sampler", bench_sampler},
+   {"transfer", bench_transfer},
+   {"kernels", bench_kernels},
+   {"mls", bench_mls},
+   {"advection", bench_advection},
+   {"seeding", bench_seeding},
+   {"frames", bench_frames},
+   {"output", bench_output},
+   {"codec", bench_codec},
+   {"archive", bench_archive},
+   {"checkpoint", bench_checkpoint},
+   {"fork", bench_fork},
+   {"fields", bench_fields},
+   {"slices", bench_slices},
+};
+
+int main(int argc, char **argv)
+{
+   int count=sizeof(benchmarks)/sizeof(benchmarks[0]);
+   for(int b=0; b<count; ++b){
+      bool selected=(argc<2);
+      for(int a=1; a<argc; ++a)
+         if(!strcmp(argv[a], benchmarks[b].name)) selected=true;
+      if(selected) benchmarks[b].run();
+   }
+   return 0;
+}
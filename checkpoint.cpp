@@ -0,0 +1,321 @@
+/**
+ * Writing and restoring checkpoints (the format is in checkpoint.h).
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+using namespace std;
+
+#define CHECKPOINT_SECTIONS (7+PARTICLE_COLUMNS)
+#define CHECKPOINT_BLOCK (1<<20) // bytes each thread copies at a time while restoring
+
+struct CheckpointSection{
+   char *data;
+   size_t bytes;
+};
+
+static size_t checkpoint_padded(size_t bytes)
+{ return (bytes+FRAME_ALIGN-1)/FRAME_ALIGN*FRAME_ALIGN; }
+
+/* the arrays of a checkpoint described by header, in their order in the file */
+static int checkpoint_sections(Grid &grid, Particles &particles, const CheckpointHeader &header, CheckpointSection *section)
+{
+   int count=0;
+   section[count].data=(char *)grid.u.data;
+   section[count++].bytes=grid.u.size*sizeof(float);
+   section[count].data=(char *)grid.v.data;
+   section[count++].bytes=grid.v.size*sizeof(float);
+   section[count].data=(char *)grid.w.data;
+   section[count++].bytes=grid.w.size*sizeof(float);
+   section[count].data=(char *)grid.pressure.data;
+   section[count++].bytes=grid.pressure.size*sizeof(double);
+   section[count].data=(char *)grid.marker.data;
+   section[count++].bytes=grid.marker.size;
+   section[count].data=(char *)grid.solid.data;
+   section[count++].bytes=grid.solid.size;
+   if(header.solids){
+      section[count].data=(char *)grid.solid_phi.data;
+      section[count++].bytes=grid.solid_phi.size*sizeof(float);
+   }
+   for(int a=0; a<header.ncolumns; ++a){
+      section[count].data=(char *)particles.columns[a]->data;
+      section[count++].bytes=(size_t)header.np*sizeof(float);
+   }
+   return count;
+}
+
+static void checkpoint_header(CheckpointHeader &header, const Grid &grid, const Particles &particles, int frame, double time)
+{
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+   header.scheme=particles.simType;
+   header.nx=grid.marker.nx;
+   header.ny=grid.marker.ny;
+   header.nz=grid.marker.nz;
+   header.lx=grid.lx;
+   header.np=particles.np;
+   header.ncolumns=particles.ncolumns;
+   header.frame=frame;
+   header.time=time;
+   header.steps_since_sort=particles.steps_since_sort;
+   header.solids=(grid.solid_phi.size>0);
+}
+
+/* Writes the checkpoint in one vectored write straight from the arrays, to a temporary file that */
+/* is flushed to the disk and then renamed over filename, so a crash leaves the last checkpoint. */
+bool write_checkpoint(const char *filename, const Grid &grid, const Particles &particles, int frame, double time)
+{
+   static const char padding[FRAME_ALIGN]={0};
+   CheckpointHeader header;
+   checkpoint_header(header, grid, particles, frame, time);
+   CheckpointSection section[CHECKPOINT_SECTIONS];
+   int count=checkpoint_sections((Grid &)grid, (Particles &)particles, header, section);
+   struct iovec io[1+2*CHECKPOINT_SECTIONS];
+   int n=0;
+   io[n].iov_base=&header;
+   io[n++].iov_len=sizeof header;
+   for(int s=0; s<count; ++s){
+      io[n].iov_base=section[s].data;
+      io[n++].iov_len=section[s].bytes;
+      if(checkpoint_padded(section[s].bytes)>section[s].bytes){
+         io[n].iov_base=(void *)padding;
+         io[n++].iov_len=checkpoint_padded(section[s].bytes)-section[s].bytes;
+      }
+   }
+
+   string temporary=string(filename)+".tmp";
+   int fd=open(temporary.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd<0) return false;
+   bool ok=write_all(fd, io, n) && fdatasync(fd)==0;
+   ok=(close(fd)==0) && ok;
+   if(ok) ok=(rename(temporary.c_str(), filename)==0);
+   if(!ok) remove(temporary.c_str());
+   return ok;
+}
+
+bool read_checkpoint_header(const char *filename, CheckpointHeader &header)
+{
+   FILE *fp=fopen(filename, "rb");
+   if(!fp) return false;
+   bool ok=fread(&header, sizeof header, 1, fp)==1 && !memcmp(header.magic, CHECKPOINT_MAGIC, 8);
+   fclose(fp);
+   return ok;
+}
+
+/* Restores the grid and particles from a checkpoint: the file is mapped and each array copied */
+/* from it in blocks, in parallel. The grid and the scheme must be the checkpoint's. Returns */
+/* false, changing nothing, if the file isn't a checkpoint of them or is cut short. */
+bool read_checkpoint(const char *filename, Grid &grid, Particles &particles, CheckpointHeader &header)
+{
+   int fd=open(filename, O_RDONLY);
+   if(fd<0) return false;
+   struct stat status;
+   if(fstat(fd, &status)!=0 || status.st_size<(off_t)sizeof header){
+      close(fd);
+      return false;
+   }
+   const size_t length=status.st_size;
+   const char *map=(const char *)mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(map==MAP_FAILED) return false;
+   madvise((void *)map, length, MADV_WILLNEED);
+
+   memcpy(&header, map, sizeof header);
+   size_t expected=sizeof header;
+   const size_t cells=(size_t)header.nx*header.ny*header.nz;
+   expected+=checkpoint_padded(grid.u.size*sizeof(float))+checkpoint_padded(grid.v.size*sizeof(float))
+             +checkpoint_padded(grid.w.size*sizeof(float))+checkpoint_padded(cells*sizeof(double))
+             +2*checkpoint_padded(cells)+(header.solids ? checkpoint_padded(cells*sizeof(float)) : 0)
+             +header.ncolumns*checkpoint_padded((size_t)header.np*sizeof(float));
+   bool ok=!memcmp(header.magic, CHECKPOINT_MAGIC, 8) && header.scheme==particles.simType
+           && header.nx==grid.marker.nx && header.ny==grid.marker.ny && header.nz==grid.marker.nz
+           && header.lx==grid.lx && header.ncolumns==particles.ncolumns && header.np>=0 && expected<=length;
+   if(!ok){
+      munmap((void *)map, length);
+      return false;
+   }
+
+   if(header.solids) grid.solid_phi.init(header.nx, header.ny, header.nz);
+   else grid.solid_phi.delete_memory();
+   for(int a=0; a<particles.ncolumns; ++a)
+      particles.columns[a]->resize(header.np);
+   CheckpointSection section[CHECKPOINT_SECTIONS];
+   int count=checkpoint_sections(grid, particles, header, section);
+   size_t offset=sizeof header;
+   for(int s=0; s<count; ++s){
+      const char *from=map+offset;
+      char *to=section[s].data;
+      const size_t bytes=section[s].bytes;
+      const long blocks=(bytes+CHECKPOINT_BLOCK-1)/CHECKPOINT_BLOCK;
+      #pragma omp parallel for schedule(dynamic)
+      for(long b=0; b<blocks; ++b){
+         size_t start=b*(size_t)CHECKPOINT_BLOCK, size=(bytes-start<CHECKPOINT_BLOCK) ? bytes-start : CHECKPOINT_BLOCK;
+         memcpy(to+start, from+start, size);
+      }
+      offset+=checkpoint_padded(bytes);
+   }
+   munmap((void *)map, length);
+
+   grid.solid_cells=0;
+   for(int c=0; c<grid.solid.size; ++c)
+      grid.solid_cells+=(grid.solid.data[c]!=0);
+   particles.np=header.np;
+   particles.steps_since_sort=header.steps_since_sort;
+   ++particles.sort_generation;
+   particles.cell_ranges_valid=false;
+   particles.stencils_valid=false;
+   return true;
+}
+
+/* what a snapshot's child reports back */
+struct SnapshotResult{
+   int ok;
+   double write_ms;
+   long long copied; // bytes of copy-on-write pages, or -1 if unknown
+};
+
+/* a number in kB from a /proc file of "name: value kB" lines, or -1 */
+static long long proc_kilobytes(const char *filename, const char *name)
+{
+   FILE *fp=fopen(filename, "r");
+   if(!fp) return -1;
+   char line[256];
+   long long value=-1;
+   const size_t length=strlen(name);
+   while(value<0 && fgets(line, sizeof line, fp))
+      if(!strncmp(line, name, length) && line[length]==':') sscanf(line+length+1, "%lld", &value);
+   fclose(fp);
+   return value;
+}
+
+/* bytes of the process's pages no other process shares */
+static long long private_bytes(void)
+{
+   long long clean=proc_kilobytes("/proc/self/smaps_rollup", "Private_Clean"),
+             dirty=proc_kilobytes("/proc/self/smaps_rollup", "Private_Dirty");
+   return (clean<0 || dirty<0) ? -1 : 1024*(clean+dirty);
+}
+
+/* bytes of the process in memory */
+static long long resident_bytes(void)
+{
+   FILE *fp=fopen("/proc/self/statm", "r");
+   if(!fp) return -1;
+   long long size, resident=-1;
+   if(fscanf(fp, "%lld %lld", &size, &resident)!=2) resident=-1;
+   fclose(fp);
+   return resident<0 ? -1 : resident*sysconf(_SC_PAGESIZE);
+}
+
+/* Forks a child to write the checkpoint of the state as it is, or writes it in place if the */
+/* memory available isn't headroom times the resident memory, max_snapshots are running or it */
+/* can't fork. */
+/* The child writes to a file of its own, which the parent moves into place once the child has */
+/* finished, unless a later checkpoint got there first. */
+bool ForkCheckpointer::
+checkpoint(const char *filename, const Grid &grid, const Particles &particles, int frame, double time)
+{
+   collect(false);
+   long long available=proc_kilobytes("/proc/meminfo", "MemAvailable"), resident=resident_bytes();
+   const char *reason=0;
+   int result[2];
+   if((int)running.size()>=max_snapshots)
+      reason="the most snapshots allowed are being written";
+   else if(available<0 || resident<0 || 1024.*available<headroom*resident)
+      reason="not enough memory to fork";
+   else if(pipe(result)!=0)
+      reason="couldn't open a pipe to the child";
+   if(reason){
+      printf("checkpoint of frame %d written in place: %s\n", frame, reason);
+      bool ok=write_checkpoint(filename, grid, particles, frame, time);
+      if(ok) committed=frame;
+      return ok;
+   }
+
+   Snapshot snapshot;
+   snapshot.frame=frame;
+   snapshot.filename=filename;
+   char suffix[32];
+   snprintf(suffix, sizeof suffix, ".frame%d", frame);
+   snapshot.partial=snapshot.filename+suffix;
+   fflush(stdout); // or the child would write out the parent's buffered output again
+   chrono::steady_clock::time_point start=chrono::steady_clock::now();
+   snapshot.pid=fork();
+   if(snapshot.pid==0){
+      // the child: only this thread survives the fork, so no OpenMP and nothing from the others' locks
+      close(result[0]);
+      SnapshotResult report;
+      long long before=private_bytes();
+      chrono::steady_clock::time_point begin=chrono::steady_clock::now();
+      report.ok=write_checkpoint(snapshot.partial.c_str(), grid, particles, frame, time);
+      report.write_ms=chrono::duration<double, milli>(chrono::steady_clock::now()-begin).count();
+      long long after=private_bytes();
+      report.copied=(before<0 || after<0) ? -1 : after-before;
+      ssize_t sent=write(result[1], &report, sizeof report);
+      _exit(sent==(ssize_t)sizeof report && report.ok ? 0 : 1);
+   }
+   double forked=chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+   close(result[1]);
+   if(snapshot.pid<0){
+      close(result[0]);
+      printf("checkpoint of frame %d written in place: couldn't fork\n", frame);
+      bool ok=write_checkpoint(filename, grid, particles, frame, time);
+      if(ok) committed=frame;
+      return ok;
+   }
+   snapshot.result=result[0];
+   running.push_back(snapshot);
+   printf("checkpoint of frame %d forked in %.2f ms (%.0f MB resident)\n", frame, forked, 1e-6*resident);
+   return true;
+}
+
+/* Reaps the snapshots that have finished, or with wait all of them, and reports on each: the */
+/* time its child took to write it, and the memory its copy-on-write pages took, which is what */
+/* the parent changed while the child held on to the image. */
+void ForkCheckpointer::
+collect(bool wait)
+{
+   for(unsigned int r=0; r<running.size(); ){
+      Snapshot &snapshot=running[r];
+      int status;
+      pid_t done=waitpid(snapshot.pid, &status, wait ? 0 : WNOHANG);
+      if(done==0){
+         ++r;
+         continue;
+      }
+      SnapshotResult report;
+      bool ok=(done==snapshot.pid && WIFEXITED(status) && WEXITSTATUS(status)==0
+               && read(snapshot.result, &report, sizeof report)==(ssize_t)sizeof report && report.ok);
+      close(snapshot.result);
+      if(ok && snapshot.frame>committed){
+         ok=(rename(snapshot.partial.c_str(), snapshot.filename.c_str())==0);
+         if(ok) committed=snapshot.frame;
+      }else
+         remove(snapshot.partial.c_str());
+      if(!ok)
+         printf("the snapshot of frame %d couldn't write its checkpoint\n", snapshot.frame);
+      else if(report.copied<0)
+         printf("checkpoint of frame %d written by its snapshot in %.1f ms\n", snapshot.frame, report.write_ms);
+      else
+         printf("checkpoint of frame %d written by its snapshot in %.1f ms, copy-on-write pages took %.1f MB\n",
+                snapshot.frame, report.write_ms, 1e-6*report.copied);
+      running.erase(running.begin()+r);
+   }
+}
+
+/* waits for the snapshots still being written */
+void ForkCheckpointer::
+finish(void)
+{
+   collect(true);
+}
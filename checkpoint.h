@@ -0,0 +1,76 @@
+/**
+ * Checkpoints: the whole state a run needs to carry on from the end of a frame, in one file. A
+ * checkpoint is a CheckpointHeader followed by the grid's velocities u, v, w, its pressure (kept
+ * for a warm start, though the solver currently starts from zero), its marker, solid mask and,
+ * with solids, their distance field, then the particle columns of the scheme (as in frame.h).
+ * Every array starts FRAME_ALIGN bytes after the previous one, so restoring is a map of the file
+ * and a copy of each array from where it lies.
+ *
+ * Resuming from a checkpoint gives the same frames, bit for bit, as the run that wrote it.
+ *
+ * ForkCheckpointer writes checkpoints without stopping the simulation: it forks, and the child
+ * writes the copy-on-write image of the state as it was at the fork while the parent carries on.
+ * The pages the parent changes meanwhile are copied, so every snapshot can cost up to the
+ * process's resident memory again: short of the headroom for that, the checkpoint is written
+ * in place, as is one asked for while the most snapshots allowed are still being written.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "grid.h"
+#include "particles.h"
+
+#define CHECKPOINT_MAGIC "FLIPCKP1"
+
+struct CheckpointHeader{
+   char magic[8];
+   int scheme; // the SimulationType
+   int nx, ny, nz; // grid cells
+   float lx; // width of the grid
+   int np; // particles
+   int ncolumns; // particle columns stored
+   int frame; // the frame the checkpoint ends
+   double time;
+   int steps_since_sort; // the particles' sorting schedule
+   int solids; // the solid distance field is stored
+   char reserved[8];
+};
+
+static_assert(sizeof(CheckpointHeader)==64, "the checkpoint header is one aligned block");
+
+bool write_checkpoint(const char *filename, const Grid &grid, const Particles &particles, int frame, double time);
+bool read_checkpoint_header(const char *filename, CheckpointHeader &header);
+bool read_checkpoint(const char *filename, Grid &grid, Particles &particles, CheckpointHeader &header);
+
+struct ForkCheckpointer{
+   int max_snapshots; // snapshots being written at once
+   float headroom; // available memory a fork needs, in multiples of the process's resident memory
+
+   ForkCheckpointer(int max_snapshots_, float headroom_)
+      :max_snapshots(max_snapshots_), headroom(headroom_), committed(-1)
+   {}
+
+   ~ForkCheckpointer()
+   { finish(); }
+
+   bool checkpoint(const char *filename, const Grid &grid, const Particles &particles, int frame, double time);
+   void finish(void);
+
+   private:
+   struct Snapshot{
+      pid_t pid;
+      int result; // the read end of the pipe the child reports on
+      int frame;
+      std::string filename, partial; // the checkpoint, and the file the child writes it to
+   };
+   std::vector<Snapshot> running; // oldest first
+   int committed; // frame of the newest checkpoint in place
+
+   void collect(bool wait);
+};
+
+#endif
@@ -0,0 +1,287 @@
+/**
+ * The compressed frame encoder and decoder (the format is in codec.h).
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "codec.h"
+
+using namespace std;
+
+#define RICE_ESCAPE 24 // a quotient this large is sent as the value itself, in 32 bits
+#define VALUE_LIMIT (1<<24) // quantized values are clamped to +-this, so predictions can't overflow
+
+/* The streams in the order they're coded: the velocities first, as the positions are predicted */
+/* from them. */
+static const int stream_order[CODEC_STREAMS]={3, 4, 5, 0, 1, 2};
+
+/* writes bits into 64-bit words, low bits first */
+struct BitWriter{
+   vector<uint64_t> &words;
+   uint64_t bits;
+   int used;
+
+   BitWriter(vector<uint64_t> &words_)
+      :words(words_), bits(0), used(0)
+   {}
+
+   /* the low n<=32 bits of value, which must be clear above them */
+   void put(uint64_t value, int n)
+   {
+      bits|=value<<used;
+      used+=n;
+      if(used>=64){
+         words.push_back(bits);
+         used-=64;
+         bits=value>>(n-used);
+      }
+   }
+
+   void finish(void)
+   {
+      if(used) words.push_back(bits);
+   }
+};
+
+/* reads them back from words that needn't be aligned, as zeros past the end */
+struct BitReader{
+   const char *word, *end;
+   uint64_t bits; // the next unread bits, at the bottom
+   int left;
+
+   BitReader(const char *word_, const char *end_)
+      :word(word_), end(end_), bits(0), left(0)
+   {}
+
+   /* the next n<=32 bits */
+   uint32_t get(int n)
+   {
+      if(n==0) return 0;
+      if(left>=n){
+         uint32_t value=(uint32_t)(bits&((1ULL<<n)-1));
+         bits>>=n;
+         left-=n;
+         return value;
+      }
+      uint64_t next=0;
+      if(word<end){
+         memcpy(&next, word, sizeof next);
+         word+=sizeof next;
+      }
+      int rest=n-left;
+      uint32_t value=(uint32_t)((bits|(next<<left))&((1ULL<<n)-1));
+      bits=next>>rest;
+      left=64-rest;
+      return value;
+   }
+};
+
+static inline uint32_t zigzag(int32_t r)
+{ return ((uint32_t)r<<1)^(uint32_t)(r>>31); }
+
+static inline int32_t unzigzag(uint32_t u)
+{ return (int32_t)(u>>1)^-(int32_t)(u&1); }
+
+/* in double, so the product's rounding can't carry the value past half a step */
+static inline int32_t quantize(float x, double inverse_step)
+{ return (int32_t)::clamp(floor(x*inverse_step+0.5), (double)-VALUE_LIMIT, (double)VALUE_LIMIT); }
+
+/* the predicted position from the previous one and the two velocities, in position steps */
+static inline int32_t predict_position(int32_t previous, int32_t previous_velocity, int32_t velocity, int velocity_step)
+{ return previous+(previous_velocity+velocity)*velocity_step/2; }
+
+/* Residuals of particles p0..p0+n-1 of stream s against their predictions: the particle before */
+/* in a keyframe (prior null), else the previous frame. */
+static void residuals(int32_t *const *current, int32_t *const *prior, int s, int p0, int n, int velocity_step, uint32_t *r)
+{
+   const int32_t *c=current[s]+p0;
+   if(!prior){
+      r[0]=zigzag(c[0]);
+      for(int q=1; q<n; ++q)
+         r[q]=zigzag(c[q]-c[q-1]);
+   }else if(s>=3){
+      const int32_t *before=prior[s]+p0;
+      for(int q=0; q<n; ++q)
+         r[q]=zigzag(c[q]-before[q]);
+   }else{
+      const int32_t *before=prior[s]+p0, *vb=prior[s+3]+p0, *v=current[s+3]+p0;
+      for(int q=0; q<n; ++q)
+         r[q]=zigzag(c[q]-predict_position(before[q], vb[q], v[q], velocity_step));
+   }
+}
+
+/* Rice codes the n residuals with the parameter that suits their mean, sent first in 5 bits */
+static void rice_encode(BitWriter &out, const uint32_t *r, int n)
+{
+   uint64_t sum=0;
+   for(int q=0; q<n; ++q)
+      sum+=r[q];
+   int k=0;
+   while(k<31 && ((uint64_t)n<<(k+1))<=sum)
+      ++k;
+   out.put(k, 5);
+   const uint32_t mask=(k ? (1u<<k)-1 : 0);
+   for(int q=0; q<n; ++q){
+      uint32_t quotient=r[q]>>k;
+      if(quotient<RICE_ESCAPE){
+         out.put((1u<<quotient)-1, quotient+1); // quotient ones and a zero
+         out.put(r[q]&mask, k);
+      }else{
+         out.put((1u<<RICE_ESCAPE)-1, RICE_ESCAPE);
+         out.put(r[q], 32);
+      }
+   }
+}
+
+static void rice_decode(BitReader &in, uint32_t *r, int n)
+{
+   int k=in.get(5);
+   for(int q=0; q<n; ++q){
+      uint32_t quotient=0;
+      while(quotient<RICE_ESCAPE && in.get(1))
+         ++quotient;
+      r[q]=(quotient<RICE_ESCAPE) ? (quotient<<k)|in.get(k) : in.get(32);
+   }
+}
+
+/* Encodes the particles' positions and velocities into data (resized to fit), as a keyframe if */
+/* the previous frame doesn't line up with them or the keyframe interval is up. The chunks are */
+/* quantized and coded in parallel, each into its own words, and then gathered. */
+void FrameEncoder::
+encode(const Particles &particles, int frame, double time, vector<char> &data)
+{
+   const int np=particles.np, nchunks=(np+CODEC_CHUNK-1)/CODEC_CHUNK;
+   const float step=precision*particles.grid.h, velocity_quantum=velocity_step*step/frame_time;
+   const bool keyframe=(generation!=particles.sort_generation || (int)previous[0].size()!=np
+                        || (keyframe_interval>0 && since_keyframe>=keyframe_interval));
+   for(int s=0; s<CODEC_STREAMS; ++s)
+      current[s].resize(np);
+   if((int)chunks.size()<nchunks)
+      chunks.resize(nchunks);
+   int32_t *now[CODEC_STREAMS], *before[CODEC_STREAMS];
+   for(int s=0; s<CODEC_STREAMS; ++s){
+      now[s]=current[s].data();
+      before[s]=previous[s].data();
+   }
+   const Array1f *columns[CODEC_STREAMS]={&particles.px, &particles.py, &particles.pz, &particles.vx, &particles.vy, &particles.vz};
+
+   #pragma omp parallel for schedule(dynamic)
+   for(int c=0; c<nchunks; ++c){
+      const int p0=c*CODEC_CHUNK, n=min(CODEC_CHUNK, np-p0);
+      for(int s=0; s<CODEC_STREAMS; ++s){
+         const float *x=&(*columns[s])[p0];
+         const double inverse=1/(double)(s<3 ? step : velocity_quantum);
+         int32_t *out=now[s]+p0;
+         #pragma omp simd
+         for(int q=0; q<n; ++q)
+            out[q]=quantize(x[q], inverse);
+      }
+      chunks[c].clear();
+      BitWriter out(chunks[c]);
+      uint32_t r[CODEC_CHUNK];
+      for(int i=0; i<CODEC_STREAMS; ++i){
+         residuals(now, keyframe ? 0 : before, stream_order[i], p0, n, velocity_step, r);
+         rice_encode(out, r, n);
+      }
+      out.finish();
+   }
+
+   FrameHeader header;
+   particles.frame_header(header, frame, time);
+   header.ncolumns=CODEC_STREAMS;
+   header.codec=COMPRESSED_FRAME;
+   header.quantum=step;
+   header.velocity_quantum=velocity_quantum;
+   header.velocity_step=velocity_step;
+   header.keyframe=keyframe;
+   const size_t table=(nchunks*sizeof(uint32_t)+7)/8*8;
+   size_t size=sizeof header+table;
+   for(int c=0; c<nchunks; ++c)
+      size+=chunks[c].size()*sizeof(uint64_t);
+   data.resize(size);
+   memcpy(data.data(), &header, sizeof header);
+   memset(&data[sizeof header], 0, table);
+   char *at=&data[sizeof header+table];
+   for(int c=0; c<nchunks; ++c){
+      uint32_t words=chunks[c].size();
+      memcpy(&data[sizeof header+c*sizeof(uint32_t)], &words, sizeof words);
+      memcpy(at, chunks[c].data(), words*sizeof(uint64_t));
+      at+=words*sizeof(uint64_t);
+   }
+
+   for(int s=0; s<CODEC_STREAMS; ++s)
+      previous[s].swap(current[s]);
+   generation=particles.sort_generation;
+   since_keyframe=keyframe ? 1 : since_keyframe+1;
+}
+
+/* Decodes a compressed frame into columns[0..5] (px, py, pz, vx, vy, vz, resized to the particle */
+/* count). Returns false if it isn't one, is cut short, or isn't a keyframe and doesn't follow a */
+/* decoded frame of as many particles. */
+bool FrameDecoder::
+decode(const char *data, size_t size, vector<float> *const *columns)
+{
+   FrameHeader h;
+   if(size<sizeof h) return false;
+   memcpy(&h, data, sizeof h);
+   if(memcmp(h.magic, FRAME_MAGIC, 8) || h.codec!=COMPRESSED_FRAME || h.np<0) return false;
+   if(!h.keyframe && (!decoded || (int)previous[0].size()!=h.np)) return false;
+   const int np=h.np, nchunks=(np+CODEC_CHUNK-1)/CODEC_CHUNK;
+   const size_t table=(nchunks*sizeof(uint32_t)+7)/8*8;
+   if(size<sizeof h+table) return false;
+   vector<size_t> start(nchunks+1);
+   start[0]=sizeof h+table;
+   for(int c=0; c<nchunks; ++c){
+      uint32_t words;
+      memcpy(&words, data+sizeof h+c*sizeof(uint32_t), sizeof words);
+      start[c+1]=start[c]+words*sizeof(uint64_t);
+   }
+   if(start[nchunks]>size) return false;
+
+   const int velocity_step=h.velocity_step;
+   for(int s=0; s<CODEC_STREAMS; ++s){
+      current[s].resize(np);
+      columns[s]->resize(np);
+   }
+   int32_t *now[CODEC_STREAMS], *before[CODEC_STREAMS];
+   for(int s=0; s<CODEC_STREAMS; ++s){
+      now[s]=current[s].data();
+      before[s]=previous[s].data();
+   }
+
+   #pragma omp parallel for schedule(dynamic)
+   for(int c=0; c<nchunks; ++c){
+      const int p0=c*CODEC_CHUNK, n=min(CODEC_CHUNK, np-p0);
+      BitReader in(data+start[c], data+start[c+1]);
+      uint32_t r[CODEC_CHUNK];
+      for(int i=0; i<CODEC_STREAMS; ++i){
+         const int s=stream_order[i];
+         rice_decode(in, r, n);
+         int32_t *out=now[s]+p0;
+         if(h.keyframe){
+            int32_t last=0;
+            for(int q=0; q<n; ++q)
+               out[q]=last=last+unzigzag(r[q]);
+         }else if(s>=3){
+            for(int q=0; q<n; ++q)
+               out[q]=before[s][p0+q]+unzigzag(r[q]);
+         }else{
+            for(int q=0; q<n; ++q)
+               out[q]=predict_position(before[s][p0+q], before[s+3][p0+q], now[s+3][p0+q], velocity_step)+unzigzag(r[q]);
+         }
+         const double quantum=(s<3 ? h.quantum : h.velocity_quantum);
+         float *x=columns[s]->data()+p0;
+         #pragma omp simd
+         for(int q=0; q<n; ++q)
+            x[q]=(float)(out[q]*quantum);
+      }
+   }
+
+   for(int s=0; s<CODEC_STREAMS; ++s)
+      previous[s].swap(current[s]);
+   header=h;
+   decoded=true;
+   return true;
+}
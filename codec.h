@@ -0,0 +1,67 @@
+/**
+ * Compressed particle frames, lossy within a guaranteed bound. Positions are quantized to a step
+ * that's a fraction of the cell size and velocities to a whole number of position steps per
+ * frame, both in double, so a decoded value is within half a step of the truth plus its rounding
+ * to a float (half an ulp of the value). The quantized values are integers, so every prediction
+ * below is exact arithmetic the decoder repeats bit for bit. A keyframe codes each particle
+ * against the one before it in memory (the particles are sorted by cell, so neighbours in memory
+ * are neighbours in space). Other frames code each particle against the previous frame: its
+ * velocity against its previous velocity, and its position against its previous position moved
+ * by the mean of the two velocities. The residuals are zigzag and Rice coded in independent
+ * chunks of particles, encoded and decoded in parallel. A frame after the particles were reordered or
+ * added to (Particles::sort_generation) has to be a keyframe, since the previous frame no longer
+ * lines up with them.
+ *
+ * A compressed frame is a FrameHeader (codec COMPRESSED_FRAME, with the steps; ncolumns is 6,
+ * the positions and velocities, as APIC's c isn't stored), the number of 64-bit words of each
+ * chunk as 32-bit counts padded to 8 bytes, and the chunks' words.
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <cstdint>
+#include <vector>
+#include "frame.h"
+#include "particles.h"
+
+#define CODEC_CHUNK 4096 // particles coded together
+#define CODEC_STREAMS 6 // x, y, z, u, v, w
+
+struct FrameEncoder{
+   float precision; // the position step as a fraction of the cell size
+   int velocity_step; // the velocity step, in position steps per frame
+   double frame_time;
+   int keyframe_interval; // most frames from one keyframe to the next, for seeking (0 for no limit)
+
+   FrameEncoder(float precision_, int velocity_step_, double frame_time_, int keyframe_interval_)
+      :precision(precision_), velocity_step(velocity_step_), frame_time(frame_time_),
+       keyframe_interval(keyframe_interval_), generation(-1), since_keyframe(0)
+   {}
+
+   void encode(const Particles &particles, int frame, double time, std::vector<char> &data);
+
+   private:
+   std::vector<int32_t> previous[CODEC_STREAMS], current[CODEC_STREAMS]; // the quantized frames
+   std::vector<std::vector<uint64_t> > chunks;
+   int generation; // the particles' sort_generation at the previous frame
+   int since_keyframe;
+};
+
+/* Decodes a run of compressed frames in order from a keyframe: a frame that isn't a keyframe */
+/* needs the one before it to have been decoded. */
+struct FrameDecoder{
+   FrameHeader header; // of the last frame decoded
+
+   FrameDecoder()
+      :decoded(false)
+   {}
+
+   bool decode(const char *data, size_t size, std::vector<float> *const *columns);
+
+   private:
+   std::vector<int32_t> previous[CODEC_STREAMS], current[CODEC_STREAMS];
+   bool decoded;
+};
+
+#endif
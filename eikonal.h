@@ -0,0 +1,60 @@
+/**
+ * Local solvers for the Eikonal equation |grad phi|=1 used by the fast sweeping in Grid::sweep_phi.
+ * Distances are measured in grid cells.
+ */
+
+#ifndef EIKONAL_H
+#define EIKONAL_H
+
+#include <cmath>
+#include "util.h"
+
+/* Scalar update of one cell from its upwind neighbours p, q, t along x, y, z. */
+static inline void solve_distance(float p, float q, float t, float &r)
+{
+    float pq_min = fmin(p,q), pq_max = fmax(p,q);
+    float min3 = fmin(t,pq_min);
+    float max3 = fmax(t,pq_max);
+    float mid3 = fmax(pq_min,fmin(pq_max,t));
+
+    float d = min3 + 1;
+    if (d > mid3) {
+        d=(min3+mid3+sqrt(2-sqr(min3-mid3)))/2;
+        if (d > max3) {
+            d=(min3+mid3+max3+sqrt(3-2*(min3*min3-min3*mid3-min3*max3+mid3*mid3-mid3*max3+max3*max3)))/3;
+        }
+    }
+    if (d < r)
+        r=d;
+}
+
+/* Branch-free update of a whole row of n cells: the neighbours are sorted with a min/max network, */
+/* all three candidate distances are computed with clamped square roots and the right one is */
+/* selected per lane. Cells whose marker is skip_marker keep their value. */
+static inline void solve_distance_row(const float *p, const float *q, const float *t,
+                                      const char *marker, char skip_marker, float *r, int n)
+{
+   #pragma omp simd
+   for(int i=0; i<n; ++i){
+      float pq_min = p[i]<q[i] ? p[i] : q[i];
+      float pq_max = p[i]<q[i] ? q[i] : p[i];
+      float min3 = t[i]<pq_min ? t[i] : pq_min;
+      float max3 = t[i]<pq_max ? pq_max : t[i];
+      float mid_lo = pq_max<t[i] ? pq_max : t[i];
+      float mid3 = pq_min<mid_lo ? mid_lo : pq_min;
+
+      float d1 = min3 + 1;
+      float disc2 = 2 - (min3-mid3)*(min3-mid3);
+      float d2 = (min3 + mid3 + std::sqrt(disc2>0 ? disc2 : 0.f))*0.5f;
+      float disc3 = 3 - 2*(min3*min3 - min3*mid3 - min3*max3 + mid3*mid3 - mid3*max3 + max3*max3);
+      float d3 = (min3 + mid3 + max3 + std::sqrt(disc3>0 ? disc3 : 0.f))*(1.f/3);
+
+      bool two = d1>mid3;
+      bool three = two & (d2>max3);
+      float d = three ? d3 : (two ? d2 : d1);
+      bool update = (marker[i]!=skip_marker) & (d<r[i]);
+      r[i] = update ? d : r[i];
+   }
+}
+
+#endif
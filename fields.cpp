@@ -0,0 +1,234 @@
+/**
+ * Encoding and reading grid field dumps (the format is in fields.h).
+ */
+
+#include <cstring>
+#include <algorithm>
+#include "fields.h"
+
+using namespace std;
+
+#define FIELD_VALUES ((FIELD_BLOCK+1)*(FIELD_BLOCK+1)*(FIELD_BLOCK+1)) // most values of a field in a block
+
+static const GridField field_order[FIELD_COUNT]={FIELD_U, FIELD_V, FIELD_W, FIELD_PRESSURE, FIELD_PHI, FIELD_MARKER};
+
+/* the indices block b of nblocks covers along an axis of an array of size indices: the last */
+/* block takes the rest, the face past the last cell of a staggered velocity */
+static inline void block_range(int b, int nblocks, int size, int &begin, int &end)
+{
+   begin=b*FIELD_BLOCK;
+   end=(b==nblocks-1) ? size : min(begin+FIELD_BLOCK, size);
+}
+
+/* copies block (bi, bj, bk) of nb[] blocks of the array into values as floats, returning how many */
+template<class T>
+static int gather_block(const Array3<T> &a, int bi, int bj, int bk, const int *nb, float *values)
+{
+   int i0, i1, j0, j1, k0, k1, n=0;
+   block_range(bi, nb[0], a.nx, i0, i1);
+   block_range(bj, nb[1], a.ny, j0, j1);
+   block_range(bk, nb[2], a.nz, k0, k1);
+   for(int k=k0; k<k1; ++k) for(int j=j0; j<j1; ++j) for(int i=i0; i<i1; ++i)
+      values[n++]=(float)a(i, j, k);
+   return n;
+}
+
+/* the reverse, returning how many values were taken */
+static int scatter_block(Array3f &a, int bi, int bj, int bk, const int *nb, const float *values)
+{
+   int i0, i1, j0, j1, k0, k1, n=0;
+   block_range(bi, nb[0], a.nx, i0, i1);
+   block_range(bj, nb[1], a.ny, j0, j1);
+   block_range(bk, nb[2], a.nz, k0, k1);
+   for(int k=k0; k<k1; ++k) for(int j=j0; j<j1; ++j) for(int i=i0; i<i1; ++i)
+      a(i, j, k)=values[n++];
+   return n;
+}
+
+static int gather_field(const Grid &grid, GridField field, int bi, int bj, int bk, const int *nb, float *values)
+{
+   switch(field){
+      case FIELD_U: return gather_block(grid.u, bi, bj, bk, nb, values);
+      case FIELD_V: return gather_block(grid.v, bi, bj, bk, nb, values);
+      case FIELD_W: return gather_block(grid.w, bi, bj, bk, nb, values);
+      case FIELD_PRESSURE: return gather_block(grid.pressure, bi, bj, bk, nb, values);
+      case FIELD_PHI: return gather_block(grid.phi, bi, bj, bk, nb, values);
+      default: return gather_block(grid.marker, bi, bj, bk, nb, values);
+   }
+}
+
+/* appends the n values: one, if they're all the same, or each XORed with the one before, less */
+/* its leading zero bytes, with a nibble per value giving how many bytes are left */
+static void compress(const float *values, int n, vector<char> &out)
+{
+   unsigned int bits[FIELD_VALUES];
+   memcpy(bits, values, n*sizeof(float));
+   bool constant=true;
+   for(int q=1; q<n && constant; ++q)
+      constant=(bits[q]==bits[0]);
+   if(constant){
+      out.push_back(0);
+      out.insert(out.end(), (const char *)bits, (const char *)bits+sizeof(float));
+      return;
+   }
+   out.push_back(1);
+   const size_t control=out.size();
+   out.resize(control+(n+1)/2, 0);
+   unsigned int previous=0;
+   for(int q=0; q<n; ++q){
+      unsigned int x=bits[q]^previous;
+      previous=bits[q];
+      int bytes=x ? 4-__builtin_clz(x)/8 : 0;
+      out[control+q/2]|=(char)(bytes<<(4*(q&1)));
+      for(int b=0; b<bytes; ++b)
+         out.push_back((char)(x>>(8*b)));
+   }
+}
+
+/* reads back n values from in, returning where they end, or null if they run past end */
+static const char *decompress(const char *in, const char *end, int n, float *values)
+{
+   unsigned int bits[FIELD_VALUES];
+   if(in>=end) return 0;
+   if(*in++==0){
+      if(end-in<(long)sizeof(float)) return 0;
+      memcpy(&bits[0], in, sizeof(float));
+      for(int q=1; q<n; ++q)
+         bits[q]=bits[0];
+      memcpy(values, bits, n*sizeof(float));
+      return in+sizeof(float);
+   }
+   if(end-in<(n+1)/2) return 0;
+   const unsigned char *control=(const unsigned char *)in;
+   in+=(n+1)/2;
+   unsigned int previous=0;
+   for(int q=0; q<n; ++q){
+      int bytes=(control[q/2]>>(4*(q&1)))&15;
+      if(bytes>4 || end-in<bytes) return 0;
+      unsigned int x=0;
+      for(int b=0; b<bytes; ++b)
+         x|=(unsigned int)(unsigned char)in[b]<<(8*b);
+      in+=bytes;
+      previous=bits[q]=x^previous;
+   }
+   memcpy(values, bits, n*sizeof(float));
+   return in;
+}
+
+static inline size_t padded8(size_t bytes)
+{ return (bytes+7)/8*8; }
+
+/* Encodes the fields of the blocks within a cell of fluid into data, resized to fit. The blocks */
+/* are gathered and compressed in parallel, each into its own buffer, and then laid out. */
+void FieldEncoder::
+encode(const Grid &grid, int fields, int frame, double time, vector<char> &data)
+{
+   const Array3c &marker=grid.marker;
+   const int nb[3]={(marker.nx+FIELD_BLOCK-1)/FIELD_BLOCK, (marker.ny+FIELD_BLOCK-1)/FIELD_BLOCK,
+                    (marker.nz+FIELD_BLOCK-1)/FIELD_BLOCK};
+   near.assign(nb[0]*nb[1]*nb[2], 0);
+   for(int k=0; k<marker.nz; ++k) for(int j=0; j<marker.ny; ++j) for(int i=0; i<marker.nx; ++i){
+      if(marker(i, j, k)!=FLUIDCELL) continue;
+      // the blocks of the cell and its neighbours: a block's fluid reaches a cell into the next
+      const int bi[2]={max(i-1, 0)/FIELD_BLOCK, min(i+1, marker.nx-1)/FIELD_BLOCK},
+                bj[2]={max(j-1, 0)/FIELD_BLOCK, min(j+1, marker.ny-1)/FIELD_BLOCK},
+                bk[2]={max(k-1, 0)/FIELD_BLOCK, min(k+1, marker.nz-1)/FIELD_BLOCK};
+      for(int c=0; c<8; ++c)
+         near[bi[c&1]+nb[0]*(bj[(c>>1)&1]+nb[1]*bk[c>>2])]=1;
+   }
+   stored.clear();
+   for(int b=0; b<(int)near.size(); ++b)
+      if(near[b]) stored.push_back(b);
+   const int nblocks=stored.size();
+   if((int)blocks.size()<nblocks)
+      blocks.resize(nblocks);
+
+   #pragma omp parallel for schedule(dynamic)
+   for(int s=0; s<nblocks; ++s){
+      const int b=stored[s], bi=b%nb[0], bj=(b/nb[0])%nb[1], bk=b/(nb[0]*nb[1]);
+      float values[FIELD_VALUES];
+      blocks[s].clear();
+      for(int f=0; f<FIELD_COUNT; ++f){
+         if(!(fields&field_order[f])) continue;
+         int n=gather_field(grid, field_order[f], bi, bj, bk, nb, values);
+         compress(values, n, blocks[s]);
+      }
+   }
+
+   FieldHeader header;
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, FIELD_MAGIC, 8);
+   header.fields=fields;
+   header.nx=marker.nx;
+   header.ny=marker.ny;
+   header.nz=marker.nz;
+   header.lx=grid.lx;
+   header.nblocks=nblocks;
+   header.frame=frame;
+   header.time=time;
+   const size_t ids=padded8(nblocks*sizeof(int)), offsets=padded8((nblocks+1)*sizeof(unsigned int));
+   size_t size=sizeof header+ids+offsets;
+   for(int s=0; s<nblocks; ++s)
+      size+=blocks[s].size();
+   data.assign(size, 0);
+   memcpy(&data[0], &header, sizeof header);
+   if(nblocks) memcpy(&data[sizeof header], &stored[0], nblocks*sizeof(int));
+   unsigned int at=sizeof header+ids+offsets;
+   for(int s=0; s<=nblocks; ++s){
+      memcpy(&data[sizeof header+ids+s*sizeof(unsigned int)], &at, sizeof at);
+      if(s<nblocks && !blocks[s].empty()){
+         memcpy(&data[at], &blocks[s][0], blocks[s].size());
+         at+=blocks[s].size();
+      }
+   }
+}
+
+/* Reads one field of a dump into values, sized to the field's array, with the blocks the dump */
+/* left out set to background. Returns false if it isn't a dump with the field or is cut short. */
+bool read_field(const char *data, size_t size, GridField field, Array3f &values, float background)
+{
+   FieldHeader header;
+   if(size<sizeof header) return false;
+   memcpy(&header, data, sizeof header);
+   if(memcmp(header.magic, FIELD_MAGIC, 8) || !(header.fields&field) || header.nblocks<0) return false;
+   const size_t ids=padded8(header.nblocks*sizeof(int)), offsets=padded8((header.nblocks+1)*sizeof(unsigned int));
+   if(size<sizeof header+ids+offsets) return false;
+   values.init(header.nx+(field==FIELD_U), header.ny+(field==FIELD_V), header.nz+(field==FIELD_W));
+   for(int c=0; c<values.size; ++c)
+      values.data[c]=background;
+   const int nb[3]={(header.nx+FIELD_BLOCK-1)/FIELD_BLOCK, (header.ny+FIELD_BLOCK-1)/FIELD_BLOCK,
+                    (header.nz+FIELD_BLOCK-1)/FIELD_BLOCK};
+   // the fields' sizes, to know how many values each field before this one has in a block
+   int shape[FIELD_COUNT][3];
+   for(int f=0; f<FIELD_COUNT; ++f){
+      shape[f][0]=header.nx+(field_order[f]==FIELD_U);
+      shape[f][1]=header.ny+(field_order[f]==FIELD_V);
+      shape[f][2]=header.nz+(field_order[f]==FIELD_W);
+   }
+   bool ok=true;
+   for(int s=0; s<header.nblocks && ok; ++s){
+      int b;
+      unsigned int begin, end;
+      memcpy(&b, data+sizeof header+s*sizeof(int), sizeof b);
+      memcpy(&begin, data+sizeof header+ids+s*sizeof(unsigned int), sizeof begin);
+      memcpy(&end, data+sizeof header+ids+(s+1)*sizeof(unsigned int), sizeof end);
+      if(b<0 || b>=nb[0]*nb[1]*nb[2] || begin>end || end>size) return false;
+      const int bi=b%nb[0], bj=(b/nb[0])%nb[1], bk=b/(nb[0]*nb[1]);
+      const char *in=data+begin;
+      float block[FIELD_VALUES];
+      for(int f=0; f<FIELD_COUNT && ok; ++f){
+         if(!(header.fields&field_order[f])) continue;
+         int i0, i1, j0, j1, k0, k1;
+         block_range(bi, nb[0], shape[f][0], i0, i1);
+         block_range(bj, nb[1], shape[f][1], j0, j1);
+         block_range(bk, nb[2], shape[f][2], k0, k1);
+         in=decompress(in, data+end, (i1-i0)*(j1-j0)*(k1-k0), block);
+         ok=(in!=0);
+         if(ok && field_order[f]==field){
+            scatter_block(values, bi, bj, bk, nb, block);
+            break;
+         }
+      }
+   }
+   return ok;
+}
@@ -0,0 +1,56 @@
+/**
+ * Grid field dumps: chosen fields of the grid (velocities, pressure, phi, marker) at the end of a
+ * frame, for debugging and rendering. The grid is cut into blocks of FIELD_BLOCK cells per side
+ * and only the blocks within a cell of fluid are stored. Each field of a block is compressed on
+ * its own, losslessly: a block of one value is that value, any other block stores each value
+ * XORed with the one before it, less its leading zero bytes (a nibble per value gives how many
+ * bytes are left), which makes the runs and slow changes of these fields short.
+ *
+ * A dump is a FieldHeader, the number of each stored block (bi+nbx*(bj+nby*bk), FIELD_BLOCK
+ * cells per side; the last block along an axis also takes the rest of the faces of the
+ * staggered velocities) as an int, padded to 8 bytes, the offset of each block's data from the
+ * start of the dump as an unsigned int and one past the last, also padded, and the blocks' data:
+ * the fields in the order of GridField, each a tag byte (0: one value, 1: XORed) and the values.
+ * Values are floats: pressure is rounded to one and the marker converted.
+ */
+
+#ifndef FIELDS_H
+#define FIELDS_H
+
+#include <vector>
+#include "grid.h"
+
+#define FIELD_MAGIC "FLIPFLD1"
+#define FIELD_BLOCK 8 // cells per side of the blocks stored or left out together
+#define FIELD_COUNT 6
+
+typedef enum GridFieldEnum { FIELD_U = 1, FIELD_V = 2, FIELD_W = 4, FIELD_PRESSURE = 8, FIELD_PHI = 16,
+                             FIELD_MARKER = 32 } GridField;
+
+struct FieldHeader{
+   char magic[8];
+   int fields; // the GridFields stored
+   int nx, ny, nz; // grid cells
+   float lx; // width of the grid
+   int nblocks; // blocks stored
+   int frame;
+   int reserved0;
+   double time;
+   char reserved[16];
+};
+
+static_assert(sizeof(FieldHeader)==64, "the field header is one aligned block");
+
+/* Encodes dumps, keeping the per-block buffers from one to the next. */
+struct FieldEncoder{
+   void encode(const Grid &grid, int fields, int frame, double time, std::vector<char> &data);
+
+   private:
+   std::vector<int> stored; // numbers of the blocks stored
+   std::vector<char> near; // per block: within a cell of fluid
+   std::vector<std::vector<char> > blocks;
+};
+
+bool read_field(const char *data, size_t size, GridField field, Array3f &values, float background);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * Writing binary particle frames (the format is in frame.h).
+ */
+
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "frame.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 16 // the least POSIX allows
+#endif
+
+/* Writes all of the buffers in io, carrying on after partial writes: a vectored write may stop */
+/* short of the whole, and takes at most IOV_MAX buffers. */
+bool write_all(int fd, struct iovec *io, int count)
+{
+   while(count>0){
+      ssize_t written=writev(fd, io, count<IOV_MAX ? count : IOV_MAX);
+      if(written<0){
+         if(errno==EINTR) continue;
+         return false;
+      }
+      for(; count>0 && (size_t)written>=io->iov_len; ++io, --count)
+         written-=io->iov_len;
+      if(count>0){
+         io->iov_base=(char *)io->iov_base+written;
+         io->iov_len-=written;
+      }
+   }
+   return true;
+}
+
+/* The header and columns go out in one vectored write straight from where they are, with the */
+/* columns' padding taken from a block of zeros, so nothing is copied or formatted. */
+bool write_frame_file(const char *filename, const FrameHeader &header, const float *const *columns)
+{
+   static const char padding[FRAME_ALIGN]={0};
+   if(header.ncolumns>FRAME_MAX_COLUMNS) return false;
+   const size_t bytes=(size_t)header.np*sizeof(float), padded=frame_column_bytes(header.np);
+   struct iovec io[1+2*FRAME_MAX_COLUMNS];
+   int count=0;
+   io[count].iov_base=(void *)&header;
+   io[count++].iov_len=sizeof header;
+   for(int c=0; c<header.ncolumns; ++c){
+      io[count].iov_base=(void *)columns[c];
+      io[count++].iov_len=bytes;
+      if(padded>bytes){
+         io[count].iov_base=(void *)padding;
+         io[count++].iov_len=padded-bytes;
+      }
+   }
+
+   int fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd<0) return false;
+   bool ok=write_all(fd, io, count);
+   return close(fd)==0 && ok;
+}
@@ -0,0 +1,72 @@
+/**
+ * The binary particle frame format. A frame file is a FrameHeader followed by the particle
+ * columns the scheme stores (px, py, pz, vx, vy, vz, then APIC's c[0..8]), np floats each,
+ * every column starting FRAME_ALIGN bytes into the file after the previous one, so a reader can
+ * seek to or map a column directly (compressed frames, with the same header, are in codec.h).
+ * The reader of raw frames is here, with no dependencies beyond the standard library, so the
+ * viewer can include it on its own.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#define FRAME_MAGIC "FLIPFRM1"
+#define FRAME_ALIGN 64 // bytes the header and each column are padded to
+#define FRAME_MAX_COLUMNS 15
+
+typedef enum FrameFormatEnum { BINARY_FRAMES = 0, TEXT_FRAMES = 1, COMPRESSED_FRAMES = 2 } FrameFormat;
+typedef enum FrameCodecEnum { RAW_FRAME = 0, COMPRESSED_FRAME = 1 } FrameCodec;
+
+struct FrameHeader{
+   char magic[8];
+   int np; // particles
+   int ncolumns; // columns stored: 6, or 15 with APIC's c
+   int scheme; // the SimulationType
+   int nx, ny, nz; // grid cells
+   float lx; // width of the grid
+   int frame;
+   double time;
+   int codec; // RAW_FRAME (the columns as above) or COMPRESSED_FRAME (codec.h)
+   float quantum; // compressed frames: the position step...
+   float velocity_quantum; // ...and the velocity step
+   short velocity_step; // compressed frames: the velocity step in position steps per frame
+   short keyframe; // compressed frames: decodes on its own, without the frame before
+};
+
+static_assert(sizeof(FrameHeader)==FRAME_ALIGN, "the frame header is one aligned block");
+
+/* bytes a column of np particles takes in a frame, padded */
+inline size_t frame_column_bytes(int np)
+{ return ((size_t)np*sizeof(float)+FRAME_ALIGN-1)/FRAME_ALIGN*FRAME_ALIGN; }
+
+/* Reads the header of a frame file and its first ncolumns columns, column c into *columns[c] */
+/* unless that's null. Returns false if the file isn't a raw frame or is cut short. */
+inline bool read_frame_file(const char *filename, FrameHeader &header, std::vector<float> *const *columns, int ncolumns)
+{
+   FILE *fp=fopen(filename, "rb");
+   if(!fp) return false;
+   bool ok=fread(&header, sizeof header, 1, fp)==1 && !memcmp(header.magic, FRAME_MAGIC, 8)
+           && header.codec==RAW_FRAME && header.np>=0 && ncolumns<=header.ncolumns;
+   for(int c=0; c<ncolumns && ok; ++c){
+      if(!columns[c]) continue;
+      columns[c]->resize(header.np);
+      long offset=(long)(sizeof header+c*frame_column_bytes(header.np));
+      ok=fseek(fp, offset, SEEK_SET)==0
+         && fread(columns[c]->data(), sizeof(float), header.np, fp)==(size_t)header.np;
+   }
+   fclose(fp);
+   return ok;
+}
+
+/* writes a frame file from the header and its header.ncolumns columns (frame.cpp) */
+bool write_frame_file(const char *filename, const FrameHeader &header, const float *const *columns);
+
+/* writes all of the buffers in io to the file, carrying on after partial writes (frame.cpp) */
+struct iovec;
+bool write_all(int fd, struct iovec *io, int count);
+
+#endif
@@ -10,7 +10,9 @@
 #include <cstdarg>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include "grid.h"
+#include "eikonal.h"
 
 using namespace std;
 
@@ -20,18 +22,21 @@ init(float gravity_, int cell_nx, int cell_ny, int cell_nz, float lx_)
    gravity=gravity_;
    lx=lx_;
    ly=cell_ny*lx/cell_nx;
+   lz=cell_nz*lx/cell_nx;
    h=lx/cell_nx;
    overh=cell_nx/lx;
+   extrapolation=SWEEP_EXTRAPOLATION;
+   extrapolation_layers=4;
+   velocity_change=false;
    // allocate all the grid variables
    u.init(cell_nx+1, cell_ny, cell_nz);
    v.init(cell_nx, cell_ny+1, cell_nz);
    w.init(cell_nx, cell_ny, cell_nz+1);
    pressure.init(cell_nx, cell_ny, cell_nz);
    marker.init(cell_nx, cell_ny, cell_nz);
+   solid.init(cell_nx, cell_ny, cell_nz);
+   solid_cells=0;
    phi.init(cell_nx, cell_ny, cell_nz);
-   du.init(cell_nx+1, cell_ny, cell_nz);
-   dv.init(cell_nx, cell_ny+1, cell_nz);
-   dw.init(cell_nx, cell_ny, cell_nz+1);
    poisson.init(cell_nx, cell_ny, cell_nz);
    preconditioner.init(cell_nx, cell_ny, cell_nz);
    m.init(cell_nx, cell_ny, cell_nz);
@@ -48,9 +53,26 @@ CFL(void)
    return h/sqrt(maxv3);
 }
 
+/* allocates du, dv, dw for schemes that read the change of the grid velocity, or frees them */
+void Grid::
+track_velocity_change(bool on)
+{
+   velocity_change=on;
+   if(on){
+      du.init(u.nx, u.ny, u.nz);
+      dv.init(v.nx, v.ny, v.nz);
+      dw.init(w.nx, w.ny, w.nz);
+   }else{
+      du.delete_memory();
+      dv.delete_memory();
+      dw.delete_memory();
+   }
+}
+
 void Grid::
 save_velocities(void)
 {
+   if(!velocity_change) return;
    u.copy_to(du);
    v.copy_to(dv);
    w.copy_to(dw);
@@ -123,8 +145,14 @@ compute_distance_to_fluid(void) // TODO see if needs index adjustment, i think i
 void Grid::
 extend_velocity(void)
 {
-   for(int i=0; i<8; ++i)
-      sweep_velocity();
+   if(extrapolation==BFS_EXTRAPOLATION){
+      extend_velocity_bfs(u, 1, 0, 0);
+      extend_velocity_bfs(v, 0, 1, 0);
+      extend_velocity_bfs(w, 0, 0, 1);
+   }else{
+      for(int i=0; i<8; ++i)
+         sweep_velocity();
+   }
 }
 
 void Grid::
@@ -151,6 +179,17 @@ apply_boundary_conditions(void)
    for(k=0; k<marker.nz; ++k)
       for(i=0; i<marker.nx; ++i)
          v(i,0,k)=v(i,1,k)=v(i,v.ny-1,k)=v(i,v.ny-2,k)=0;
+   // and the same for the solids inside it: no flow through any face of a solid cell
+   if(solid_cells==0) return;
+   for(k=0; k<marker.nz; ++k)
+      for(j=0; j<marker.ny; ++j)
+         for(i=0; i<marker.nx; ++i)
+            if(solid(i,j,k)){
+               marker(i,j,k)=SOLIDCELL;
+               u(i,j,k)=u(i+1,j,k)=0;
+               v(i,j,k)=v(i,j+1,k)=0;
+               w(i,j,k)=w(i,j,k+1)=0;
+            }
 }
 
 void Grid::
@@ -166,6 +205,7 @@ make_incompressible(void)
 void Grid::
 get_velocity_update(void)
 {
+   if(!velocity_change) return;
    int i;
    for(i=0; i<u.size; ++i)
       du.data[i]=u.data[i]-du.data[i];
@@ -192,60 +232,36 @@ init_phi(void)
    }
 }
 
-static inline void solve_distance(float p, float q, float t, float &r)
-{
-    float pq_min = fmin(p,q), pq_max = fmax(p,q);
-    float min3 = fmin(t,pq_min);
-    float max3 = fmax(t,pq_max);
-    float mid3 = fmax(pq_min,fmin(pq_max,t));
-
-    float d = min3 + 1;
-    if (d > mid3) {
-        d=(min3+mid3+sqrt(2-sqr(min3-mid3)))/2;
-        if (d > max3) {
-            d=(min3+mid3+max3+sqrt(3-2*(min3*min3-min3*mid3-min3*max3+mid3*mid3-mid3*max3+max3*max3)))/3;
-        }
-    }
-    if (d < r)
-        r=d;
-}
-
 void Grid::
 sweep_phi(void)
 {
-   // fast sweeping outside the fluid in all four sweep directions
-   int i, j, k;
-   for(j=1; j<phi.ny; ++j) for(i=1; i<phi.nx; ++i) for(k=1; k < phi.nz; ++k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i-1,j,k), phi(i,j-1,k), phi(i,j,k-1), phi(i,j,k));
-
-   for(j=phi.ny-2; j>=0; --j) for(i=1; i<phi.nx; ++i) for(k=1; k < phi.nz; ++k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i-1,j,k), phi(i,j+1,k), phi(i,j,k-1), phi(i,j,k));
-
-   for(j=1; j<phi.ny; ++j) for(i=phi.nx-2; i>=0; --i) for(k=1; k < phi.nz; ++k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i+1,j,k), phi(i,j-1,k), phi(i,j,k-1), phi(i,j,k));
-
-   for(j=phi.ny-2; j>=0; --j) for(i=phi.nx-2; i>=0; --i) for(k=1; k < phi.nz; ++k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i+1,j,k), phi(i,j+1,k), phi(i,j,k-1), phi(i,j,k));
-
-   for(j=1; j<phi.ny; ++j) for(i=1; i<phi.nx; ++i) for(k=phi.nz-2; k>=0; --k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i-1,j,k), phi(i,j-1,k), phi(i,j,k+1), phi(i,j,k));
-
-   for(j=phi.ny-2; j>=0; --j) for(i=1; i<phi.nx; ++i) for(k=phi.nz-2; k>=0; --k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i-1,j,k), phi(i,j+1,k), phi(i,j,k+1), phi(i,j,k));
-
-   for(j=1; j<phi.ny; ++j) for(i=phi.nx-2; i>=0; --i) for(k=phi.nz-2; k>=0; --k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i+1,j,k), phi(i,j-1,k), phi(i,j,k+1), phi(i,j,k));
-
-    for(j=phi.ny-2; j>=0; --j) for(i=phi.nx-2; i>=0; --i) for(k=phi.nz-2; k>=0; --k)
-      if(marker(i,j,k)!=FLUIDCELL)
-         solve_distance(phi(i+1,j,k), phi(i,j+1,k), phi(i,j,k+1), phi(i,j,k));
+   // fast sweeping outside the fluid in the four y/z sweep directions; each x row is updated at
+   // once from its x neighbours as they were before the row update (so a row has no dependencies
+   // within itself) and from the already swept rows behind it in y and z, then swept forward and
+   // back along x, revisiting only the cells next to one the row update lowered
+   int nx=phi.nx;
+   vector<float> px(nx), before(nx);
+   for(int dk=-1; dk<=1; dk+=2) for(int dj=-1; dj<=1; dj+=2){
+      int k0=(dk>0) ? 1 : phi.nz-2, k1=(dk>0) ? phi.nz : -1;
+      int j0=(dj>0) ? 1 : phi.ny-2, j1=(dj>0) ? phi.ny : -1;
+      for(int k=k0; k!=k1; k+=dk) for(int j=j0; j!=j1; j+=dj){
+         float *row=&phi(0,j,k);
+         const float *ry=&phi(0,j-dj,k), *rz=&phi(0,j,k-dk);
+         const char *m=&marker(0,j,k);
+         px[0]=row[1];
+         for(int i=1; i<nx-1; ++i)
+            px[i]=(row[i-1]<row[i+1]) ? row[i-1] : row[i+1];
+         px[nx-1]=row[nx-2];
+         memcpy(&before[0], row, nx*sizeof(float));
+         solve_distance_row(&px[0], ry, rz, m, FLUIDCELL, row, nx);
+         for(int i=1; i<nx; ++i)
+            if(row[i-1]<before[i-1] && row[i-1]<row[i] && m[i]!=FLUIDCELL)
+               solve_distance(row[i-1], ry[i], rz[i], row[i]);
+         for(int i=nx-2; i>=0; --i)
+            if(row[i+1]<before[i+1] && row[i+1]<row[i] && m[i]!=FLUIDCELL)
+               solve_distance(row[i+1], ry[i], rz[i], row[i]);
+      }
+   }
 }
 
 void Grid::
@@ -331,16 +347,22 @@ sweep_velocity(void) // TODO fix sweep
    sweep_u(u.nx-2, 0, 1, u.ny-1, u.nz-2, 0);
    sweep_u(u.nx-2, 0, u.ny-2, 0, u.nz-2, 0);
    for(i=0; i<u.nx; ++i){
-      for(k=0; k<u.nz; ++k)
-         u(i,0,k)=u(i,1,k); u(i,u.ny-1,k)=u(i,u.ny-2,k);
+      for(k=0; k<u.nz; ++k){
+         u(i,0,k)=u(i,1,k);
+         u(i,u.ny-1,k)=u(i,u.ny-2,k);
+      }
    }
    for(j=0; j<u.ny; ++j){
-      for(k=0; k<u.nz; ++k)
-         u(0,j,k)=u(1,j,k); u(u.nx-1,j,k)=u(u.nx-2,j,k);
+      for(k=0; k<u.nz; ++k){
+         u(0,j,k)=u(1,j,k);
+         u(u.nx-1,j,k)=u(u.nx-2,j,k);
+      }
    }
    for(i=0; i<u.nx; ++i){
-      for(j=0; j<u.ny; ++j)
-         u(i,j,0)=u(i,j,1); u(i,j,u.nz-1)=u(i,j,u.nz-2);
+      for(j=0; j<u.ny; ++j){
+         u(i,j,0)=u(i,j,1);
+         u(i,j,u.nz-1)=u(i,j,u.nz-2);
+      }
    }
 
    // now the same for v
@@ -353,16 +375,22 @@ sweep_velocity(void) // TODO fix sweep
    sweep_v(v.nx-2, 0, 1, v.ny-1, v.nz-2, 0);
    sweep_v(v.nx-2, 0, v.ny-2, 0, v.nz-2, 0);
    for(i=0; i<v.nx; ++i){
-      for(k=0; k<v.nz; ++k)
-         v(i,0,k)=v(i,1,k); v(i,v.ny-1,k)=v(i,v.ny-2,k);
+      for(k=0; k<v.nz; ++k){
+         v(i,0,k)=v(i,1,k);
+         v(i,v.ny-1,k)=v(i,v.ny-2,k);
+      }
    }
    for(j=0; j<v.ny; ++j){
-      for(k=0; k<v.nz; ++k)
-         v(0,j,k)=v(1,j,k); v(v.nx-1,j,k)=v(v.nx-2,j,k);
+      for(k=0; k<v.nz; ++k){
+         v(0,j,k)=v(1,j,k);
+         v(v.nx-1,j,k)=v(v.nx-2,j,k);
+      }
    }
    for(i=0; i<v.nx; ++i){
-      for(j=0; j<v.ny; ++j)
-         v(i,j,0)=v(i,j,1); v(i,j,v.nz-1)=v(i,j,v.nz-2);
+      for(j=0; j<v.ny; ++j){
+         v(i,j,0)=v(i,j,1);
+         v(i,j,v.nz-1)=v(i,j,v.nz-2);
+      }
    }
 
    // now for w
@@ -375,16 +403,85 @@ sweep_velocity(void) // TODO fix sweep
    sweep_w(w.nx-2, 0, 1, w.ny-1, w.nz-2, 0);
    sweep_w(w.nx-2, 0, w.ny-2, 0, w.nz-2, 0);
    for(i=0; i<w.nx; ++i){
-      for(k=0; k<w.nz; ++k)
-         w(i,0,k)=w(i,1,k); w(i,w.ny-1,k)=w(i,w.ny-2,k);
+      for(k=0; k<w.nz; ++k){
+         w(i,0,k)=w(i,1,k);
+         w(i,w.ny-1,k)=w(i,w.ny-2,k);
+      }
    }
    for(j=0; j<w.ny; ++j){
-      for(k=0; k<w.nz; ++k)
-         w(0,j,k)=w(1,j,k); w(w.nx-1,j,k)=w(w.nx-2,j,k);
+      for(k=0; k<w.nz; ++k){
+         w(0,j,k)=w(1,j,k);
+         w(w.nx-1,j,k)=w(w.nx-2,j,k);
+      }
    }
    for(i=0; i<w.nx; ++i){
-      for(j=0; j<w.ny; ++j)
-         w(i,j,0)=w(i,j,1); w(i,j,w.nz-1)=w(i,j,w.nz-2);
+      for(j=0; j<w.ny; ++j){
+         w(i,j,0)=w(i,j,1);
+         w(i,j,w.nz-1)=w(i,j,w.nz-2);
+      }
+   }
+}
+
+/* Breadth-first extrapolation of one velocity component: faces bordering a fluid cell are known, */
+/* and each new layer of faces takes the average of its already-known neighbours. */
+/* (di,dj,dk) is the offset from the cell in front of a face to the cell behind it. */
+void Grid::
+extend_velocity_bfs(Array3f &f, int di, int dj, int dk)
+{
+   const int stride[3]={1, f.nx, f.nx*f.ny};
+   const int dims[3]={f.nx, f.ny, f.nz};
+   vector<char> known(f.size, 0); // 0 unknown, 1 known, 2 queued for the next layer
+   vector<int> front, next;
+   vector<float> value;
+
+   #pragma omp parallel for
+   for(int k=0; k<f.nz; ++k) for(int j=0; j<f.ny; ++j) for(int i=0; i<f.nx; ++i){
+      bool behind=(i-di>=0 && j-dj>=0 && k-dk>=0 && marker(i-di,j-dj,k-dk)==FLUIDCELL);
+      bool ahead=(i<marker.nx && j<marker.ny && k<marker.nz && marker(i,j,k)==FLUIDCELL);
+      if(behind || ahead) known[i+f.nx*(j+f.ny*k)]=1;
+   }
+
+   // first layer: unknown faces with at least one known neighbour
+   for(int k=0; k<f.nz; ++k) for(int j=0; j<f.ny; ++j) for(int i=0; i<f.nx; ++i){
+      int idx=i+f.nx*(j+f.ny*k);
+      if(known[idx]) continue;
+      if((i>0 && known[idx-1]==1) || (i<f.nx-1 && known[idx+1]==1)
+         || (j>0 && known[idx-f.nx]==1) || (j<f.ny-1 && known[idx+f.nx]==1)
+         || (k>0 && known[idx-f.nx*f.ny]==1) || (k<f.nz-1 && known[idx+f.nx*f.ny]==1)){
+         known[idx]=2;
+         front.push_back(idx);
+      }
+   }
+
+   for(int layer=0; layer<extrapolation_layers && !front.empty(); ++layer){
+      value.resize(front.size());
+      #pragma omp parallel for
+      for(int n=0; n<(int)front.size(); ++n){
+         int idx=front[n];
+         int c[3]={idx%f.nx, (idx/f.nx)%f.ny, idx/(f.nx*f.ny)};
+         float total=0;
+         int count=0;
+         for(int a=0; a<3; ++a){
+            if(c[a]>0 && known[idx-stride[a]]==1){ total+=f.data[idx-stride[a]]; ++count; }
+            if(c[a]<dims[a]-1 && known[idx+stride[a]]==1){ total+=f.data[idx+stride[a]]; ++count; }
+         }
+         value[n]=total/count;
+      }
+      // commit the layer, then queue its unknown neighbours as the next one
+      for(unsigned int n=0; n<front.size(); ++n){
+         f.data[front[n]]=value[n];
+         known[front[n]]=1;
+      }
+      next.clear();
+      for(unsigned int n=0; n<front.size(); ++n){
+         int idx=front[n];
+         int c[3]={idx%f.nx, (idx/f.nx)%f.ny, idx/(f.nx*f.ny)};
+         for(int a=0; a<3; ++a){
+            if(c[a]>0 && !known[idx-stride[a]]){ known[idx-stride[a]]=2; next.push_back(idx-stride[a]); }
+            if(c[a]<dims[a]-1 && !known[idx+stride[a]]){ known[idx+stride[a]]=2; next.push_back(idx+stride[a]); }
+         }
+      }
+      front.swap(next);
    }
 }
 
@@ -10,21 +10,39 @@
 
 #include "array2.h"
 #include "array3.h"
+#include "kernels.h"
 #include "util.h"
 
 #define AIRCELL 0
 #define FLUIDCELL 1
 #define SOLIDCELL 2
 
+typedef enum ExtrapolationTypeEnum { SWEEP_EXTRAPOLATION = 0, BFS_EXTRAPOLATION = 1 } ExtrapolationType;
+
+/* Raw pointers and strides of three staggered fields, for the samplers: copied into a local, */
+/* they stay in registers across a loop over particles. */
+struct StaggeredView{
+   const float *u, *v, *w;
+   int u_sy, u_sz, v_sy, v_sz, w_sy, w_sz;
+   int nx, ny, nz; // cells along each axis
+   float overh, h;
+};
+
 struct Grid{
    float gravity;
    float lx, ly, lz;
    float h, overh;
+   ExtrapolationType extrapolation; // how velocities are extended into the air
+   int extrapolation_layers; // number of face layers the BFS extrapolation fills
 
    // active variables
    Array3f u, v, w; // staggered MAC grid of velocities
-   Array3f du, dv, dw; // saved velocities and differences for particle update
+   Array3f du, dv, dw; // saved velocities and differences for particle update (only allocated while tracked)
+   bool velocity_change; // du, dv, dw are allocated and kept up to date; only FLIP reads them
    Array3c marker; // identifies what sort of cell we have
+   Array3c solid; // cells inside the scene's solids (nonzero), kept solid besides the domain walls
+   int solid_cells; // number of them, so scenes without solids skip the mask
+   Array3f solid_phi; // signed distance to the solids at the cell centres (only allocated with solids)
    Array3f phi; // decays away from water into air (used for extrapolating velocity)
    Array3d pressure;
    // stuff for the pressure solve
@@ -41,6 +59,7 @@ struct Grid{
 
    void init(float gravity_, int cell_nx, int cell_ny, int cell_nz, float lx_);
    float CFL(void);
+   void track_velocity_change(bool on);
    void save_velocities(void);
    void add_gravity(float dt, bool centered, float cx, float cy, float cz);
    void compute_distance_to_fluid(void);
@@ -93,32 +112,188 @@ struct Grid{
         float sz=z*overh-0.5;
         k=(int)sz;
         if(k<0){ k=0; fz=0.0; }
-        else if(k>pressure.ny-2){ k=pressure.nz-2; fz=1.0; }
+        else if(k>pressure.nz-2){ k=pressure.nz-2; fz=1.0; }
         else{ fz=sz-floor(sz); }
     }
 
-    void trilerp_uvw(float px, float py, float pz, float &pu, float &pv, float &pw)
+    /* Interpolates the field f (with strides sy and sz) with the kernel's stencil whose first */
+    /* node is (i,j,k) and whose fractions along the axes are fx, fy and fz. The sums are nested */
+    /* like Array3::trilerp's, which the linear kernel reproduces exactly. */
+    template<class Kernel, int stride=1>
+    static FORCE_INLINE float interpolate(const float *f, int sy, int sz, int i, int j, int k, float fx, float fy, float fz)
     {
-        int i, j, k;
-        float fx, fy, fz;
+        const int N=Kernel::width;
+        // indexing f directly (instead of offsetting a pointer) lets the batch loops use gathers
+        int n=stride*i+sy*j+sz*k;
+        float value=0;
+        #pragma GCC unroll 4
+        for(int c=0; c<N; ++c){
+            float plane=0;
+            #pragma GCC unroll 4
+            for(int b=0; b<N; ++b){
+                float row=Kernel::weight(0, fx)*f[n+sz*c+sy*b];
+                #pragma GCC unroll 4
+                for(int a=1; a<N; ++a)
+                    row+=Kernel::weight(a, fx)*f[n+sz*c+sy*b+stride*a];
+                plane=b ? plane+Kernel::weight(b, fy)*row : Kernel::weight(0, fy)*row;
+            }
+            value=c ? value+Kernel::weight(c, fz)*plane : Kernel::weight(0, fz)*plane;
+        }
+        return value;
+    }
 
-        bary_x(px, i, fx);
-        bary_y_centre(py, j, fy);
-        bary_z_centre(pz, k, fz);
+    /* interpolate, also giving the APIC c vector of the sample: h times the sum of */
+    /* weight*value*(node offset in cells), i.e. along x */
+    /* h*(sum of a*u over the nodes at offset a - fx*sum of u over all nodes). The stride is */
+    /* that of f along x, for fields interleaved with others. */
+    template<class Kernel, int stride=1>
+    static FORCE_INLINE float interpolate_affine(const float *f, int sy, int sz, int i, int j, int k, float fx, float fy, float fz,
+                                                 float h, float &c0, float &c1, float &c2)
+    {
+        const int N=Kernel::width;
+        // the value first: its loads are then shared with the sums below, ahead of any store to c
+        float value=interpolate<Kernel, stride>(f, sy, sz, i, j, k, fx, fy, fz);
+        int n=stride*i+sy*j+sz*k;
+        float total=0, far_x=0, far_y=0, far_z=0;
+        // each sum starts at its first term, leaving the linear kernel the additions it always had
+        #pragma GCC unroll 4
+        for(int c=0; c<N; ++c){
+            #pragma GCC unroll 4
+            for(int b=0; b<N; ++b){
+                #pragma GCC unroll 4
+                for(int a=0; a<N; ++a){
+                    float u=Kernel::weight(a, fx)*Kernel::weight(b, fy)*Kernel::weight(c, fz)*f[n+sz*c+sy*b+stride*a];
+                    total=(a|b|c) ? total+u : u;
+                    if(a) far_x=(a==1 && !(b|c)) ? u : far_x+a*u;
+                    if(b) far_y=(b==1 && !(a|c)) ? u : far_y+b*u;
+                    if(c) far_z=(c==1 && !(a|b)) ? u : far_z+c*u;
+                }
+            }
+        }
+        c0=h*(far_x-fx*total);
+        c1=h*(far_y-fy*total);
+        c2=h*(far_z-fz*total);
+        return value;
+    }
 
-        pu=u.trilerp(i, j, k, fx, fy, fz);
+    /* interpolate, also giving the gradient of the interpolant in cell units: gx, gy, gz are */
+    /* its derivatives along fx, fy, fz. The sums nest like interpolate's, each row and plane */
+    /* carrying its value and its slope. */
+    template<class Kernel>
+    static FORCE_INLINE float interpolate_gradient(const float *f, int sy, int sz, int i, int j, int k, float fx, float fy, float fz,
+                                                   float &gx, float &gy, float &gz)
+    {
+        const int N=Kernel::width;
+        int n=i+sy*j+sz*k;
+        float value=0, vx=0, vy=0, vz=0;
+        #pragma GCC unroll 4
+        for(int c=0; c<N; ++c){
+            float plane=0, px=0, py=0;
+            #pragma GCC unroll 4
+            for(int b=0; b<N; ++b){
+                float node=f[n+sz*c+sy*b];
+                float row=Kernel::weight(0, fx)*node, rx=Kernel::slope(0, fx)*node;
+                #pragma GCC unroll 4
+                for(int a=1; a<N; ++a){
+                    node=f[n+sz*c+sy*b+a];
+                    row+=Kernel::weight(a, fx)*node;
+                    rx+=Kernel::slope(a, fx)*node;
+                }
+                plane=b ? plane+Kernel::weight(b, fy)*row : Kernel::weight(0, fy)*row;
+                px=b ? px+Kernel::weight(b, fy)*rx : Kernel::weight(0, fy)*rx;
+                py=b ? py+Kernel::slope(b, fy)*row : Kernel::slope(0, fy)*row;
+            }
+            value=c ? value+Kernel::weight(c, fz)*plane : Kernel::weight(0, fz)*plane;
+            vx=c ? vx+Kernel::weight(c, fz)*px : Kernel::weight(0, fz)*px;
+            vy=c ? vy+Kernel::weight(c, fz)*py : Kernel::weight(0, fz)*py;
+            vz=c ? vz+Kernel::slope(c, fz)*plane : Kernel::slope(0, fz)*plane;
+        }
+        gx=vx; gy=vy; gz=vz;
+        return value;
+    }
 
-        bary_x_centre(px, i, fx);
-        bary_y(py, j, fy);
-        bary_z_centre(pz, k, fz);
+    StaggeredView staggered_view(const Array3f &fu, const Array3f &fv, const Array3f &fw) const
+    {
+        StaggeredView s={fu.data, fv.data, fw.data, fu.nx, fu.nx*fu.ny, fv.nx, fv.nx*fv.ny, fw.nx, fw.nx*fw.ny,
+                         pressure.nx, pressure.ny, pressure.nz, overh, h};
+        return s;
+    }
 
-        pv=v.trilerp(i, j, k, fx, fy, fz);
+    /* The stencil at the cell centres (nodes 0..n-1, at s-0.5) of a point along one axis, from */
+    /* its coordinate s in cell units. It's clamped into the grid, keeping the fraction relative */
+    /* to its first node. */
+    template<class Kernel>
+    static FORCE_INLINE void centre_stencil(float s, int n, int &i, float &f)
+    {
+        int index;
+        Kernel::stencil(s-0.5f, index, f);
+        int last=n-Kernel::width;
+        i=index<0 ? 0 : (index>last ? last : index);
+        f+=index-i;
+    }
 
-        bary_x_centre(px, i, fx);
-        bary_y_centre(py, j, fy);
-        bary_z(pz, k, fz);
+    /* The stencils of a point along one axis on the faces (nodes 0..n) and at the cell centres. */
+    /* Particles stay 1.001h inside the walls, so only the centre stencil can reach past the grid. */
+    template<class Kernel>
+    static FORCE_INLINE void staggered_stencils(float s, int n, int &i, float &f, int &ic, float &fc)
+    {
+        Kernel::stencil(s, i, f);
+        centre_stencil<Kernel>(s, n, ic, fc);
+    }
 
-        pw=w.trilerp(i, j, k, fx, fy, fz);
+    /* Samples three staggered fields (u, v, w or du, dv, dw) at one point with the given kernel. */
+    /* The stencils are computed once per axis and shared by the components. If c isn't null it */
+    /* gets the nine APIC c values too, c[3*a+b] for component a. */
+    template<class Kernel>
+    static void sample_staggered(const StaggeredView &s, float x, float y, float z,
+                                 float &pu, float &pv, float &pw, float *c=0)
+    {
+        int i, ic, j, jc, k, kc;
+        float fx, fxc, fy, fyc, fz, fzc;
+        staggered_stencils<Kernel>(x*s.overh, s.nx, i, fx, ic, fxc);
+        staggered_stencils<Kernel>(y*s.overh, s.ny, j, fy, jc, fyc);
+        staggered_stencils<Kernel>(z*s.overh, s.nz, k, fz, kc, fzc);
+        if(c){
+            pu=interpolate_affine<Kernel>(s.u, s.u_sy, s.u_sz, i, jc, kc, fx, fyc, fzc, s.h, c[0], c[1], c[2]);
+            pv=interpolate_affine<Kernel>(s.v, s.v_sy, s.v_sz, ic, j, kc, fxc, fy, fzc, s.h, c[3], c[4], c[5]);
+            pw=interpolate_affine<Kernel>(s.w, s.w_sy, s.w_sz, ic, jc, k, fxc, fyc, fz, s.h, c[6], c[7], c[8]);
+        }else{
+            pu=interpolate<Kernel>(s.u, s.u_sy, s.u_sz, i, jc, kc, fx, fyc, fzc);
+            pv=interpolate<Kernel>(s.v, s.v_sy, s.v_sz, ic, j, kc, fxc, fy, fzc);
+            pw=interpolate<Kernel>(s.w, s.w_sy, s.w_sz, ic, jc, k, fxc, fyc, fz);
+        }
+    }
+
+    /* sample_staggered at n points, vectorized across the points (with gathers for the node */
+    /* values). If c isn't null, c[3*a+b][q] gets the c values of point q. */
+    template<class Kernel=LinearKernel>
+    void sample_staggered_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                                const float *x, const float *y, const float *z, int n,
+                                float *pu, float *pv, float *pw, float *const *c=0) const;
+
+    /* sample_staggered_batch, also giving the gradient of the sampled field: g[3*a+b][q] is the */
+    /* derivative of component a along axis b at point q, per unit length. */
+    template<class Kernel=LinearKernel>
+    void sample_staggered_gradient_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                                         const float *x, const float *y, const float *z, int n,
+                                         float *pu, float *pv, float *pw, float *const *g) const;
+
+    /* sample_staggered_batch from cached stencils: the cell coordinates of the points in 16.16 */
+    /* fixed point per axis, i.e. the cell index above a fraction quantized to 1/65536 of a cell. */
+    template<class Kernel=LinearKernel>
+    void sample_staggered_cached(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                                 const unsigned int *sx, const unsigned int *sy, const unsigned int *sz, int n,
+                                 float *pu, float *pv, float *pw, float *const *c=0) const;
+
+    /* the 16.16 fixed point cell coordinate of x, truncated so its cell index is bary_x's */
+    unsigned int fixed_coordinate(float x) const
+    {
+        return (unsigned int)(x*overh*65536.f);
+    }
+
+    void trilerp_uvw(float px, float py, float pz, float &pu, float &pv, float &pw) const
+    {
+        sample_staggered<LinearKernel>(staggered_view(u, v, w), px, py, pz, pu, pv, pw);
     }
 
    private:
@@ -128,6 +303,7 @@ struct Grid{
    void sweep_v(int i0, int i1, int j0, int j1, int k0, int k1);
    void sweep_w(int i0, int i1, int j0, int j1, int k0, int k1);
    void sweep_velocity(void);
+   void extend_velocity_bfs(Array3f &f, int di, int dj, int dk);
    void find_divergence(void);
    void form_poisson(void);
    void form_preconditioner(void);
@@ -135,7 +311,101 @@ struct Grid{
    void apply_preconditioner(const Array3d &x, Array3d &y, Array3d &temp);
    void solve_pressure(int maxits, double tolerance);
    void add_gradient(void);
+   template<class Kernel, class Source>
+   static void sample_batch(const StaggeredView &s, const Source &source, int n, float *pu, float *pv, float *pw, float *const *c);
 };
 
-#endif
+/* Coordinate sources for Grid::sample_batch: they give the coordinate in cell units of point q */
+/* along an axis, from its position or from a cached fixed point coordinate. */
+struct PositionSource{
+   const float *x[3];
+   float overh;
+
+   float operator()(int q, int axis) const
+   { return x[axis][q]*overh; }
+};
+
+struct FixedSource{
+   const unsigned int *x[3];
 
+   float operator()(int q, int axis) const
+   { return x[axis][q]*(1.f/65536); }
+};
+
+template<class Kernel, class Source>
+inline void Grid::
+sample_batch(const StaggeredView &s, const Source &source, int n, float *pu, float *pv, float *pw, float *const *c)
+{
+   if(c){
+      float *c0=c[0], *c1=c[1], *c2=c[2], *c3=c[3], *c4=c[4], *c5=c[5], *c6=c[6], *c7=c[7], *c8=c[8];
+      #pragma omp simd
+      for(int q=0; q<n; ++q){
+         int i, ic, j, jc, k, kc;
+         float fx, fxc, fy, fyc, fz, fzc;
+         staggered_stencils<Kernel>(source(q, 0), s.nx, i, fx, ic, fxc);
+         staggered_stencils<Kernel>(source(q, 1), s.ny, j, fy, jc, fyc);
+         staggered_stencils<Kernel>(source(q, 2), s.nz, k, fz, kc, fzc);
+         pu[q]=interpolate_affine<Kernel>(s.u, s.u_sy, s.u_sz, i, jc, kc, fx, fyc, fzc, s.h, c0[q], c1[q], c2[q]);
+         pv[q]=interpolate_affine<Kernel>(s.v, s.v_sy, s.v_sz, ic, j, kc, fxc, fy, fzc, s.h, c3[q], c4[q], c5[q]);
+         pw[q]=interpolate_affine<Kernel>(s.w, s.w_sy, s.w_sz, ic, jc, k, fxc, fyc, fz, s.h, c6[q], c7[q], c8[q]);
+      }
+   }else{
+      #pragma omp simd
+      for(int q=0; q<n; ++q){
+         int i, ic, j, jc, k, kc;
+         float fx, fxc, fy, fyc, fz, fzc;
+         staggered_stencils<Kernel>(source(q, 0), s.nx, i, fx, ic, fxc);
+         staggered_stencils<Kernel>(source(q, 1), s.ny, j, fy, jc, fyc);
+         staggered_stencils<Kernel>(source(q, 2), s.nz, k, fz, kc, fzc);
+         pu[q]=interpolate<Kernel>(s.u, s.u_sy, s.u_sz, i, jc, kc, fx, fyc, fzc);
+         pv[q]=interpolate<Kernel>(s.v, s.v_sy, s.v_sz, ic, j, kc, fxc, fy, fzc);
+         pw[q]=interpolate<Kernel>(s.w, s.w_sy, s.w_sz, ic, jc, k, fxc, fyc, fz);
+      }
+   }
+}
+
+template<class Kernel>
+inline void Grid::
+sample_staggered_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                       const float *x, const float *y, const float *z, int n,
+                       float *pu, float *pv, float *pw, float *const *c) const
+{
+   PositionSource source={{x, y, z}, overh};
+   sample_batch<Kernel>(staggered_view(fu, fv, fw), source, n, pu, pv, pw, c);
+}
+
+template<class Kernel>
+inline void Grid::
+sample_staggered_cached(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                        const unsigned int *sx, const unsigned int *sy, const unsigned int *sz, int n,
+                        float *pu, float *pv, float *pw, float *const *c) const
+{
+   FixedSource source={{sx, sy, sz}};
+   sample_batch<Kernel>(staggered_view(fu, fv, fw), source, n, pu, pv, pw, c);
+}
+
+template<class Kernel>
+inline void Grid::
+sample_staggered_gradient_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw,
+                                const float *x, const float *y, const float *z, int n,
+                                float *pu, float *pv, float *pw, float *const *g) const
+{
+   StaggeredView s=staggered_view(fu, fv, fw);
+   float *g0=g[0], *g1=g[1], *g2=g[2], *g3=g[3], *g4=g[4], *g5=g[5], *g6=g[6], *g7=g[7], *g8=g[8];
+   #pragma omp simd
+   for(int q=0; q<n; ++q){
+      int i, ic, j, jc, k, kc;
+      float fx, fxc, fy, fyc, fz, fzc, gx, gy, gz;
+      staggered_stencils<Kernel>(x[q]*s.overh, s.nx, i, fx, ic, fxc);
+      staggered_stencils<Kernel>(y[q]*s.overh, s.ny, j, fy, jc, fyc);
+      staggered_stencils<Kernel>(z[q]*s.overh, s.nz, k, fz, kc, fzc);
+      pu[q]=interpolate_gradient<Kernel>(s.u, s.u_sy, s.u_sz, i, jc, kc, fx, fyc, fzc, gx, gy, gz);
+      g0[q]=gx*s.overh; g1[q]=gy*s.overh; g2[q]=gz*s.overh;
+      pv[q]=interpolate_gradient<Kernel>(s.v, s.v_sy, s.v_sz, ic, j, kc, fxc, fy, fzc, gx, gy, gz);
+      g3[q]=gx*s.overh; g4[q]=gy*s.overh; g5[q]=gz*s.overh;
+      pw[q]=interpolate_gradient<Kernel>(s.w, s.w_sy, s.w_sz, ic, jc, k, fxc, fyc, fz, gx, gy, gz);
+      g6[q]=gx*s.overh; g7[q]=gy*s.overh; g8[q]=gz*s.overh;
+   }
+}
+
+#endif
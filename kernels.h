@@ -0,0 +1,105 @@
+/**
+ * Transfer kernel policies: the B-spline weights with which the particle/grid transfers spread
+ * a particle along each axis. The transfer loops are templates over a policy, so the width of
+ * the stencil is a compile-time constant and the N^3 node loops unroll completely.
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cmath>
+
+/* The kernel functions and the interpolation templates built on them have to inline into the */
+/* batch loops, which can't vectorize around a call; it's forced, since the templates outgrow */
+/* the compiler's inlining limits once a translation unit instantiates several of them. */
+#ifdef __GNUC__
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
+typedef enum TransferKernelEnum { LINEAR_KERNEL = 0, QUADRATIC_KERNEL = 1, CUBIC_KERNEL = 2 } TransferKernel;
+
+/* A policy has the width of its stencil along an axis and four functions. stencil gives, for */
+/* a coordinate s in node units (node i at s=i), the first node base of the stencil and the */
+/* fraction f=s-base. weight(o, f) is the weight of node base+o, at o-f cells from the particle, */
+/* and slope(o, f) its derivative along s; they're evaluated where they're used rather than */
+/* stored, which keeps vectorized loops in registers (the unrolled node loops share the */
+/* evaluations). affine_scale turns the c vectors stored on */
+/* the particles, h*sum of weight*velocity*(node offset in cells), into the affine velocity */
+/* the P2G adds at a node: affine_scale(h)*dot(c, node offset in cells). */
+
+struct LinearKernel{
+   enum { width=2 };
+
+   /* the transfers' original APIC convention */
+   static float affine_scale(float h)
+   { return h; }
+
+   /* bary_x's barycentric coordinates */
+   static void stencil(float s, int &base, float &f)
+   {
+      base=(int)s;
+      f=s-std::floor(s);
+   }
+
+   static float weight(int o, float f)
+   { return o ? f : 1-f; }
+
+   static float slope(int o, float f)
+   { return o ? 1.f : -1.f; }
+};
+
+struct QuadraticKernel{
+   enum { width=3 };
+
+   /* h/D for the APIC inertia D=h^2/4 of the quadratic B-spline */
+   static float affine_scale(float h)
+   { return 4/h; }
+
+   static void stencil(float s, int &base, float &f)
+   {
+      base=(int)std::floor(s-0.5f);
+      f=s-base;
+   }
+
+   static float weight(int o, float f)
+   {
+      float d=std::fabs(o-f);
+      return d<0.5f ? 0.75f-d*d : (d<1.5f ? 0.5f*(1.5f-d)*(1.5f-d) : 0.f);
+   }
+
+   static float slope(int o, float f)
+   {
+      float d=o-f, a=std::fabs(d);
+      return a<0.5f ? 2*d : (a<1.5f ? std::copysign(1.5f-a, d) : 0.f);
+   }
+};
+
+struct CubicKernel{
+   enum { width=4 };
+
+   /* h/D for the APIC inertia D=h^2/3 of the cubic B-spline */
+   static float affine_scale(float h)
+   { return 3/h; }
+
+   static void stencil(float s, int &base, float &f)
+   {
+      base=(int)std::floor(s)-1;
+      f=s-base;
+   }
+
+   static float weight(int o, float f)
+   {
+      float d=std::fabs(o-f);
+      return d<1 ? (0.5f*d-1)*d*d+2.f/3 : (d<2 ? (2-d)*(2-d)*(2-d)*(1.f/6) : 0.f);
+   }
+
+   static float slope(int o, float f)
+   {
+      float d=o-f, a=std::fabs(d);
+      return a<1 ? (2-1.5f*a)*d : (a<2 ? std::copysign(0.5f*(2-a)*(2-a), d) : 0.f);
+   }
+};
+
+#endif
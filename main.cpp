@@ -7,12 +7,14 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
 #include "particles.h"
 #include "util.h"
 #include "shared_main.h"
 
 #define N_ITER (100)
+#define FRAME_TIME (1./30)
 using namespace std;
 
 
@@ -22,8 +24,26 @@ int main(int argc, char **argv)
    if( USE_SPHERICAL_GRAV )
       gravity *= GRAV_FACTOR;
    Grid grid(gravity, 50, 50, 50, 1);
+   grid.extrapolation = EXTRAPOLATION_TYPE;
+   grid.extrapolation_layers = EXTRAPOLATION_LAYERS;
    SimulationType sType = SIMULATION_TYPE;
    
+   // --resume checkpoint carries on the run that wrote the checkpoint, with its scheme
+   const char *resume=0;
+   CheckpointHeader checkpoint;
+   for(int a=1; a+1<argc; ++a){
+      if(strcmp(argv[a], "--resume")) continue;
+      resume=argv[a+1];
+      for(int b=a; b+2<argc; ++b)
+         argv[b]=argv[b+2];
+      argc-=2;
+      break;
+   }
+   if(resume && !read_checkpoint_header(resume, checkpoint)){
+      printf("%s isn't a checkpoint\n", resume);
+      return 1;
+   }
+
    std::string outputpath=".";
 
    if(argc>1) outputpath=argv[1];
@@ -40,16 +60,56 @@ int main(int argc, char **argv)
       else if(!simType.compare("pic"))
          sType = PIC;
    }
+   if(resume)
+      sType = (SimulationType)checkpoint.scheme;
    Particles particles(grid, sType);
+   grid.track_velocity_change(sType == FLIP);
+   particles.sort_interval = SORT_INTERVAL;
+   particles.sort_locality_threshold = SORT_LOCALITY_THRESHOLD;
+   particles.cache_stencils = CACHE_STENCILS;
+   particles.kernel = TRANSFER_KERNEL;
+   particles.engine = TRANSFER_ENGINE;
+   particles.substep_cfl = ADVECTION_CFL;
+   particles.substep_tolerance = ADVECTION_TOLERANCE;
+   particles.affine_advection = ADVECTION_AFFINE;
+   particles.affine_radius = ADVECTION_AFFINE_RADIUS;
 
-   init_water_drop(grid, particles, 2, 2, 2);
-   particles.write_to_file("%s/frameparticles%04d", outputpath.c_str(), 0);
+   int first_frame=1;
+   if(resume){
+      if(!read_checkpoint(resume, grid, particles, checkpoint)){
+         printf("couldn't resume from %s: it isn't of this grid or is cut short\n", resume);
+         return 1;
+      }
+      printf("resumed from %s at frame %d\n", resume, checkpoint.frame);
+      first_frame=checkpoint.frame+1;
+   }else{
+      Scene scene;
+      if(argc>3 ? !scene.read(argv[3]) : !scene.parse(DEFAULT_SCENE, "the default scene"))
+         return 1;
+      init_scene(grid, particles, scene, 2, 2, 2);
+   }
+   ArchiveWriter *archive=open_frame_archive(outputpath.c_str(), resume!=0);
+   AsyncWriter *writer=ASYNC_OUTPUT ? new AsyncWriter(OUTPUT_BUFFERS, archive) : 0;
+   FrameEncoder encoder(FRAME_PRECISION, FRAME_VELOCITY_STEP, FRAME_TIME, FRAME_KEYFRAME_INTERVAL);
+   FieldEncoder fields;
+   SliceStream *slices=open_slice_stream(grid, outputpath.c_str(), (first_frame-1)*FRAME_TIME, resume!=0);
+   ForkCheckpointer *checkpointer=CHECKPOINT_FORK ? new ForkCheckpointer(CHECKPOINT_SNAPSHOTS, CHECKPOINT_HEADROOM) : 0;
+   if(!resume)
+      output_frame(particles, writer, archive, &encoder, outputpath.c_str(), 0, 0);
 
-   for(int i=1; i<N_ITER + 1; ++i){
+   for(int i=first_frame; i<N_ITER + 1; ++i){
       printf("===================================================> step %d...\n", i);
-      advance_one_frame(grid, particles, 1./30);
-      particles.write_to_file("%s/frameparticles%04d", outputpath.c_str(), i);
+      advance_one_frame(grid, particles, FRAME_TIME, slices);
+      output_frame(particles, writer, archive, &encoder, outputpath.c_str(), i, i*FRAME_TIME);
+      if(FIELD_INTERVAL>0 && i%FIELD_INTERVAL==0)
+         output_fields(grid, writer, fields, outputpath.c_str(), i, i*FRAME_TIME);
+      if(CHECKPOINT_INTERVAL>0 && i%CHECKPOINT_INTERVAL==0)
+         save_checkpoint(grid, particles, checkpointer, outputpath.c_str(), i, i*FRAME_TIME);
    }
+   delete writer; // after the frames still queued are written
+   delete archive;
+   delete checkpointer; // after the snapshots still being written finish
+   delete slices;
 
    return 0;
 }
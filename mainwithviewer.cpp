@@ -18,6 +18,8 @@ using namespace std;
 char frame_number[100]="frame 0";
 Grid* pGrid;
 Particles* pParticles;
+FrameEncoder* pEncoder;
+ArchiveWriter* pArchive;
 std::string outputpath;
 double frametime = 1./30;
 int stepCount;
@@ -68,7 +70,7 @@ void key_handler(unsigned char key, int x, int y)
          advance_one_frame(*pGrid, *pParticles, 1./30);
          ++stepCount;
          printf("===================================================> step %d...\n", stepCount);
-         pParticles->write_to_file("%s/frameparticles%04d", outputpath.c_str(), stepCount);
+         output_frame(*pParticles, 0, pArchive, pEncoder, outputpath.c_str(), stepCount, stepCount*frametime); // synchronous: the viewer never leaves its main loop to drain a writer
          sprintf(frame_number, "frame %d", stepCount);
          glutPostRedisplay();
          break;
@@ -84,6 +86,8 @@ int main(int argc, char **argv)
    if( USE_SPHERICAL_GRAV )
       gravity *= GRAV_FACTOR;
    pGrid = new Grid(gravity, 50, 50, 50, 1);
+   pGrid->extrapolation = EXTRAPOLATION_TYPE;
+   pGrid->extrapolation_layers = EXTRAPOLATION_LAYERS;
    SimulationType sType = SIMULATION_TYPE;
    
    outputpath=".";
@@ -103,10 +107,26 @@ int main(int argc, char **argv)
          sType = PIC;
    }
    pParticles = new Particles(*pGrid, sType);
+   pGrid->track_velocity_change(sType == FLIP);
+   pParticles->sort_interval = SORT_INTERVAL;
+   pParticles->sort_locality_threshold = SORT_LOCALITY_THRESHOLD;
+   pParticles->cache_stencils = CACHE_STENCILS;
+   pParticles->kernel = TRANSFER_KERNEL;
+   pParticles->engine = TRANSFER_ENGINE;
+   pParticles->substep_cfl = ADVECTION_CFL;
+   pParticles->substep_tolerance = ADVECTION_TOLERANCE;
+   pParticles->affine_advection = ADVECTION_AFFINE;
+   pParticles->affine_radius = ADVECTION_AFFINE_RADIUS;
+
+   Scene scene;
+   if(argc>3 ? !scene.read(argv[3]) : !scene.parse(DEFAULT_SCENE, "the default scene"))
+      return 1;
 
    Gluvi::init("fluid simulation viewer woohoo", &argc, argv);
-   init_water_drop(*pGrid, *pParticles, 2, 2, 2);
-   pParticles->write_to_file("%s/frameparticles%04d", outputpath.c_str(), 0);
+   init_scene(*pGrid, *pParticles, scene, 2, 2, 2);
+   pEncoder = new FrameEncoder(FRAME_PRECISION, FRAME_VELOCITY_STEP, frametime, FRAME_KEYFRAME_INTERVAL);
+   pArchive = open_frame_archive(outputpath.c_str(), false);
+   output_frame(*pParticles, 0, pArchive, pEncoder, outputpath.c_str(), 0, 0);
    stepCount = 0;
 
    glutKeyboardFunc(key_handler);
@@ -0,0 +1,108 @@
+/**
+ * The asynchronous writer thread.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include "archive.h"
+#include "output.h"
+
+using namespace std;
+
+AsyncWriter::
+AsyncWriter(int nbuffers, ArchiveWriter *archive_)
+   :waited_ms(0), written(0), failed(0), archive(archive_), buffers(nbuffers), stopping(false), writing(false)
+{
+   for(int b=0; b<nbuffers; ++b)
+      available.push_back(&buffers[b]);
+   thread=std::thread(&AsyncWriter::run, this);
+}
+
+/* writes whatever is still queued before the thread ends */
+AsyncWriter::
+~AsyncWriter()
+{
+   {
+      lock_guard<mutex> guard(lock);
+      stopping=true;
+   }
+   changed.notify_all();
+   thread.join();
+}
+
+/* a buffer to fill, waiting for the writer to finish one if none is free */
+OutputBuffer *AsyncWriter::
+acquire(void)
+{
+   unique_lock<mutex> guard(lock);
+   if(available.empty()){
+      chrono::steady_clock::time_point start=chrono::steady_clock::now();
+      while(available.empty())
+         changed.wait(guard);
+      waited_ms+=chrono::duration<double, milli>(chrono::steady_clock::now()-start).count();
+   }
+   OutputBuffer *buffer=available.back();
+   available.pop_back();
+   return buffer;
+}
+
+void AsyncWriter::
+submit(OutputBuffer *buffer)
+{
+   {
+      lock_guard<mutex> guard(lock);
+      queue.push_back(buffer);
+   }
+   changed.notify_all();
+}
+
+/* waits until everything submitted has been written */
+void AsyncWriter::
+flush(void)
+{
+   unique_lock<mutex> guard(lock);
+   while(!queue.empty() || writing)
+      changed.wait(guard);
+}
+
+/* writes size bytes to the file in as many writes as it takes */
+bool write_whole_file(const char *filename, const char *data, size_t size)
+{
+   int fd=open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd<0) return false;
+   while(size>0){
+      ssize_t n=write(fd, data, size);
+      if(n<0 && errno==EINTR) continue;
+      if(n<0) break;
+      data+=n;
+      size-=n;
+   }
+   return close(fd)==0 && size==0;
+}
+
+void AsyncWriter::
+run(void)
+{
+   unique_lock<mutex> guard(lock);
+   for(;;){
+      while(!stopping && queue.empty())
+         changed.wait(guard);
+      if(queue.empty()) return; // stopping, with nothing left to write
+      OutputBuffer *buffer=queue.front();
+      queue.pop_front();
+      writing=true;
+      guard.unlock();
+      bool ok=(archive && buffer->archived) ? archive->append(buffer->data.data(), buffer->data.size())
+                      : write_whole_file(buffer->filename.c_str(), buffer->data.data(), buffer->data.size());
+      if(!ok) printf("couldn't write %s\n", buffer->filename.c_str());
+      guard.lock();
+      written+=ok;
+      failed+=!ok;
+      writing=false;
+      available.push_back(buffer);
+      changed.notify_all();
+   }
+}
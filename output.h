@@ -0,0 +1,59 @@
+/**
+ * Asynchronous output: a writer thread that writes files while the simulation goes on.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct ArchiveWriter;
+
+/* a file waiting to be written: its name and its bytes */
+struct OutputBuffer{
+   std::string filename;
+   std::vector<char> data;
+   bool archived; // a frame for the writer's archive, if it has one, rather than for the file
+
+   OutputBuffer()
+      :archived(false)
+   {}
+};
+
+/* The simulation takes a free buffer with acquire, fills it and hands it over with submit, and */
+/* the writer thread writes the submitted buffers in order and recycles them. There is a fixed */
+/* number of buffers (two is double buffering: one filling while the other is written), so when */
+/* the writer falls behind acquire waits for it, which bounds the memory held by pending output; */
+/* waited_ms adds up the time acquire has waited. Given an archive, the writer appends the */
+/* archived buffers to it instead of writing them to their files. */
+struct AsyncWriter{
+   double waited_ms;
+   int written, failed; // files written, and files that couldn't be
+   ArchiveWriter *archive; // the writer thread's alone until it ends
+
+   AsyncWriter(int nbuffers, ArchiveWriter *archive_=0);
+   ~AsyncWriter();
+   OutputBuffer *acquire(void);
+   void submit(OutputBuffer *buffer);
+   void flush(void);
+
+   private:
+   std::vector<OutputBuffer> buffers;
+   std::vector<OutputBuffer *> available;
+   std::deque<OutputBuffer *> queue;
+   std::mutex lock;
+   std::condition_variable changed;
+   bool stopping, writing;
+   std::thread thread;
+
+   void run(void);
+};
+
+bool write_whole_file(const char *filename, const char *data, size_t size);
+
+#endif
@@ -1 +1 @@
-/** * Implementation of the Particles functions. Most of your edits should be in here. * * @author Ante Qu, 2017 * Based on Bridson's simple_flip2d starter code at http://www.cs.ubc.ca/~rbridson/ */#include <cmath>#include <cstdarg>#include <cstdio>#include <cstdlib>#include "particles.h"#include "util.h"using namespace std;void Particles::add_particle(const Vec3f &px, const Vec3f &pu){   x.push_back(px);   u.push_back(pu);   /* TODO: initialize the variables you created in particles.h */   cx.push_back(Vec3f(0.f,0.f,0.f));   cy.push_back(Vec3f(0.f,0.f,0.f));   cz.push_back(Vec3f(0.f,0.f,0.f));   ++np;}template<class T>void Particles::accumulate(T &accum, float q, int i, int j, int k, float fx, float fy, float fz){   float weight;   float diff_z = 1-fz, diff_y = 1-fy, diff_x = 1-fx;   weight=diff_x*diff_y*diff_z;   accum(i,j,k)+=weight*q;   sum(i,j,k)+=weight;   weight=fx*diff_y*diff_z;   accum(i+1,j,k)+=weight*q;   sum(i+1,j,k)+=weight;   weight=diff_x*fy*diff_z;   accum(i,j+1,k)+=weight*q;   sum(i,j+1,k)+=weight;   weight=fx*fy*diff_z;   accum(i+1,j+1,k)+=weight*q;   sum(i+1,j+1,k)+=weight;   weight=diff_x*diff_y*fz;   accum(i,j,k+1)+=weight*q;   sum(i,j,k+1)+=weight;   weight=fx*diff_y*fz;   accum(i+1,j,k+1)+=weight*q;   sum(i+1,j,k+1)+=weight;   weight=diff_x*fy*fz;   accum(i,j+1,k+1)+=weight*q;   sum(i,j+1,k+1)+=weight;   weight=fx*fy*fz;   accum(i+1,j+1,k+1)+=weight*q;   sum(i+1,j+1,k+1)+=weight;}/* call this function to incorporate c[] when transfering particles to grid *//* This function should take the c_pa^n values from c, and update them, with proper weighting, *//*  into the correct grid velocity values in accum */template<class T>void Particles::affineFix(T &accum, Vec3f c, int i, int j, int k, float fx, float fy, float fz){   /* TODO: fill this in */   float weight;   float diff_z = 1-fz, diff_y = 1-fy, diff_x = 1-fx;   weight=diff_x*diff_y*diff_z;   accum(i,j,k)+= weight * dot(c, Vec3f(-fx, -fy,-fz) * grid.h);   weight=fx*diff_y*diff_z;   accum(i+1,j,k)+= weight * dot(c, Vec3f(1-fx, -fy,-fz) * grid.h);   weight=diff_x*fy*diff_z;   accum(i,j+1,k)+= weight * dot(c, Vec3f(-fx, 1-fy,-fz) * grid.h);   weight=fx*fy*diff_z;   accum(i+1,j+1,k)+= weight * dot(c, Vec3f(1-fx, 1-fy,-fz) * grid.h);   weight=diff_x*diff_y*fz;   accum(i,j,k+1)+= weight * dot(c, Vec3f(-fx, -fy,1-fz) * grid.h);   weight=fx*diff_y*fz;   accum(i+1,j,k+1)+= weight * dot(c, Vec3f(1-fx, -fy,1-fz) * grid.h);   weight=diff_x*fy*fz;   accum(i,j+1,k+1)+= weight * dot(c, Vec3f(-fx, 1-fy,1-fz) * grid.h);   weight=fx*fy*fz;   accum(i+1,j+1,k+1)+= weight * dot(c, Vec3f(1-fx, 1-fy,1-fz) * grid.h);}void Particles::transfer_to_grid(void){   int p, i, ui, j, vj, k, wk;   float fx, ufx, fy, vfy, fz, wfz;   grid.u.zero();   sum.zero();   for(p=0; p<np; ++p){      grid.bary_x(x[p][0], ui, ufx);      grid.bary_y_centre(x[p][1], j, fy);      grid.bary_z_centre(x[p][2], k, fz);      accumulate(grid.u, u[p][0], ui, j, k, ufx, fy, fz);      /* TODO: call affineFix to incorporate c_px^n into the grid.u update */      if (simType == APIC)        affineFix(grid.u, cx[p], ui, j, k, ufx, fy, fz);   }   for(j=0; j<grid.u.ny; ++j) for(i=0; i<grid.u.nx; ++i) for(k=0; k<grid.u.nz; ++k){      if(sum(i,j,k)!=0) grid.u(i,j,k)/=sum(i,j,k);   }   grid.v.zero();   sum.zero();   for(p=0; p<np; ++p){      grid.bary_x_centre(x[p][0], i, fx);      grid.bary_y(x[p][1], vj, vfy);      accumulate(grid.v, u[p][1] , i, vj, k, fx, vfy, fz);      /* TODO: call affineFix to incorporate c_py^n into the grid.v update */      if (simType == APIC)        affineFix(grid.v, cy[p], i, vj, k, fx, vfy, fz);   }   for(j=0; j<grid.v.ny; ++j) for(i=0; i<grid.v.nx; ++i) for(k=0; k<grid.v.nz; ++k){      if(sum(i,j,k)!=0) grid.v(i,j,k)/=sum(i,j,k);   }   grid.w.zero();   sum.zero();   for(p=0; p<np; ++p){      grid.bary_y_centre(x[p][1], j, fy);      grid.bary_z(x[p][2], wk, wfz);      accumulate(grid.w, u[p][2] , i, j, wk, fx, fy, wfz);      /* TODO: call affineFix to incorporate c_py^n into the grid.v update */      if (simType == APIC)         affineFix(grid.w, cz[p], i, vj, wk, fx, fy, wfz);   }   for(j=0; j<grid.w.ny; ++j) for(i=0; i<grid.w.nx; ++i) for(k=0; k<grid.w.nz; ++k){            if(sum(i,j,k)!=0) grid.w(i,j,k)/=sum(i,j,k);   }   // identify where particles are in grid   grid.marker.zero();   for(p=0; p<np; ++p){      grid.bary_x(x[p][0], i, fx);      grid.bary_y(x[p][1], j, fy);      grid.bary_z(x[p][2], k, fz);      grid.marker(i,j,k)=FLUIDCELL;   }}/* this function computes c from the gradient of w and the velocity field from the grid. */Vec3f Particles::computeC(Array3f &ufield, int i, int j, int k, float fx, float fy, float fz){   /* TODO: fill this in */   Vec3f newC = Vec3f(0.f,0.f,0.f);   Vec3f weight_prime;   float weight;   float diff_z = 1-fz, diff_y = 1-fy, diff_x = 1-fx;   // i, j, k   weight = diff_x*diff_y*diff_z;   weight_prime = Vec3f(-fx, -fy,-fz) * grid.h;   newC += weight * weight_prime * ufield(i,j,k);   // i+1, j, k   weight = fx*diff_y*diff_z;   weight_prime = Vec3f(diff_x, -fy,-fz) * grid.h;   newC += weight * weight_prime * ufield(i+1,j,k);   // i, j+1, k   weight = diff_x*fy*diff_z;   weight_prime = Vec3f(-fx, diff_y,-fz) * grid.h;   newC += weight * weight_prime * ufield(i, j+1,k);   // i+1, j+1, k   weight = fx*fy*diff_z;   weight_prime = Vec3f(diff_x, diff_y,-fz) * grid.h;   newC += weight * weight_prime * ufield(i+1, j+1,k);   // i, j, k+1   weight = diff_x*diff_y*fz;   weight_prime = Vec3f(-fx, -fy,diff_z) * grid.h;   newC += weight * weight_prime * ufield(i,j,k+1);   // i+1, j, k   weight = fx*diff_y*fz;   weight_prime = Vec3f(diff_x, -fy,diff_z) * grid.h;   newC += weight * weight_prime * ufield(i+1,j,k+1);   // i, j+1, k   weight = diff_x*fy*fz;   weight_prime = Vec3f(-fx, diff_y,diff_z) * grid.h;   newC += weight * weight_prime * ufield(i, j+1,k+1);   // i+1, j+1, k   weight = fx*fy*fz;   weight_prime = Vec3f(diff_x, diff_y,diff_z) * grid.h;   newC += weight * weight_prime * ufield(i+1, j+1,k+1);   return newC;}void Particles::update_from_grid(void){   int p;   int i, ui, j, vj, k, wk;   float fx, ufx, fy, vfy, fz, wfz;   for(p=0; p<np; ++p){      grid.bary_x(x[p][0], ui, ufx);      grid.bary_x_centre(x[p][0], i, fx);      grid.bary_y(x[p][1], vj, vfy);      grid.bary_y_centre(x[p][1], j, fy);      grid.bary_z(x[p][2], wk, wfz);      grid.bary_z_centre(x[p][2], k, fz);      if( simType == FLIP )      {         u[p]+=Vec3f(grid.du.trilerp(ui, j, k, ufx, fy, fz), grid.dv.trilerp(i, vj, k, fx, vfy, fz), grid.dw.trilerp(i, j, wk, fx, fy, wfz)); // FLIP      }      else      {         u[p]=Vec3f(grid.u.trilerp(ui, j, k, ufx, fy, fz), grid.v.trilerp(i, vj, k, fx, vfy, fz), grid.w.trilerp(i, j, wk, fx, fy, wfz)); // PIC and APIC         if( simType == APIC )         {            /* TODO: call computeC with the right indices to compute c_px^n and c_py^n */            cx[p] = computeC(grid.u, ui, j, k, ufx, fy, fz); // APIC            cy[p] = computeC(grid.v, i, vj, k, fx, vfy, fz); // APIC            cz[p] = computeC(grid.w, i, j, wk, fx, fy, wfz); // APIC         }      }   }}void Particles::move_particles_in_grid(float dt){   Vec3f midx, gu;   float xmin=1.001*grid.h, xmax=grid.lx-1.001*grid.h;   float ymin=1.001*grid.h, ymax=grid.ly-1.001*grid.h;   float zmin=1.001*grid.h, zmax=grid.lz-1.001*grid.h;   for(int p=0; p<np; ++p){      // first stage of Runge-Kutta 2 (do a half Euler step)      grid.trilerp_uvw(x[p][0], x[p][1], x[p][2], gu[0], gu[1], gu[2]);      midx=x[p]+0.5*dt*gu;      clamp(midx[0], xmin, xmax);      clamp(midx[1], ymin, ymax);      clamp(midx[2], zmin, zmax);      // second stage of Runge-Kutta 2      grid.trilerp_uvw(midx[0], midx[1], x[p][2], gu[0], gu[1], gu[2]);      x[p]+=dt*gu;      clamp(x[p][0], xmin, xmax);      clamp(x[p][1], ymin, ymax);      clamp(x[p][2], zmin, zmax);   }}void Particles::write_to_file(const char *filename_format, ...){   va_list ap;   va_start(ap, filename_format);   char *filename;   vasprintf(&filename, filename_format, ap);   FILE *fp=fopen(filename, "wt");   free(filename);   va_end(ap);   fprintf(fp, "%d\n", np);   for(int p=0; p<np; ++p)      fprintf(fp, "%.5g %.5g\n", x[p][0], x[p][1]);   fclose(fp);}
\ No newline at end of file
+/** * Implementation of the Particles functions. Most of your edits should be in here. * * @author Ante Qu, 2017 * Based on Bridson's simple_flip2d starter code at http://www.cs.ubc.ca/~rbridson/ */#include <cmath>#include <cstdarg>#include <cstdio>#include <cstdlib>#include <cstring>#include <algorithm>#include <utility>#include "particles.h"#include "util.h"using namespace std;void Particles::add_particle(const Vec3f &px_, const Vec3f &pu){   px.push_back(px_[0]);   py.push_back(px_[1]);   pz.push_back(px_[2]);   vx.push_back(pu[0]);   vy.push_back(pu[1]);   vz.push_back(pu[2]);   if(simType==APIC){      for(int a=0; a<9; ++a)         c[a].push_back(0.f);   }   ++np;   ++sort_generation;   cell_ranges_valid=false;   stencils_valid=false;}/* Appends count particles at the origin with zero velocity (and C), returning the index of the *//* first: for adding many at once, with one resize per column, and filling their columns in place. */int Particles::add_particles(int count){   int first=np;   for(int a=0; a<ncolumns; ++a){      columns[a]->resize(np+count);      memset(&(*columns[a])[first], 0, count*sizeof(float));   }   np+=count;   ++sort_generation;   cell_ranges_valid=false;   stencils_valid=false;   return first;}/* Scatters all three velocity components of the n particles listed in index into u_accum, *//* v_accum and w_accum with the kernel's weights, and marks the particles' cells as fluid. Each *//* particle is read once: the face and centre stencils are computed once per axis and shared by *//* the components. For affine schemes each node also gets the particle's affine term, *//* dot(c, x_node-x_p) scaled by the kernel. The weights and values of the whole batch are computed *//* in vectorized loops over its N^3 nodes, and only the scatter itself is scalar. */template<class Scheme, class Kernel>void Particles::accumulate(const int *index, int n){   const int N=Kernel::width;   int cell[3][PARTICLE_BATCH], face[3][PARTICLE_BATCH], centre[3][PARTICLE_BATCH];   float fface[3][PARTICLE_BATCH], fcentre[3][PARTICLE_BATCH];   float pos[3][PARTICLE_BATCH], vel[3][PARTICLE_BATCH], cc[9][PARTICLE_BATCH];   float weight[N*N*N][PARTICLE_BATCH], value[N*N*N][PARTICLE_BATCH];   for(int q=0; q<n; ++q){      int p=index[q];      pos[0][q]=px[p]; pos[1][q]=py[p]; pos[2][q]=pz[p];      vel[0][q]=vx[p]; vel[1][q]=vy[p]; vel[2][q]=vz[p];   }   if(Scheme::affine){      for(int a=0; a<9; ++a)         for(int q=0; q<n; ++q)            cc[a][q]=c[a][index[q]];   }   const int cells[3]={grid.pressure.nx, grid.pressure.ny, grid.pressure.nz};   const float overh=grid.overh;   for(int a=0; a<3; ++a){      const float *x=pos[a];      const int na=cells[a];      #pragma omp simd      for(int q=0; q<n; ++q){         float s=x[q]*overh;         cell[a][q]=(int)s;         Grid::staggered_stencils<Kernel>(s, na, face[a][q], fface[a][q], centre[a][q], fcentre[a][q]);      }   }   if(cache_stencils){      for(int a=0; a<3; ++a)         for(int q=0; q<n; ++q)            stencil[a][index[q]]=grid.fixed_coordinate(pos[a][q]);   }   const float scale=Kernel::affine_scale(grid.h);   for(int axis=0; axis<3; ++axis){      Array3<Vec2f> &accum=(axis==0) ? u_accum : (axis==1) ? v_accum : w_accum;      // the component is stored on faces normal to its axis, and at cell centres along the others      const int *i=(axis==0) ? face[0] : centre[0], *j=(axis==1) ? face[1] : centre[1], *k=(axis==2) ? face[2] : centre[2];      const float *fx=(axis==0) ? fface[0] : fcentre[0];      const float *fy=(axis==1) ? fface[1] : fcentre[1];      const float *fz=(axis==2) ? fface[2] : fcentre[2];      const float *v=vel[axis], *c0=cc[3*axis], *c1=cc[3*axis+1], *c2=cc[3*axis+2];      #pragma omp simd      for(int q=0; q<n; ++q){         #pragma GCC unroll 64         for(int node=0; node<N*N*N; ++node){            int ox=node%N, oy=(node/N)%N, oz=node/(N*N);            float w=Kernel::weight(ox, fx[q])*Kernel::weight(oy, fy[q])*Kernel::weight(oz, fz[q]);            float a=Scheme::affine ? scale*(c0[q]*(ox-fx[q])+c1[q]*(oy-fy[q])+c2[q]*(oz-fz[q])) : 0.f;            weight[node][q]=w;            value[node][q]=w*(v[q]+a);         }      }      for(int q=0; q<n; ++q){         for(int oz=0, node=0; oz<N; ++oz) for(int oy=0; oy<N; ++oy) for(int ox=0; ox<N; ++ox, ++node){            Vec2f &node_accum=accum(i[q]+ox, j[q]+oy, k[q]+oz);            node_accum.v[0]+=value[node][q];            node_accum.v[1]+=weight[node][q];         }      }   }   for(int q=0; q<n; ++q)      grid.marker(cell[0][q], cell[1][q], cell[2][q])=FLUIDCELL;}/* The MLS engine's scatter of the n particles listed in index: momentum and mass to the cell *//* centres around each particle, with the affine momentum of the moving least squares transfer, *//* w*(v+C*(x_node-x_p)). Unlike accumulate, one stencil and one set of N^3 weights serve all *//* three components, and each node takes one 16 byte update. */template<class Kernel>void Particles::accumulate_nodes(const int *index, int n){   const int N=Kernel::width;   int cell[3][PARTICLE_BATCH], base[3][PARTICLE_BATCH];   float frac[3][PARTICLE_BATCH], pos[3][PARTICLE_BATCH], vel[3][PARTICLE_BATCH], cc[9][PARTICLE_BATCH];   float weight[N*N*N][PARTICLE_BATCH], value[3][N*N*N][PARTICLE_BATCH];   for(int q=0; q<n; ++q){      int p=index[q];      pos[0][q]=px[p]; pos[1][q]=py[p]; pos[2][q]=pz[p];      vel[0][q]=vx[p]; vel[1][q]=vy[p]; vel[2][q]=vz[p];   }   for(int a=0; a<9; ++a)      for(int q=0; q<n; ++q)         cc[a][q]=c[a][index[q]];   const int cells[3]={nodes.nx, nodes.ny, nodes.nz};   const float overh=grid.overh;   for(int a=0; a<3; ++a){      const float *x=pos[a];      const int na=cells[a];      #pragma omp simd      for(int q=0; q<n; ++q){         float s=x[q]*overh;         cell[a][q]=(int)s;         Grid::centre_stencil<Kernel>(s, na, base[a][q], frac[a][q]);      }   }   const float scale=Kernel::affine_scale(grid.h);   const float *fx=frac[0], *fy=frac[1], *fz=frac[2];   #pragma omp simd   for(int q=0; q<n; ++q){      #pragma GCC unroll 64      for(int node=0; node<N*N*N; ++node){         int ox=node%N, oy=(node/N)%N, oz=node/(N*N);         float dx=ox-fx[q], dy=oy-fy[q], dz=oz-fz[q];         float w=Kernel::weight(ox, fx[q])*Kernel::weight(oy, fy[q])*Kernel::weight(oz, fz[q]);         weight[node][q]=w;         value[0][node][q]=w*(vel[0][q]+scale*(cc[0][q]*dx+cc[1][q]*dy+cc[2][q]*dz));         value[1][node][q]=w*(vel[1][q]+scale*(cc[3][q]*dx+cc[4][q]*dy+cc[5][q]*dz));         value[2][node][q]=w*(vel[2][q]+scale*(cc[6][q]*dx+cc[7][q]*dy+cc[8][q]*dz));      }   }   for(int q=0; q<n; ++q){      for(int oz=0, node=0; oz<N; ++oz) for(int oy=0; oy<N; ++oy) for(int ox=0; ox<N; ++ox, ++node){         CentreNode &centre=nodes(base[0][q]+ox, base[1][q]+oy, base[2][q]+oz);         centre.v[0]+=value[0][node][q];         centre.v[1]+=value[1][node][q];         centre.v[2]+=value[2][node][q];         centre.v[3]+=weight[node][q];      }   }   for(int q=0; q<n; ++q)      grid.marker(cell[0][q], cell[1][q], cell[2][q])=FLUIDCELL;}/* numbers the transfer blocks color by color, where the color is the parity of the block coordinates */void Particles::init_block_slot(void){   int nbx=(grid.marker.nx+TRANSFER_BLOCK-1)/TRANSFER_BLOCK;   int nby=(grid.marker.ny+TRANSFER_BLOCK-1)/TRANSFER_BLOCK;   int nbz=(grid.marker.nz+TRANSFER_BLOCK-1)/TRANSFER_BLOCK;   block_slot.resize(nbx*nby*nbz);   block_start.resize(nbx*nby*nbz+1);   int slot=0;   for(int color=0; color<8; ++color){      color_start[color]=slot;      for(int bk=(color>>2)&1; bk<nbz; bk+=2) for(int bj=(color>>1)&1; bj<nby; bj+=2) for(int bi=color&1; bi<nbx; bi+=2)         block_slot[bi+nbx*(bj+nby*bk)]=slot++;   }   color_start[8]=slot;}/* stable counting sort of the particle indices by the slot of their transfer block */void Particles::bin_by_block(void){   if(block_slot.size()==0) init_block_slot();   int nbx=(grid.marker.nx+TRANSFER_BLOCK-1)/TRANSFER_BLOCK;   int nby=(grid.marker.ny+TRANSFER_BLOCK-1)/TRANSFER_BLOCK;   int nblocks=block_slot.size();   Array1i key(np), next(nblocks);   block_order.resize(np);   #pragma omp parallel for   for(int p=0; p<np; ++p){      int bi=(int)(px[p]*grid.overh)/TRANSFER_BLOCK;      int bj=(int)(py[p]*grid.overh)/TRANSFER_BLOCK;      int bk=(int)(pz[p]*grid.overh)/TRANSFER_BLOCK;      key[p]=block_slot[bi+nbx*(bj+nby*bk)];   }   block_start.zero();   for(int p=0; p<np; ++p)      ++block_start[key[p]+1];   for(int b=0; b<nblocks; ++b){      block_start[b+1]+=block_start[b];      next[b]=block_start[b];   }   for(int p=0; p<np; ++p)      block_order[next[key[p]]++]=p;}/* Particle to grid transfer, parallel without atomics: the blocks of one color are scattered *//* concurrently, since they can't touch the same nodes or cells, and the colors run one after the *//* other. Every node therefore sums its contributions in the same order for any number of threads. *//* All components and the marker are filled in one pass over the particles, followed by one *//* normalization sweep over the grid. */void Particles::transfer_to_grid(void){   bin_by_block();   if(cache_stencils){      for(int a=0; a<3; ++a)         stencil[a].resize(np);   }   // the scheme and kernel are chosen once here; FLIP scatters like PIC   const bool collocated=(simType==APIC && engine==MLS_ENGINE);   void (Particles::*scatter)(const int *, int);   if(kernel==CUBIC_KERNEL)      scatter=collocated ? &Particles::accumulate_nodes<CubicKernel>             : (simType==APIC) ? &Particles::accumulate<APICScheme, CubicKernel> : &Particles::accumulate<PICScheme, CubicKernel>;   else if(kernel==QUADRATIC_KERNEL)      scatter=collocated ? &Particles::accumulate_nodes<QuadraticKernel>             : (simType==APIC) ? &Particles::accumulate<APICScheme, QuadraticKernel> : &Particles::accumulate<PICScheme, QuadraticKernel>;   else      scatter=collocated ? &Particles::accumulate_nodes<LinearKernel>             : (simType==APIC) ? &Particles::accumulate<APICScheme, LinearKernel> : &Particles::accumulate<PICScheme, LinearKernel>;   if(collocated){      if(nodes.size!=grid.marker.size) nodes.init(grid.marker.nx, grid.marker.ny, grid.marker.nz);      else nodes.zero();   }else{      u_accum.zero();      v_accum.zero();      w_accum.zero();   }   grid.marker.zero();   for(int color=0; color<8; ++color){      #pragma omp parallel for schedule(dynamic)      for(int b=color_start[color]; b<color_start[color+1]; ++b)         for(int p=block_start[b]; p<block_start[b+1]; p+=PARTICLE_BATCH)            (this->*scatter)(&block_order[p], min(PARTICLE_BATCH, block_start[b+1]-p));   }   if(collocated){      nodes_to_faces();      stencils_valid=false;      return;   }   #pragma omp parallel for   for(int k=0; k<grid.w.nz; ++k){      for(int axis=0; axis<3; ++axis){         Array3f &field=(axis==0) ? grid.u : (axis==1) ? grid.v : grid.w;         const Array3<Vec2f> &accum=(axis==0) ? u_accum : (axis==1) ? v_accum : w_accum;         if(k>=field.nz) continue;         const Vec2f *in=&accum(0,0,k);         float *out=&field(0,0,k);         for(int n=0; n<field.nx*field.ny; ++n)            out[n]=(in[n].v[1]!=0) ? in[n].v[0]/in[n].v[1] : 0.f;      }   }   stencils_valid=cache_stencils;}/* a row of n face velocities: component axis of the momentum over the mass of the rows of cell *//* centres on either side of the faces (the one inside, past a wall) */static void face_row(const CentreNode *lower, const CentreNode *upper, int axis, int n, float *out){   if(lower && upper){      #pragma omp simd      for(int i=0; i<n; ++i){         float mass=lower[i].v[3]+upper[i].v[3];         out[i]=(mass!=0) ? (lower[i].v[axis]+upper[i].v[axis])/mass : 0.f;      }   }else{      const CentreNode *inside=lower ? lower : upper;      for(int i=0; i<n; ++i)         out[i]=(inside[i].v[3]!=0) ? inside[i].v[axis]/inside[i].v[3] : 0.f;   }}/* The MLS engine's grid update: each face velocity is the momentum over the mass of the cell *//* centres on either side of it, a row of faces at a time. */void Particles::nodes_to_faces(void){   const int nx=nodes.nx, ny=nodes.ny, nz=nodes.nz;   #pragma omp parallel for   for(int k=0; k<=nz; ++k){      for(int j=0; j<=ny; ++j){         if(j<ny && k<nz){            const CentreNode *row=&nodes(0, j, k);            float *u=&grid.u(0, j, k);            face_row(0, row, 0, 1, u);            face_row(row, row+1, 0, nx-1, u+1);            face_row(row+nx-1, 0, 0, 1, u+nx);         }         if(k<nz)            face_row(j>0 ? &nodes(0, j-1, k) : 0, j<ny ? &nodes(0, j, k) : 0, 1, nx, &grid.v(0, j, k));         if(j<ny)            face_row(k>0 ? &nodes(0, j, k-1) : 0, k<nz ? &nodes(0, j, k) : 0, 2, nx, &grid.w(0, j, k));      }   }}/* the cell centre velocities the MLS engine's gather reads, averaged from the faces on either side */void Particles::faces_to_nodes(void){   if(nodes.size!=grid.marker.size) nodes.init(grid.marker.nx, grid.marker.ny, grid.marker.nz);   #pragma omp parallel for   for(int k=0; k<nodes.nz; ++k) for(int j=0; j<nodes.ny; ++j) for(int i=0; i<nodes.nx; ++i){      CentreNode &centre=nodes(i, j, k);      centre.v[0]=0.5f*(grid.u(i, j, k)+grid.u(i+1, j, k));      centre.v[1]=0.5f*(grid.v(i, j, k)+grid.v(i, j+1, k));      centre.v[2]=0.5f*(grid.w(i, j, k)+grid.w(i, j, k+1));   }}/* samples three staggered fields for particles p0..p0+n-1, from the stencil cache if the transfer filled it */template<class Kernel>void Particles::sample_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw, int p0, int n,             float *pu, float *pv, float *pw, float *const *c){   if(stencils_valid)      grid.sample_staggered_cached<Kernel>(fu, fv, fw, &stencil[0][p0], &stencil[1][p0], &stencil[2][p0], n, pu, pv, pw, c);   else      grid.sample_staggered_batch<Kernel>(fu, fv, fw, &px[p0], &py[p0], &pz[p0], n, pu, pv, pw, c);}/* grid to particle transfer of particles p0..p0+n-1: the grid change for the FLIP share of the *//* velocity, the grid velocity (and for affine schemes C) for the rest */template<class Scheme, class Kernel>void Particles::gather_batch(int p0, int n){   const float ratio=Scheme::flip_ratio();   float *v[3]={&vx[p0], &vy[p0], &vz[p0]};   float change[3][PARTICLE_BATCH], velocity[3][PARTICLE_BATCH];   float *cc[9];   for(int a=0; a<9; ++a)      cc[a]=Scheme::affine ? &c[a][p0] : 0;   if(ratio>0)      sample_batch<Kernel>(grid.du, grid.dv, grid.dw, p0, n, change[0], change[1], change[2], 0);   if(ratio==0) // PIC and APIC sample straight into the particles      sample_batch<Kernel>(grid.u, grid.v, grid.w, p0, n, v[0], v[1], v[2], Scheme::affine ? cc : 0);   else if(ratio<1)      sample_batch<Kernel>(grid.u, grid.v, grid.w, p0, n, velocity[0], velocity[1], velocity[2], Scheme::affine ? cc : 0);   if(ratio>0){      for(int a=0; a<3; ++a){         float *va=v[a];         const float *d=change[a], *g=velocity[a];         #pragma omp simd         for(int q=0; q<n; ++q)            va[q]=(ratio==1) ? va[q]+d[q] : ratio*(va[q]+d[q])+(1-ratio)*g[q];      }   }}/* The MLS engine's gather for particles p0..p0+n-1: the velocity and C from the cell centres, *//* with the one stencil per axis shared by the three components. */template<class Kernel>void Particles::gather_nodes(int p0, int n){   const float *f=nodes.data->v, h=grid.h, overh=grid.overh;   const int nx=nodes.nx, ny=nodes.ny, nz=nodes.nz, sy=4*nx, sz=4*nx*ny;   const float *x=&px[p0], *y=&py[p0], *z=&pz[p0];   float *u=&vx[p0], *v=&vy[p0], *w=&vz[p0];   float *c0=&c[0][p0], *c1=&c[1][p0], *c2=&c[2][p0], *c3=&c[3][p0], *c4=&c[4][p0];   float *c5=&c[5][p0], *c6=&c[6][p0], *c7=&c[7][p0], *c8=&c[8][p0];   #pragma omp simd   for(int q=0; q<n; ++q){      int i, j, k;      float fx, fy, fz;      Grid::centre_stencil<Kernel>(x[q]*overh, nx, i, fx);      Grid::centre_stencil<Kernel>(y[q]*overh, ny, j, fy);      Grid::centre_stencil<Kernel>(z[q]*overh, nz, k, fz);      u[q]=Grid::interpolate_affine<Kernel, 4>(f, sy, sz, i, j, k, fx, fy, fz, h, c0[q], c1[q], c2[q]);      v[q]=Grid::interpolate_affine<Kernel, 4>(f+1, sy, sz, i, j, k, fx, fy, fz, h, c3[q], c4[q], c5[q]);      w[q]=Grid::interpolate_affine<Kernel, 4>(f+2, sy, sz, i, j, k, fx, fy, fz, h, c6[q], c7[q], c8[q]);   }}/* one Runge-Kutta 2 step of particles p0..p0+n-1 through the trilinear grid velocity, kept inside the walls */void Particles::move_batch(int p0, int n, float dt){   const float xmin=1.001f*grid.h, xmax=grid.lx-1.001f*grid.h;   const float ymin=1.001f*grid.h, ymax=grid.ly-1.001f*grid.h;   const float zmin=1.001f*grid.h, zmax=grid.lz-1.001f*grid.h;   float *x=&px[p0], *y=&py[p0], *z=&pz[p0];   float gu[PARTICLE_BATCH], gv[PARTICLE_BATCH], gw[PARTICLE_BATCH];   float midx[PARTICLE_BATCH]={0}, midy[PARTICLE_BATCH]={0}, midz[PARTICLE_BATCH]={0}; // all set for q<n, which the compiler can't see   // first stage of Runge-Kutta 2 (do a half Euler step)   grid.sample_staggered_batch(grid.u, grid.v, grid.w, x, y, z, n, gu, gv, gw);   #pragma omp simd   for(int q=0; q<n; ++q){      midx[q]=::clamp(x[q]+0.5f*dt*gu[q], xmin, xmax);      midy[q]=::clamp(y[q]+0.5f*dt*gv[q], ymin, ymax);      midz[q]=::clamp(z[q]+0.5f*dt*gw[q], zmin, zmax);   }   // second stage of Runge-Kutta 2   grid.sample_staggered_batch(grid.u, grid.v, grid.w, midx, midy, midz, n, gu, gv, gw);   #pragma omp simd   for(int q=0; q<n; ++q){      x[q]=::clamp(x[q]+dt*gu[q], xmin, xmax);      y[q]=::clamp(y[q]+dt*gv[q], ymin, ymax);      z[q]=::clamp(z[q]+dt*gw[q], zmin, zmax);   }}/* Moves the particles p0..p0+n-1 that ended up inside the solids (or within a tenth of a cell of *//* them) back out along the gradient of the trilinear solid distance, the way the walls clamp. */void Particles::push_out_batch(int p0, int n){   const float xmin=1.001f*grid.h, xmax=grid.lx-1.001f*grid.h;   const float ymin=1.001f*grid.h, ymax=grid.ly-1.001f*grid.h;   const float zmin=1.001f*grid.h, zmax=grid.lz-1.001f*grid.h;   const Array3f &phi=grid.solid_phi;   const float overh=grid.overh, margin=0.1f*grid.h;   float *x=&px[p0], *y=&py[p0], *z=&pz[p0];   #pragma omp simd   for(int q=0; q<n; ++q){      int i, j, k;      float fx, fy, fz, gx, gy, gz;      Grid::centre_stencil<LinearKernel>(x[q]*overh, phi.nx, i, fx);      Grid::centre_stencil<LinearKernel>(y[q]*overh, phi.ny, j, fy);      Grid::centre_stencil<LinearKernel>(z[q]*overh, phi.nz, k, fz);      float d=Grid::interpolate_gradient<LinearKernel>(phi.data, phi.nx, phi.nx*phi.ny, i, j, k, fx, fy, fz, gx, gy, gz);      float length=sqrt(gx*gx+gy*gy+gz*gz);      float scale=(d<margin && length>0) ? (margin-d)/length : 0.f;      x[q]=::clamp(x[q]+scale*gx, xmin, xmax);      y[q]=::clamp(y[q]+scale*gy, ymin, ymax);      z[q]=::clamp(z[q]+scale*gz, zmin, zmax);   }}/* Advects particles p0..p0+n-1 for dt through the grid velocity in as many Runge-Kutta 2 substeps *//* as each one's local CFL needs, at most max_substeps: enough that it crosses at most substep_cfl *//* cells per substep, and that over a substep the velocity change along its path (sampled a whole *//* Euler step ahead) strays it at most substep_tolerance cells. Particles in calm water take one *//* substep. Each substep samples only the particles still moving, and histogram[s] counts the *//* particles that took s substeps. */void Particles::advect_batch(int p0, int n, float dt, int max_substeps, int *histogram){   const float xmin=1.001f*grid.h, xmax=grid.lx-1.001f*grid.h;   const float ymin=1.001f*grid.h, ymax=grid.ly-1.001f*grid.h;   const float zmin=1.001f*grid.h, zmax=grid.lz-1.001f*grid.h;   float *x=&px[p0], *y=&py[p0], *z=&pz[p0];   float gu[PARTICLE_BATCH], gv[PARTICLE_BATCH], gw[PARTICLE_BATCH];   float ax[PARTICLE_BATCH], ay[PARTICLE_BATCH], az[PARTICLE_BATCH];   float au[PARTICLE_BATCH], av[PARTICLE_BATCH], aw[PARTICLE_BATCH], step[PARTICLE_BATCH];   int steps[PARTICLE_BATCH];   // the velocity at the particles, which is also the first stage of their first substep   grid.sample_staggered_batch(grid.u, grid.v, grid.w, x, y, z, n, gu, gv, gw);   #pragma omp simd   for(int q=0; q<n; ++q){      ax[q]=::clamp(x[q]+dt*gu[q], xmin, xmax);      ay[q]=::clamp(y[q]+dt*gv[q], ymin, ymax);      az[q]=::clamp(z[q]+dt*gw[q], zmin, zmax);   }   grid.sample_staggered_batch(grid.u, grid.v, grid.w, ax, ay, az, n, au, av, aw);   const float speed_scale=dt*grid.overh/substep_cfl, change_scale=dt*grid.overh/substep_tolerance;   #pragma omp simd   for(int q=0; q<n; ++q){      float speed=sqrt(max(sqr(gu[q])+sqr(gv[q])+sqr(gw[q]), sqr(au[q])+sqr(av[q])+sqr(aw[q])));      float change=sqrt(sqr(au[q]-gu[q])+sqr(av[q]-gv[q])+sqr(aw[q]-gw[q]));      float needed=min(max(speed_scale*speed, change_scale*change), (float)max_substeps);      steps[q]=max(1, (int)std::ceil(needed));      step[q]=dt/steps[q];   }   for(int q=0; q<n; ++q)      ++histogram[steps[q]];   // substep s moves the particles taking more than s substeps, packed into ax.. so the sampler only sees them   int active[PARTICLE_BATCH];   float mx[PARTICLE_BATCH], my[PARTICLE_BATCH], mz[PARTICLE_BATCH], h[PARTICLE_BATCH];   for(int s=0; s<max_substeps; ++s){      int m=0;      for(int q=0; q<n; ++q)         if(steps[q]>s) active[m++]=q;      if(m==0) break;      for(int i=0; i<m; ++i){         int q=active[i];         ax[i]=x[q]; ay[i]=y[q]; az[i]=z[q]; h[i]=step[q];         au[i]=gu[q]; av[i]=gv[q]; aw[i]=gw[q];      }      // first stage of Runge-Kutta 2 (do a half Euler step)      if(s>0)         grid.sample_staggered_batch(grid.u, grid.v, grid.w, ax, ay, az, m, au, av, aw);      #pragma omp simd      for(int i=0; i<m; ++i){         mx[i]=::clamp(ax[i]+0.5f*h[i]*au[i], xmin, xmax);         my[i]=::clamp(ay[i]+0.5f*h[i]*av[i], ymin, ymax);         mz[i]=::clamp(az[i]+0.5f*h[i]*aw[i], zmin, zmax);      }      // second stage of Runge-Kutta 2      grid.sample_staggered_batch(grid.u, grid.v, grid.w, mx, my, mz, m, au, av, aw);      #pragma omp simd      for(int i=0; i<m; ++i){         ax[i]=::clamp(ax[i]+h[i]*au[i], xmin, xmax);         ay[i]=::clamp(ay[i]+h[i]*av[i], ymin, ymax);         az[i]=::clamp(az[i]+h[i]*aw[i], zmin, zmax);      }      for(int i=0; i<m; ++i){         int q=active[i];         x[q]=ax[i]; y[q]=ay[i]; z[q]=az[i];      }   }}/* A batch's local affine models of the grid velocity, u(x)=u+g*(x-anchor): g[3*a+b] is the *//* derivative of component a along axis b at the anchor. */struct AffineBatch{   float x[3][PARTICLE_BATCH];   float u[3][PARTICLE_BATCH];   float g[9][PARTICLE_BATCH];};/* anchors the models of batch particles list[0..m-1] at the points x, y, z (indexed like list) */static void anchor_affine(const Grid &grid, AffineBatch &model, const int *list, int m,                          const float *x, const float *y, const float *z){   float u[PARTICLE_BATCH], v[PARTICLE_BATCH], w[PARTICLE_BATCH], g[9][PARTICLE_BATCH];   float *gp[9]={g[0], g[1], g[2], g[3], g[4], g[5], g[6], g[7], g[8]};   grid.sample_staggered_gradient_batch(grid.u, grid.v, grid.w, x, y, z, m, u, v, w, gp);   for(int i=0; i<m; ++i){      int q=list[i];      model.x[0][q]=x[i]; model.x[1][q]=y[i]; model.x[2][q]=z[i];      model.u[0][q]=u[i]; model.u[1][q]=v[i]; model.u[2][q]=w[i];      for(int a=0; a<9; ++a)         model.g[a][q]=g[a][i];   }}/* The velocity at the points x, y, z of the n particles of a batch from their affine models. *//* The models of the moving particles (moving[q] nonzero) that left their anchor's cell, or *//* strayed more than radius cells from it, are first anchored again at the points. */static void affine_velocity(const Grid &grid, float radius, AffineBatch &model, const float *moving, int n,                            const float *x, const float *y, const float *z, float *u, float *v, float *w){   int stale[PARTICLE_BATCH], any=0;   const float reach=sqr(radius*grid.h), overh=grid.overh;   #pragma omp simd reduction(|:any)   for(int q=0; q<n; ++q){      float dx=x[q]-model.x[0][q], dy=y[q]-model.x[1][q], dz=z[q]-model.x[2][q];      int left=((int)(x[q]*overh)!=(int)(model.x[0][q]*overh)) | ((int)(y[q]*overh)!=(int)(model.x[1][q]*overh))             | ((int)(z[q]*overh)!=(int)(model.x[2][q]*overh)) | (sqr(dx)+sqr(dy)+sqr(dz)>reach);      stale[q]=left & (moving[q]!=0);      any|=stale[q];   }   if(any){      int list[PARTICLE_BATCH], m=0;      float sx[PARTICLE_BATCH], sy[PARTICLE_BATCH], sz[PARTICLE_BATCH];      for(int q=0; q<n; ++q)         if(stale[q]){            list[m]=q; sx[m]=x[q]; sy[m]=y[q]; sz[m]=z[q];            ++m;         }      anchor_affine(grid, model, list, m, sx, sy, sz);   }   #pragma omp simd   for(int q=0; q<n; ++q){      float dx=x[q]-model.x[0][q], dy=y[q]-model.x[1][q], dz=z[q]-model.x[2][q];      u[q]=model.u[0][q]+model.g[0][q]*dx+model.g[1][q]*dy+model.g[2][q]*dz;      v[q]=model.u[1][q]+model.g[3][q]*dx+model.g[4][q]*dy+model.g[5][q]*dz;      w[q]=model.u[2][q]+model.g[6][q]*dx+model.g[7][q]*dy+model.g[8][q]*dz;   }}/* advect_batch through each particle's local affine model of the grid velocity, sampled with its *//* gradient at the particle and then only where the model goes stale (see affine_velocity), so *//* most Runge-Kutta stages cost a few multiply-adds instead of a trilinear sample. Evaluating a *//* model is cheap enough that every substep runs over the whole batch, particles already done *//* taking zero-length steps, rather than packing the moving ones. The substep count takes the *//* velocity change along the Euler step from the model too, so calm particles sample the grid *//* once per step. The models are the grid's own gradient rather than the APIC c vectors, which *//* for the linear kernel aren't gradients, so the mode works with any scheme. */void Particles::advect_batch_affine(int p0, int n, float dt, int max_substeps, int *histogram){   const float xmin=1.001f*grid.h, xmax=grid.lx-1.001f*grid.h;   const float ymin=1.001f*grid.h, ymax=grid.ly-1.001f*grid.h;   const float zmin=1.001f*grid.h, zmax=grid.lz-1.001f*grid.h;   float *x=&px[p0], *y=&py[p0], *z=&pz[p0];   AffineBatch model;   float au[PARTICLE_BATCH], av[PARTICLE_BATCH], aw[PARTICLE_BATCH], step[PARTICLE_BATCH];   int steps[PARTICLE_BATCH], all[PARTICLE_BATCH]={0}; // set for q<n, which the compiler can't see   for(int q=0; q<n; ++q)      all[q]=q;   anchor_affine(grid, model, all, n, x, y, z);   const float speed_scale=dt*grid.overh/substep_cfl, change_scale=dt*grid.overh/substep_tolerance;   int most=1;   #pragma omp simd reduction(max:most)   for(int q=0; q<n; ++q){      float u=model.u[0][q], v=model.u[1][q], w=model.u[2][q];      float du=dt*(model.g[0][q]*u+model.g[1][q]*v+model.g[2][q]*w);      float dv=dt*(model.g[3][q]*u+model.g[4][q]*v+model.g[5][q]*w);      float dw=dt*(model.g[6][q]*u+model.g[7][q]*v+model.g[8][q]*w);      float speed=sqrt(max(sqr(u)+sqr(v)+sqr(w), sqr(u+du)+sqr(v+dv)+sqr(w+dw)));      float change=sqrt(sqr(du)+sqr(dv)+sqr(dw));      float needed=min(max(speed_scale*speed, change_scale*change), (float)max_substeps);      steps[q]=max(1, (int)std::ceil(needed));      step[q]=dt/steps[q];      most=max(most, steps[q]);   }   for(int q=0; q<n; ++q)      ++histogram[steps[q]];   float mx[PARTICLE_BATCH]={0}, my[PARTICLE_BATCH]={0}, mz[PARTICLE_BATCH]={0}, h[PARTICLE_BATCH]={0};   for(int s=0; s<most; ++s){      #pragma omp simd      for(int q=0; q<n; ++q)         h[q]=(steps[q]>s) ? step[q] : 0.f;      // first stage of Runge-Kutta 2 (do a half Euler step)      affine_velocity(grid, affine_radius, model, h, n, x, y, z, au, av, aw);      #pragma omp simd      for(int q=0; q<n; ++q){         mx[q]=::clamp(x[q]+0.5f*h[q]*au[q], xmin, xmax);         my[q]=::clamp(y[q]+0.5f*h[q]*av[q], ymin, ymax);         mz[q]=::clamp(z[q]+0.5f*h[q]*aw[q], zmin, zmax);      }      // second stage of Runge-Kutta 2      affine_velocity(grid, affine_radius, model, h, n, mx, my, mz, au, av, aw);      #pragma omp simd      for(int q=0; q<n; ++q){         x[q]=::clamp(x[q]+h[q]*au[q], xmin, xmax);         y[q]=::clamp(y[q]+h[q]*av[q], ymin, ymax);         z[q]=::clamp(z[q]+h[q]*aw[q], zmin, zmax);      }   }}template<class Kernel>void Particles::update_from_grid_with(void){   // the scheme is chosen once here   const bool collocated=(simType==APIC && engine==MLS_ENGINE);   void (Particles::*gather)(int, int)=collocated ? &Particles::gather_nodes<Kernel>                                     : (simType==FLIP) ? &Particles::gather_batch<FLIPScheme, Kernel>                                     : (simType==APIC) ? &Particles::gather_batch<APICScheme, Kernel>                                                       : &Particles::gather_batch<PICScheme, Kernel>;   if(collocated) faces_to_nodes();   #pragma omp parallel for schedule(static)   for(int p0=0; p0<np; p0+=PARTICLE_BATCH)      (this->*gather)(p0, min(PARTICLE_BATCH, np-p0));}void Particles::update_from_grid(void){   if(kernel==CUBIC_KERNEL) update_from_grid_with<CubicKernel>();   else if(kernel==QUADRATIC_KERNEL) update_from_grid_with<QuadraticKernel>();   else update_from_grid_with<LinearKernel>();}void Particles::move_particles_in_grid(float dt){   #pragma omp parallel for schedule(static)   for(int p0=0; p0<np; p0+=PARTICLE_BATCH){      move_batch(p0, min(PARTICLE_BATCH, np-p0), dt);      if(grid.solid_cells) push_out_batch(p0, min(PARTICLE_BATCH, np-p0));   }   cell_ranges_valid=false;   stencils_valid=false;}/* Fused grid to particle transfer and advection: a batch of particles gathers its new velocities *//* (and C) and then takes all of its substeps through the grid velocity while the batch and its *//* grid neighbourhood are still in cache, instead of streaming the whole particle arrays once per *//* substep. Substeps run across the batch, so the independent particles hide each other's grid *//* load latency. */template<class Scheme, class Kernel>void Particles::update_and_move_batches(float dt, int max_substeps){   while(substep_histogram.size()<max_substeps+1)      substep_histogram.push_back(0);   int *histogram=substep_histogram.data, bins=substep_histogram.size();   if(Scheme::collocated) faces_to_nodes();   #pragma omp parallel for schedule(static) reduction(+:histogram[:bins])   for(int p0=0; p0<np; p0+=PARTICLE_BATCH){      const int n=min(PARTICLE_BATCH, np-p0);      if(Scheme::collocated) gather_nodes<Kernel>(p0, n);      else gather_batch<Scheme, Kernel>(p0, n);      if(affine_advection) advect_batch_affine(p0, n, dt, max_substeps, histogram);      else advect_batch(p0, n, dt, max_substeps, histogram);      if(grid.solid_cells) push_out_batch(p0, n);   }   cell_ranges_valid=false;   stencils_valid=false;}template<class Kernel>void Particles::update_and_move_with(float dt, int max_substeps){   if(simType==FLIP) update_and_move_batches<FLIPScheme, Kernel>(dt, max_substeps);   else if(simType==APIC && engine==MLS_ENGINE) update_and_move_batches<MLSScheme, Kernel>(dt, max_substeps);   else if(simType==APIC) update_and_move_batches<APICScheme, Kernel>(dt, max_substeps);   else update_and_move_batches<PICScheme, Kernel>(dt, max_substeps);}void Particles::update_and_move(float dt, int max_substeps){   if(kernel==CUBIC_KERNEL) update_and_move_with<CubicKernel>(dt, max_substeps);   else if(kernel==QUADRATIC_KERNEL) update_and_move_with<QuadraticKernel>(dt, max_substeps);   else update_and_move_with<LinearKernel>(dt, max_substeps);}/* prints the share of the particle updates since the last report that took each number of *//* substeps, and starts counting again */void Particles::report_substeps(void){   long total=0, substeps=0;   for(int s=1; s<substep_histogram.size(); ++s){      total+=substep_histogram[s];      substeps+=(long)s*substep_histogram[s];   }   if(total==0) return;   printf("substeps per particle:");   for(int s=1; s<substep_histogram.size(); ++s)      printf(" %d: %.1f%%", s, 100.0*substep_histogram[s]/total);   printf(" (%.2f on average)\n", (double)substeps/total);   substep_histogram.zero();}/* spreads the low 10 bits of v out to every third bit */static unsigned int spread_bits(unsigned int v){   v&=0x3ff;   v=(v|(v<<16))&0x030000ff;   v=(v|(v<<8))&0x0300f00f;   v=(v|(v<<4))&0x030c30c3;   v=(v|(v<<2))&0x09249249;   return v;}static unsigned int morton_code(int i, int j, int k){   return spread_bits(i)|(spread_bits(j)<<1)|(spread_bits(k)<<2);}/* ranks every grid cell by its Z-order (Morton) code, so cells close in the grid get close ranks */void Particles::init_cell_rank(void){   const Array3c &marker=grid.marker;   vector<pair<unsigned int, int> > order(marker.size);   for(int k=0; k<marker.nz; ++k) for(int j=0; j<marker.ny; ++j) for(int i=0; i<marker.nx; ++i){      int index=i+marker.nx*(j+marker.ny*k);      order[index]=make_pair(morton_code(i, j, k), index);   }   sort(order.begin(), order.end());   cell_rank.resize(marker.size);   for(int r=0; r<marker.size; ++r)      cell_rank[order[r].second]=r;}/* Fraction of consecutive particles in memory whose cells aren't neighbours in the grid. *//* It is small right after sort_by_cell and grows as the particles mix. */float Particles::locality(void){   if(np<2) return 0;   const int n=np;   const float overh=grid.overh;   const float *xs=px.data, *ys=py.data, *zs=pz.data;   int far=0;   #pragma omp simd reduction(+:far)   for(int p=0; p<n-1; ++p){      int di=abs((int)(xs[p+1]*overh)-(int)(xs[p]*overh));      int dj=abs((int)(ys[p+1]*overh)-(int)(ys[p]*overh));      int dk=abs((int)(zs[p+1]*overh)-(int)(zs[p]*overh));      far+=(di>1)|(dj>1)|(dk>1);   }   return far/(float)(n-1);}/* Reorders all particle columns by the Morton rank of their cell with a (stable) counting sort, *//* and records where each cell's particles start in cell_start. */void Particles::sort_by_cell(void){   const Array3c &marker=grid.marker;   if(cell_rank.size()!=marker.size) init_cell_rank();   const int ncells=marker.size;   Array1i key(np), order(np), next(ncells);   #pragma omp parallel for   for(int p=0; p<np; ++p){      int i=(int)(px[p]*grid.overh), j=(int)(py[p]*grid.overh), k=(int)(pz[p]*grid.overh);      key[p]=cell_rank[i+marker.nx*(j+marker.ny*k)];   }   cell_start.resize(ncells+1);   cell_start.zero();   for(int p=0; p<np; ++p)      ++cell_start[key[p]+1];   for(int r=0; r<ncells; ++r){      cell_start[r+1]+=cell_start[r];      next[r]=cell_start[r];   }   for(int p=0; p<np; ++p)      order[next[key[p]]++]=p;   Array1f scratch(np);   for(int a=0; a<ncolumns; ++a){      const Array1f &column=*columns[a];      #pragma omp parallel for      for(int p=0; p<np; ++p)         scratch[p]=column[order[p]];      columns[a]->swap(scratch);   }   ++sort_generation;   cell_ranges_valid=true;   stencils_valid=false;}/* sorts the particles by cell every sort_interval steps, or sooner if their locality degrades */void Particles::update_sorting(void){   ++steps_since_sort;   bool scheduled=(sort_interval>0 && steps_since_sort>=sort_interval);   if(scheduled || (sort_locality_threshold<1 && locality()>sort_locality_threshold)){      sort_by_cell();      steps_since_sort=0;   }}/* the header of a binary frame of the particles as they are (see frame.h) */void Particles::frame_header(FrameHeader &header, int frame, double time) const{   memset(&header, 0, sizeof header);   memcpy(header.magic, FRAME_MAGIC, 8);   header.np=np;   header.ncolumns=ncolumns;   header.scheme=simType;   header.nx=grid.marker.nx;   header.ny=grid.marker.ny;   header.nz=grid.marker.nz;   header.lx=grid.lx;   header.frame=frame;   header.time=time;}/* Writes the particles as a binary frame: all three coordinates and every column the scheme *//* stores, straight from the arrays. */bool Particles::write_frame(int frame, double time, const char *filename_format, ...){   va_list ap;   va_start(ap, filename_format);   char *filename;   vasprintf(&filename, filename_format, ap);   va_end(ap);   FrameHeader header;   frame_header(header, frame, time);   const float *data[PARTICLE_COLUMNS];   for(int a=0; a<ncolumns; ++a)      data[a]=columns[a]->data;   bool ok=write_frame_file(filename, header, data);   if(!ok) printf("couldn't write frame %s\n", filename);   free(filename);   return ok;}/* Copies the particles into data as a binary frame, byte for byte what write_frame writes, to *//* be written later while they move on. */void Particles::snapshot_frame(std::vector<char> &data, int frame, double time) const{   const size_t bytes=(size_t)np*sizeof(float), padded=frame_column_bytes(np);   data.resize(sizeof(FrameHeader)+ncolumns*padded);   FrameHeader header;   frame_header(header, frame, time);   memcpy(data.data(), &header, sizeof header);   if(np==0) return;   #pragma omp parallel for schedule(static)   for(int a=0; a<ncolumns; ++a){      char *column=&data[sizeof header+a*padded];      memcpy(column, columns[a]->data, bytes);      memset(column+bytes, 0, padded-bytes);   }}/* the original text export: the count, then x and y of each particle */void Particles::write_to_file(const char *filename_format, ...){   va_list ap;   va_start(ap, filename_format);   char *filename;   vasprintf(&filename, filename_format, ap);   FILE *fp=fopen(filename, "wt");   free(filename);   va_end(ap);   fprintf(fp, "%d\n", np);   for(int p=0; p<np; ++p)      fprintf(fp, "%.5g %.5g\n", x[p][0], x[p][1]);   fclose(fp);}
\ No newline at end of file
@@ -9,38 +9,176 @@
 #define PARTICLES_H
 
 #include <vector>
+#include "array1.h"
+#include "frame.h"
 #include "grid.h"
 #include "vec2.h"
 #include "vec3.h"
 
+#define PARTICLE_BATCH 16 // particles whose weights are computed together in the transfers
+#define PARTICLE_COLUMNS 15 // px, py, pz, vx, vy, vz and (for APIC only) c[0..8]
+#define TRANSFER_BLOCK 4 // cells per side of the blocks scheduled by the parallel P2G (at least 2, or 4 for the wider kernels)
+
 typedef enum SimulationTypeEnum { PIC = 0, FLIP = 1, APIC = 2 } SimulationType;
+typedef enum TransferEngineEnum { STAGGERED_ENGINE = 0, MLS_ENGINE = 1 } TransferEngine;
+
+/* Transfer schemes as compile-time traits of the templated transfer kernels, so a scheme's choices */
+/* fold away instead of being tested per particle. affine: particles carry C, scattered to the grid */
+/* as an affine velocity and gathered back from the grid velocity gradient. flip_ratio: the share */
+/* of the new velocity taken as the old one plus the grid change (FLIP), the rest being the grid */
+/* velocity itself (PIC); a blended scheme is just another ratio. collocated: the transfers go */
+/* through the cell centres, with one stencil for all three components (the MLS engine). */
+struct PICScheme{
+   static const bool affine=false;
+   static const bool collocated=false;
+   static float flip_ratio() { return 0.f; }
+};
+
+struct FLIPScheme{
+   static const bool affine=false;
+   static const bool collocated=false;
+   static float flip_ratio() { return 1.f; }
+};
+
+struct APICScheme{
+   static const bool affine=true;
+   static const bool collocated=false;
+   static float flip_ratio() { return 0.f; }
+};
+
+/* APIC through the MLS engine */
+struct MLSScheme{
+   static const bool affine=true;
+   static const bool collocated=true;
+   static float flip_ratio() { return 0.f; }
+};
+
+/* A cell centre node of the MLS engine: momentum and mass while the particles scatter to it, */
+/* then the velocity the particles gather. Interleaved, so a node is one aligned load or store. */
+struct CentreNode{
+   float v[4];
+};
+
+/* Read-only view of three particle columns as Vec3f, for the viewer and output code. */
+struct ParticleVec3View{
+   const Array1f &a, &b, &c;
+
+   ParticleVec3View(const Array1f &a_, const Array1f &b_, const Array1f &c_)
+      :a(a_), b(b_), c(c_)
+   {}
+
+   unsigned int size() const
+   { return a.n; }
+
+   Vec3f operator[](int p) const
+   { return Vec3f(a[p], b[p], c[p]); }
+};
 
 struct Particles{
    Grid &grid;
    int np; // number of particles
-   std::vector<Vec3f> x, u; // positions and velocities
-   /* TODO: add helper variables */
-   std::vector<Vec3f> cx, cy, cz; // c vectors stored, times h
+   Array1f px, py, pz; // positions, one aligned column per axis
+   Array1f vx, vy, vz; // velocities
+   Array1f c[9]; // c vectors stored, times h: c[3*a+b] is component b of the c vector for velocity component a (APIC only)
+   ParticleVec3View x, u; // positions and velocities as Vec3f
+   Array1f *columns[PARTICLE_COLUMNS]; // all of the above the scheme uses, for operations that touch every column
+   int ncolumns;
+   int sort_generation; // counts the reorderings and additions, so a reader of successive frames can tell they still line up
+
+   // spatial sorting
+   int sort_interval; // reorder the particles by cell every this many steps (0 for never)...
+   float sort_locality_threshold; // ...or when the fraction of neighbours in memory that aren't neighbours in the grid exceeds this
+   int steps_since_sort;
+   bool cell_ranges_valid; // particles haven't moved since the last sort_by_cell
+   Array1i cell_rank; // Morton order rank of each grid cell
+   Array1i cell_start; // particles in the cell of rank r are cell_start[r]..cell_start[r+1]-1 after a sort
+
+   // stencil cache: the particles don't move between transfer_to_grid and update_from_grid, so the
+   // transfer can leave their cell coordinates (16.16 fixed point per axis) for the gather to reuse
+   bool cache_stencils; // fill and use the cache, or recompute the stencils from the positions
+   bool stencils_valid; // particles haven't moved since the cache was filled
+   Array1ui stencil[3];
+
+   // adaptive advection: each particle takes as many Runge-Kutta 2 substeps as its local CFL needs
+   float substep_cfl; // cells a particle may cross in one substep
+   float substep_tolerance; // cells a substep may stray from its path through the velocity change along it
+   Array1i substep_histogram; // particles that took s substeps, summed since the last report_substeps
+   bool affine_advection; // substep through a local affine model of the grid velocity, re-sampled only when it goes stale...
+   float affine_radius; // ...on leaving the cell it was sampled in or straying more than this many cells from there
 
    // transfer stuff
-   Array3f sum;
+   Array3<Vec2f> u_accum, v_accum, w_accum; // (momentum, weight) per face, interleaved so the P2G touches one line per node
+   // particles binned by transfer block for the parallel P2G: blocks are numbered color by color
+   // (by the parity of their block coordinates), so blocks of one color never share grid nodes
+   Array1i block_slot; // slot of each block in the colored numbering
+   Array1i block_start; // particles of the block in slot b are block_order[block_start[b]..block_start[b+1]-1]
+   Array1i block_order;
+   int color_start[9]; // blocks of color c are slots color_start[c]..color_start[c+1]-1
    SimulationType simType;
+   TransferKernel kernel; // weights of the particle/grid transfers (the advection is always trilinear)
+   TransferEngine engine; // MLS_ENGINE moves APIC's transfers to the cell centres (other schemes ignore it)
+   Array3<CentreNode> nodes; // the MLS engine's grid, allocated on its first transfer
 
    Particles(Grid &grid_, SimulationType simType_)
-      :grid(grid_), np(0),
-       sum(grid_.pressure.nx+1, grid_.pressure.ny+1, grid_.pressure.nz+1), simType( simType_ )
-   {}
+      :grid(grid_), np(0), x(px, py, pz), u(vx, vy, vz), sort_generation(0),
+       sort_interval(0), sort_locality_threshold(1.f), steps_since_sort(0), cell_ranges_valid(false),
+       cache_stencils(false), stencils_valid(false), substep_cfl(0.5f), substep_tolerance(0.05f),
+       affine_advection(false), affine_radius(0.5f),
+       u_accum(grid_.u.nx, grid_.u.ny, grid_.u.nz), v_accum(grid_.v.nx, grid_.v.ny, grid_.v.nz),
+       w_accum(grid_.w.nx, grid_.w.ny, grid_.w.nz), simType( simType_ ), kernel(LINEAR_KERNEL),
+       engine(STAGGERED_ENGINE)
+   {
+      Array1f *all[PARTICLE_COLUMNS]={&px, &py, &pz, &vx, &vy, &vz, &c[0], &c[1], &c[2],
+                                      &c[3], &c[4], &c[5], &c[6], &c[7], &c[8]};
+      // only store and update what the scheme reads: C for APIC (FLIP's grid velocity change is
+      // the grid's, which the caller tracks with grid.track_velocity_change)
+      ncolumns=(simType==APIC) ? PARTICLE_COLUMNS : 6;
+      for(int a=0; a<PARTICLE_COLUMNS; ++a)
+         columns[a]=all[a];
+   }
 
    void add_particle(const Vec3f &px, const Vec3f &pu);
+   int add_particles(int count);
    void transfer_to_grid(void);
    void update_from_grid(void);
    void move_particles_in_grid(float dt);
+   void update_and_move(float dt, int max_substeps);
+   void report_substeps(void);
+   float locality(void);
+   void sort_by_cell(void);
+   void update_sorting(void);
+   void frame_header(FrameHeader &header, int frame, double time) const;
+   bool write_frame(int frame, double time, const char *filename_format, ...);
+   void snapshot_frame(std::vector<char> &data, int frame, double time) const;
    void write_to_file(const char *filename_format, ...);
 
+   /* particles in cell (i,j,k) are begin..end-1; only meaningful while cell_ranges_valid */
+   void cell_range(int i, int j, int k, int &begin, int &end) const
+   {
+      int r=cell_rank[i+grid.marker.nx*(j+grid.marker.ny*k)];
+      begin=cell_start[r];
+      end=cell_start[r+1];
+   }
+
    private:
-   template<class T> void accumulate(T &accum, float q, int i, int j, int k, float fx, float fy, float fz);
-   template<class T> void affineFix(T &accum, Vec3f c, int i, int j, int k, float fx, float fy, float fz);
-   Vec3f computeC(Array3f &ufield, int i, int j, int k, float fx, float fy, float fz);
+   void init_cell_rank(void);
+   void init_block_slot(void);
+   void bin_by_block(void);
+   template<class Scheme, class Kernel> void accumulate(const int *index, int n);
+   template<class Scheme, class Kernel> void gather_batch(int p0, int n);
+   template<class Kernel> void accumulate_nodes(const int *index, int n);
+   template<class Kernel> void gather_nodes(int p0, int n);
+   void nodes_to_faces(void);
+   void faces_to_nodes(void);
+   template<class Kernel> void update_from_grid_with(void);
+   template<class Scheme, class Kernel> void update_and_move_batches(float dt, int max_substeps);
+   template<class Kernel> void update_and_move_with(float dt, int max_substeps);
+   template<class Kernel> void sample_batch(const Array3f &fu, const Array3f &fv, const Array3f &fw, int p0, int n,
+                     float *pu, float *pv, float *pw, float *const *c);
+   void move_batch(int p0, int n, float dt);
+   void push_out_batch(int p0, int n);
+   void advect_batch(int p0, int n, float dt, int max_substeps, int *histogram);
+   void advect_batch_affine(int p0, int n, float dt, int max_substeps, int *histogram);
 };
 
 #endif
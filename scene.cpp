@@ -0,0 +1,634 @@
+/**
+ * Scene files, their signed distance programs, and the initial state they seed.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "util.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#define make_directory(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define make_directory(path) mkdir(path, 0755)
+#endif
+
+using namespace std;
+
+/* The shapes' distances at one point, written once for the scalar and the vectorized evaluation */
+
+static inline float plane_distance(float x, float y, float z, const float *p)
+{ return p[0]*x+p[1]*y+p[2]*z-p[3]; }
+
+static inline float sphere_distance(float x, float y, float z, const float *p)
+{ return sqrt(sqr(x-p[0])+sqr(y-p[1])+sqr(z-p[2]))-p[3]; }
+
+static inline float box_distance(float x, float y, float z, const float *p)
+{
+   float qx=fabs(x-p[0])-p[3], qy=fabs(y-p[1])-p[4], qz=fabs(z-p[2])-p[5];
+   return sqrt(sqr(max(qx, 0.f))+sqr(max(qy, 0.f))+sqr(max(qz, 0.f)))+min(max(qx, max(qy, qz)), 0.f);
+}
+
+/* a cylinder along an axis is a circle in the other two coordinates, a and b */
+static inline float circle_distance(float a, float b, const float *p)
+{ return sqrt(sqr(a-p[1])+sqr(b-p[2]))-p[3]; }
+
+float SdfProgram::
+evaluate(float x, float y, float z) const
+{
+   float phi;
+   evaluate(&x, &y, &z, 1, &phi);
+   return phi;
+}
+
+/* Evaluates the program at n<=SDF_BATCH points an instruction at a time, each a vectorized loop */
+/* over the points, with a stack of distances per point. */
+void SdfProgram::
+evaluate(const float *x, const float *y, const float *z, int n, float *phi) const
+{
+   float stack[SDF_STACK][SDF_BATCH];
+   int top=0;
+   for(unsigned int c=0; c<code.size(); ++c){
+      const float *p=code[c].p;
+      switch(code[c].op){
+         case SDF_PLANE:{
+            float *out=stack[top++];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=plane_distance(x[q], y[q], z[q], p);
+            break;
+         }
+         case SDF_SPHERE:{
+            float *out=stack[top++];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=sphere_distance(x[q], y[q], z[q], p);
+            break;
+         }
+         case SDF_BOX:{
+            float *out=stack[top++];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=box_distance(x[q], y[q], z[q], p);
+            break;
+         }
+         case SDF_CYLINDER:{
+            float *out=stack[top++];
+            const float *a=(p[0]==0) ? y : x, *b=(p[0]==2) ? y : z;
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=circle_distance(a[q], b[q], p);
+            break;
+         }
+         case SDF_UNION:{
+            float *out=stack[top-2], *b=stack[--top];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=min(out[q], b[q]);
+            break;
+         }
+         case SDF_INTERSECT:{
+            float *out=stack[top-2], *b=stack[--top];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=max(out[q], b[q]);
+            break;
+         }
+         case SDF_SUBTRACT:{
+            float *out=stack[top-2], *b=stack[--top];
+            #pragma omp simd
+            for(int q=0; q<n; ++q)
+               out[q]=max(out[q], -b[q]);
+            break;
+         }
+      }
+   }
+   for(int q=0; q<n; ++q)
+      phi[q]=top ? stack[0][q] : 1e30f;
+}
+
+/* Bounds the program over the box [lo,hi] by interval arithmetic: plane, sphere and cylinder */
+/* bounds are exact, a box's is its distance at the centre of the query plus or minus the half */
+/* diagonal (a distance changes no faster than the point moves), and the operations combine the */
+/* intervals of their operands. */
+void SdfProgram::
+bounds(const float lo[3], const float hi[3], float &low, float &high) const
+{
+   float lows[SDF_STACK+1], highs[SDF_STACK+1]; // one spare for the operations' unused references
+   int top=0;
+   for(unsigned int c=0; c<code.size(); ++c){
+      const float *p=code[c].p;
+      float &l=lows[top], &u=highs[top];
+      switch(code[c].op){
+         case SDF_PLANE:
+            l=u=-p[3];
+            for(int a=0; a<3; ++a){
+               l+=min(p[a]*lo[a], p[a]*hi[a]);
+               u+=max(p[a]*lo[a], p[a]*hi[a]);
+            }
+            ++top;
+            break;
+         case SDF_SPHERE:
+         case SDF_CYLINDER:{
+            // nearest and farthest distances from the centre (or axis) to the box
+            const bool sphere=(code[c].op==SDF_SPHERE);
+            float nearest=0, farthest=0;
+            for(int a=0; a<3; ++a){
+               if(!sphere && a==(int)p[0]) continue;
+               const float centre=sphere ? p[a] : p[1+(a>(int)p[0] ? a-1 : a)];
+               nearest+=sqr(max(max(lo[a]-centre, centre-hi[a]), 0.f));
+               farthest+=max(sqr(centre-lo[a]), sqr(centre-hi[a]));
+            }
+            l=sqrt(nearest)-p[3];
+            u=sqrt(farthest)-p[3];
+            ++top;
+            break;
+         }
+         case SDF_BOX:{
+            const float centre=box_distance(0.5f*(lo[0]+hi[0]), 0.5f*(lo[1]+hi[1]), 0.5f*(lo[2]+hi[2]), p);
+            const float reach=0.5f*sqrt(sqr(hi[0]-lo[0])+sqr(hi[1]-lo[1])+sqr(hi[2]-lo[2]));
+            l=centre-reach;
+            u=centre+reach;
+            ++top;
+            break;
+         }
+         case SDF_UNION:
+            --top;
+            lows[top-1]=min(lows[top-1], lows[top]);
+            highs[top-1]=min(highs[top-1], highs[top]);
+            break;
+         case SDF_INTERSECT:
+            --top;
+            lows[top-1]=max(lows[top-1], lows[top]);
+            highs[top-1]=max(highs[top-1], highs[top]);
+            break;
+         case SDF_SUBTRACT:
+            --top;
+            lows[top-1]=max(lows[top-1], -highs[top]);
+            highs[top-1]=max(highs[top-1], -lows[top]);
+            break;
+      }
+   }
+   low=top ? lows[0] : 1e30f;
+   high=top ? highs[0] : 1e30f;
+}
+
+unsigned long long SdfProgram::
+hash(unsigned long long key) const
+{
+   for(unsigned int c=0; c<code.size(); ++c){
+      key=hash64(key^code[c].op);
+      for(int a=0; a<6; ++a){
+         unsigned int bits;
+         memcpy(&bits, &code[c].p[a], sizeof bits);
+         key=hash64(key^bits);
+      }
+   }
+   return hash64(key^code.size());
+}
+
+/* Ends a section: the shapes left on its stack are united. */
+static void close_section(SdfProgram *program, int depth)
+{
+   SdfInstruction join={SDF_UNION, {0, 0, 0, 0, 0, 0}};
+   for(; depth>1; --depth)
+      program->code.push_back(join);
+}
+
+/* Compiles the scene in text (see scene.h), printing what's wrong with it to stderr if it can't. */
+/* Name is what the messages call it. */
+bool Scene::
+parse(const char *text, const char *name)
+{
+   fluid.code.clear();
+   solid.code.clear();
+   seeded.code.clear();
+   SdfProgram *section=0;
+   int depth=0, line=0;
+   for(const char *next=text; *next; ){
+      const char *end=strchr(next, '\n');
+      if(!end) end=next+strlen(next);
+      string buffer(next, end);
+      next=*end ? end+1 : end;
+      ++line;
+      size_t comment=buffer.find('#');
+      if(comment!=string::npos) buffer.erase(comment);
+
+      char word[32], axis[2];
+      int used=0;
+      if(sscanf(buffer.c_str(), "%31s%n", word, &used)!=1)
+         continue;
+      const char *args=buffer.c_str()+used;
+      SdfInstruction in={SDF_UNION, {0, 0, 0, 0, 0, 0}};
+      int expected=0, got=0;
+      if(!strcmp(word, "fluid") || !strcmp(word, "solid")){
+         if(section) close_section(section, depth);
+         section=(word[0]=='f') ? &fluid : &solid;
+         if(!section->empty()){
+            fprintf(stderr, "%s:%d: second %s section\n", name, line, word);
+            return false;
+         }
+         depth=0;
+         continue;
+      }else if(!strcmp(word, "plane")){
+         in.op=SDF_PLANE;
+         expected=4;
+         got=sscanf(args, "%f %f %f %f", &in.p[0], &in.p[1], &in.p[2], &in.p[3]);
+         float length=sqrt(sqr(in.p[0])+sqr(in.p[1])+sqr(in.p[2]));
+         if(got==expected && length==0){
+            fprintf(stderr, "%s:%d: plane without a normal\n", name, line);
+            return false;
+         }
+         for(int a=0; a<4 && got==expected; ++a)
+            in.p[a]/=length;
+      }else if(!strcmp(word, "sphere")){
+         in.op=SDF_SPHERE;
+         expected=4;
+         got=sscanf(args, "%f %f %f %f", &in.p[0], &in.p[1], &in.p[2], &in.p[3]);
+      }else if(!strcmp(word, "box")){
+         in.op=SDF_BOX;
+         expected=6;
+         float corner[6];
+         got=sscanf(args, "%f %f %f %f %f %f", &corner[0], &corner[1], &corner[2], &corner[3], &corner[4], &corner[5]);
+         for(int a=0; a<3 && got==expected; ++a){
+            in.p[a]=0.5f*(corner[a]+corner[a+3]);
+            in.p[a+3]=0.5f*fabs(corner[a+3]-corner[a]);
+         }
+      }else if(!strcmp(word, "cylinder")){
+         in.op=SDF_CYLINDER;
+         expected=4;
+         got=sscanf(args, " %1[xyz] %f %f %f", axis, &in.p[1], &in.p[2], &in.p[3]);
+         if(got==expected)
+            in.p[0]=(float)(axis[0]-'x');
+      }else if(!strcmp(word, "union") || !strcmp(word, "intersect") || !strcmp(word, "subtract")){
+         in.op=(word[0]=='u') ? SDF_UNION : (word[0]=='i' ? SDF_INTERSECT : SDF_SUBTRACT);
+      }else{
+         fprintf(stderr, "%s:%d: unknown instruction '%s'\n", name, line, word);
+         return false;
+      }
+
+      if(got!=expected){
+         fprintf(stderr, "%s:%d: %s takes %d numbers\n", name, line, word, expected);
+         return false;
+      }
+      if(!section){
+         fprintf(stderr, "%s:%d: %s before the fluid or solid section\n", name, line, word);
+         return false;
+      }
+      if(in.op>=SDF_UNION){
+         if(depth<2){
+            fprintf(stderr, "%s:%d: %s needs two shapes before it\n", name, line, word);
+            return false;
+         }
+         --depth;
+      // one slot is kept for the solids subtracted from the fluid
+      }else if(++depth>SDF_STACK-1){
+         fprintf(stderr, "%s:%d: more than %d shapes left to combine\n", name, line, SDF_STACK-1);
+         return false;
+      }
+      section->code.push_back(in);
+   }
+   if(section) close_section(section, depth);
+   if(fluid.empty()){
+      fprintf(stderr, "%s: no fluid\n", name);
+      return false;
+   }
+
+   seeded=fluid;
+   if(!solid.empty()){
+      SdfInstruction cut={SDF_SUBTRACT, {0, 0, 0, 0, 0, 0}};
+      seeded.code.insert(seeded.code.end(), solid.code.begin(), solid.code.end());
+      seeded.code.push_back(cut);
+   }
+   return true;
+}
+
+bool Scene::
+read(const char *filename)
+{
+   FILE *fp=fopen(filename, "rb");
+   if(!fp){
+      fprintf(stderr, "can't read scene %s\n", filename);
+      return false;
+   }
+   string text;
+   char buffer[4096];
+   for(size_t n; (n=fread(buffer, 1, sizeof buffer, fp))>0; )
+      text.append(buffer, n);
+   fclose(fp);
+   return parse(text.c_str(), filename);
+}
+
+/* identifies the compiled scene, whatever its file looked like */
+unsigned long long Scene::
+hash(void) const
+{ return solid.hash(fluid.hash(0x5343454e45ULL)); }
+
+/* Pulls the n points, at distances phi, to the distance target along the program's finite */
+/* difference gradient. */
+static void project_batch(const SdfProgram &program, float *x, float *y, float *z, const float *phi, int n, float target)
+{
+   const float e=1e-4f;
+   float ox[SDF_BATCH]={0}, oy[SDF_BATCH]={0}, oz[SDF_BATCH]={0}, plus[SDF_BATCH], minus[SDF_BATCH], g[3][SDF_BATCH];
+   float *moved[3]={ox, oy, oz};
+   const float *from[3]={x, y, z};
+   for(int a=0; a<3; ++a){
+      for(int q=0; q<n; ++q){
+         ox[q]=x[q]; oy[q]=y[q]; oz[q]=z[q];
+      }
+      for(int q=0; q<n; ++q)
+         moved[a][q]=from[a][q]+e;
+      program.evaluate(ox, oy, oz, n, plus);
+      for(int q=0; q<n; ++q)
+         moved[a][q]=from[a][q]-e;
+      program.evaluate(ox, oy, oz, n, minus);
+      for(int q=0; q<n; ++q)
+         g[a][q]=(plus[q]-minus[q])/(2*e);
+   }
+   #pragma omp simd
+   for(int q=0; q<n; ++q){
+      float length=sqrt(sqr(g[0][q])+sqr(g[1][q])+sqr(g[2][q]));
+      float scale=length>0 ? (target-phi[q])/length : 0.f;
+      x[q]+=scale*g[0][q];
+      y[q]+=scale*g[1][q];
+      z[q]+=scale*g[2][q];
+   }
+}
+
+/* Draws the na*nb*nc jittered samples of cell (i,j,k) and keeps those in the program, returning */
+/* how many; if particles isn't null they're stored from index p on. Samples within a quarter of */
+/* a sample spacing of the surface are dropped and those within one and a half are pulled to */
+/* three quarters, twice (the finite difference gradient is approximate). The random numbers are */
+/* keyed on first, the cell's first sample, so the samples can be drawn again in any order. The */
+/* cell's interval bounds decide first whether it's wholly outside (nothing is kept) or wholly */
+/* inside (everything is, with no evaluations); inside says the caller already knows the latter. */
+static int seed_cell(const SdfProgram &program, float h, int i, int j, int k, unsigned long long first,
+                     int na, int nb, int nc, bool inside, Particles *particles, int p)
+{
+   const float outside=-0.25f*h/na, surface=-1.5f*h/na;
+   const int samples=na*nb*nc;
+   if(!inside){
+      const float lo[3]={i*h, j*h, k*h}, hi[3]={(i+1)*h, (j+1)*h, (k+1)*h};
+      float low, high;
+      program.bounds(lo, hi, low, high);
+      if(low>outside) return 0;
+      inside=(high<=surface);
+   }
+   if(inside && !particles) return samples;
+
+   int count=0;
+   for(int s0=0; s0<samples; s0+=SDF_BATCH){
+      const int n=min(SDF_BATCH, samples-s0);
+      float x[SDF_BATCH], y[SDF_BATCH], z[SDF_BATCH], phi[SDF_BATCH];
+      for(int q=0; q<n; ++q){
+         const int s=s0+q, a=s/(nb*nc), b=(s/nc)%nb, c=s%nc;
+         const unsigned long long counter=3*(first+s); // three numbers per sample
+         x[q]=(i+(a+0.1f+0.8f*random_unit(counter))/na)*h;
+         y[q]=(j+(b+0.1f+0.8f*random_unit(counter+1))/nb)*h;
+         z[q]=(k+(c+0.1f+0.8f*random_unit(counter+2))/nc)*h;
+      }
+      if(!inside)
+         program.evaluate(x, y, z, n, phi);
+      else
+         for(int q=0; q<n; ++q)
+            phi[q]=surface;
+
+      if(!particles){
+         for(int q=0; q<n; ++q)
+            count+=(phi[q]<=outside);
+         continue;
+      }
+      // the samples near the surface, gathered to be projected together
+      int near[SDF_BATCH], m=0;
+      float nx[SDF_BATCH], ny[SDF_BATCH], nz[SDF_BATCH], nphi[SDF_BATCH];
+      for(int q=0; q<n; ++q)
+         if(phi[q]<=outside && phi[q]>surface){
+            near[m]=q;
+            nx[m]=x[q]; ny[m]=y[q]; nz[m]=z[q]; nphi[m]=phi[q];
+            ++m;
+         }
+      if(m){
+         project_batch(program, nx, ny, nz, nphi, m, -0.75f*h/na);
+         program.evaluate(nx, ny, nz, m, nphi);
+         project_batch(program, nx, ny, nz, nphi, m, -0.75f*h/na);
+         for(int r=0; r<m; ++r){
+            x[near[r]]=nx[r]; y[near[r]]=ny[r]; z[near[r]]=nz[r];
+         }
+      }
+      for(int q=0; q<n; ++q)
+         if(phi[q]<=outside){
+            particles->px[p+count]=x[q];
+            particles->py[p+count]=y[q];
+            particles->pz[p+count]=z[q];
+            ++count;
+         }
+   }
+   return count;
+}
+
+/* Seeds particles (positions only) in the fluid outside the solids, na*nb*nc jittered samples per */
+/* cell of the domain's interior. The cells are seeded in parallel by blocks, and blocks whose */
+/* interval bounds are wholly outside are skipped without looking at their cells: a counting pass */
+/* sizes the particle storage once and gives each cell its first particle, then a second pass */
+/* draws the same samples again (the random numbers are keyed on the seed, cell and sample) and */
+/* writes them in place, so the particles and their order don't depend on the number of threads. */
+void Scene::
+seed_particles(Grid &grid, Particles &particles, int na, int nb, int nc, unsigned long long seed) const
+{
+   if(seeded.empty()) return;
+   const int nx=grid.marker.nx, ny=grid.marker.ny, nz=grid.marker.nz, ncells=grid.marker.size;
+   const int bx=(nx+SCENE_BLOCK-1)/SCENE_BLOCK, by=(ny+SCENE_BLOCK-1)/SCENE_BLOCK, bz=(nz+SCENE_BLOCK-1)/SCENE_BLOCK;
+   const float h=grid.h, outside=-0.25f*h/na, surface=-1.5f*h/na;
+   const int samples=na*nb*nc;
+   Array1i start(ncells+1); // cells in grid order (i fastest)
+   start.zero();
+
+   int first=0;
+   for(int pass=0; pass<2; ++pass){
+      #pragma omp parallel for collapse(3) schedule(dynamic)
+      for(int bk=0; bk<bz; ++bk)
+         for(int bj=0; bj<by; ++bj)
+            for(int bi=0; bi<bx; ++bi){
+               const int i0=max(bi*SCENE_BLOCK, 1), i1=min((bi+1)*SCENE_BLOCK, nx-1);
+               const int j0=max(bj*SCENE_BLOCK, 1), j1=min((bj+1)*SCENE_BLOCK, ny-1);
+               const int k0=max(bk*SCENE_BLOCK, 1), k1=min((bk+1)*SCENE_BLOCK, nz-1);
+               if(i0>=i1 || j0>=j1 || k0>=k1) continue;
+               const float lo[3]={i0*h, j0*h, k0*h}, hi[3]={i1*h, j1*h, k1*h};
+               float low, high;
+               seeded.bounds(lo, hi, low, high);
+               if(low>outside) continue;
+               const bool inside=(high<=surface);
+               for(int k=k0; k<k1; ++k)
+                  for(int j=j0; j<j1; ++j)
+                     for(int i=i0; i<i1; ++i){
+                        const int cell=i+nx*(j+ny*k);
+                        const unsigned long long key=((unsigned long long)seed*ncells+cell)*samples;
+                        if(pass==0)
+                           start[cell+1]=seed_cell(seeded, h, i, j, k, key, na, nb, nc, inside, 0, 0);
+                        else if(start[cell+1]>start[cell])
+                           seed_cell(seeded, h, i, j, k, key, na, nb, nc, inside, &particles, first+start[cell]);
+                     }
+            }
+      if(pass==0){
+         for(int cell=0; cell<ncells; ++cell)
+            start[cell+1]+=start[cell];
+         first=particles.add_particles(start[ncells]);
+      }
+   }
+}
+
+/* Samples the solids' distance at the cell centres into grid.solid_phi and marks the cells inside */
+/* in grid.solid, in parallel by blocks, a row of a block at a time. The distance only matters */
+/* near the solids (particles are pushed out along its gradient), so blocks whose interval bounds */
+/* are two cells or more outside are filled with their lower bound without evaluating. */
+void Scene::
+voxelize_solid(Grid &grid) const
+{
+   grid.solid.zero();
+   grid.solid_cells=0;
+   if(solid.empty()){
+      grid.solid_phi.delete_memory();
+      return;
+   }
+   const int nx=grid.marker.nx, ny=grid.marker.ny, nz=grid.marker.nz;
+   const int bx=(nx+SCENE_BLOCK-1)/SCENE_BLOCK, by=(ny+SCENE_BLOCK-1)/SCENE_BLOCK, bz=(nz+SCENE_BLOCK-1)/SCENE_BLOCK;
+   const float h=grid.h;
+   grid.solid_phi.init(nx, ny, nz);
+   int count=0;
+
+   #pragma omp parallel for collapse(3) schedule(dynamic) reduction(+:count)
+   for(int bk=0; bk<bz; ++bk)
+      for(int bj=0; bj<by; ++bj)
+         for(int bi=0; bi<bx; ++bi){
+            const int i0=bi*SCENE_BLOCK, i1=min(i0+SCENE_BLOCK, nx);
+            const int j0=bj*SCENE_BLOCK, j1=min(j0+SCENE_BLOCK, ny);
+            const int k0=bk*SCENE_BLOCK, k1=min(k0+SCENE_BLOCK, nz);
+            // the bounds only need to hold at the cell centres
+            const float lo[3]={(i0+0.5f)*h, (j0+0.5f)*h, (k0+0.5f)*h}, hi[3]={(i1-0.5f)*h, (j1-0.5f)*h, (k1-0.5f)*h};
+            float low, high;
+            solid.bounds(lo, hi, low, high);
+            const bool far=(low>=2*h);
+            float x[SCENE_BLOCK], y[SCENE_BLOCK], z[SCENE_BLOCK], phi[SCENE_BLOCK];
+            for(int i=i0; i<i1; ++i)
+               x[i-i0]=(i+0.5f)*h;
+            for(int k=k0; k<k1; ++k)
+               for(int j=j0; j<j1; ++j){
+                  if(far){
+                     for(int i=i0; i<i1; ++i)
+                        grid.solid_phi(i, j, k)=low;
+                     continue;
+                  }
+                  for(int i=i0; i<i1; ++i){
+                     y[i-i0]=(j+0.5f)*h;
+                     z[i-i0]=(k+0.5f)*h;
+                  }
+                  solid.evaluate(x, y, z, i1-i0, phi);
+                  for(int i=i0; i<i1; ++i){
+                     const char in=(phi[i-i0]<0);
+                     grid.solid_phi(i, j, k)=phi[i-i0];
+                     grid.solid(i, j, k)=in;
+                     count+=in;
+                  }
+               }
+         }
+   grid.solid_cells=count;
+}
+
+/* The initial state cache: a file per key in the directory, holding a header, the particles' */
+/* positions and velocities column by column, and the grid's solid distance if it has solids (the */
+/* mask is where it's negative). */
+#define STATE_MAGIC "FLIPSCN1"
+
+struct StateHeader{
+   char magic[8];
+   unsigned long long key;
+   int np, nx, ny, nz;
+   int solids; // the solid distance follows the particles
+};
+
+static string state_path(const char *directory, unsigned long long key)
+{
+   char name[32];
+   snprintf(name, sizeof name, "/%016llx.state", key);
+   return string(directory)+name;
+}
+
+/* Appends the particles and sets the solids stored for key, if the directory has them for a grid */
+/* of this size; the grid and particles are left alone otherwise. The file's size is checked */
+/* against its header first, so the columns can be read straight into the particles. */
+bool read_initial_state(const char *directory, unsigned long long key, Grid &grid, Particles &particles)
+{
+   FILE *fp=fopen(state_path(directory, key).c_str(), "rb");
+   if(!fp) return false;
+   StateHeader header;
+   bool ok=fread(&header, sizeof header, 1, fp)==1 && !memcmp(header.magic, STATE_MAGIC, 8) && header.key==key
+           && header.np>=0 && header.nx==grid.marker.nx && header.ny==grid.marker.ny && header.nz==grid.marker.nz;
+   const long cells=(ok && header.solids) ? grid.marker.size : 0;
+   if(ok){
+      const long expected=(long)sizeof header+(long)sizeof(float)*(6L*header.np+cells);
+      ok=fseek(fp, 0, SEEK_END)==0 && ftell(fp)==expected && fseek(fp, sizeof header, SEEK_SET)==0;
+   }
+   if(!ok){
+      fclose(fp);
+      return false;
+   }
+
+   int first=particles.add_particles(header.np);
+   Array1f *column[6]={&particles.px, &particles.py, &particles.pz, &particles.vx, &particles.vy, &particles.vz};
+   for(int a=0; a<6 && ok && header.np; ++a)
+      ok=fread(&(*column[a])[first], sizeof(float), header.np, fp)==(size_t)header.np;
+   Array3f phi(cells ? grid.marker.nx : 0, cells ? grid.marker.ny : 0, cells ? grid.marker.nz : 0);
+   ok=ok && fread(phi.data, sizeof(float), cells, fp)==(size_t)cells;
+   fclose(fp);
+   if(!ok){
+      for(int a=0; a<particles.ncolumns; ++a)
+         particles.columns[a]->resize(first);
+      particles.np=first;
+      return false;
+   }
+   grid.solid.zero();
+   grid.solid_cells=0;
+   for(int c=0; c<cells; ++c){
+      grid.solid.data[c]=(phi.data[c]<0);
+      grid.solid_cells+=grid.solid.data[c];
+   }
+   grid.solid_phi.init(phi.nx, phi.ny, phi.nz);
+   phi.copy_to(grid.solid_phi);
+   return true;
+}
+
+/* Stores the particles and solids for key, creating the directory if need be. The file is */
+/* written under a temporary name and renamed, so an interrupted write never leaves a bad entry. */
+bool write_initial_state(const char *directory, unsigned long long key, const Grid &grid, const Particles &particles)
+{
+   make_directory(directory);
+   string path=state_path(directory, key), temporary=path+".tmp";
+   FILE *fp=fopen(temporary.c_str(), "wb");
+   if(!fp) return false;
+   StateHeader header;
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, STATE_MAGIC, 8);
+   header.key=key;
+   header.np=particles.np;
+   header.nx=grid.marker.nx;
+   header.ny=grid.marker.ny;
+   header.nz=grid.marker.nz;
+   header.solids=(grid.solid_phi.size>0);
+   bool ok=fwrite(&header, sizeof header, 1, fp)==1;
+   const Array1f *column[6]={&particles.px, &particles.py, &particles.pz, &particles.vx, &particles.vy, &particles.vz};
+   for(int a=0; a<6 && ok && particles.np; ++a)
+      ok=fwrite(column[a]->data, sizeof(float), particles.np, fp)==(size_t)particles.np;
+   if(header.solids)
+      ok=ok && fwrite(grid.solid_phi.data, sizeof(float), grid.solid_phi.size, fp)==(size_t)grid.solid_phi.size;
+   ok=(fclose(fp)==0) && ok;
+   if(ok) ok=(rename(temporary.c_str(), path.c_str())==0);
+   if(!ok) remove(temporary.c_str());
+   return ok;
+}
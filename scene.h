@@ -0,0 +1,75 @@
+/**
+ * Scenes: the initial fluid and the solids of a simulation as signed distance functions (negative
+ * inside), read from a text file and compiled into flat programs that evaluate a batch of points
+ * an instruction at a time.
+ *
+ * A scene file has a fluid section and optionally a solid section, each started by a line with
+ * its name and followed by one shape or operation per line, in postfix order ('#' starts a
+ * comment). Coordinates are in the grid's units: the domain is [0,lx]x[0,ly]x[0,lz].
+ *
+ *    plane nx ny nz d          inside where dot(n, x) < d
+ *    sphere cx cy cz r
+ *    box x0 y0 z0 x1 y1 z1     between the two corners
+ *    cylinder axis a b r       infinite along axis (x, y or z), around (a, b) in the other two
+ *    union                     of the two shapes before it
+ *    intersect                 of the two shapes before it
+ *    subtract                  the shape before it from the one before that
+ *
+ * Shapes left over at the end of a section are united. Particles are seeded in the fluid outside
+ * the solids, the cells whose centres are inside the solids stay solid, and particles carried
+ * into a solid are pushed out to its nearest surface: a solid standing on a wall of the domain
+ * should reach through it, or the particles would be pushed out through the wall.
+ */
+
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include "grid.h"
+#include "particles.h"
+
+#define SDF_BATCH 64 // points SdfProgram::evaluate takes at once
+#define SDF_STACK 16 // most shapes a program holds at once while it's evaluated
+#define SCENE_BLOCK 8 // cells per side of the blocks culled together by seeding and voxelization
+#define SCENE_CACHE_VERSION 1 // part of the cache key: bump it when seeding, voxelizing or the cached state change
+
+typedef enum SdfOpEnum { SDF_PLANE = 0, SDF_SPHERE = 1, SDF_BOX = 2, SDF_CYLINDER = 3,
+                         SDF_UNION = 4, SDF_INTERSECT = 5, SDF_SUBTRACT = 6 } SdfOp;
+
+/* One step of a program. Shapes keep their parameters in a form ready to evaluate: planes a unit */
+/* normal and offset, spheres a centre and radius, boxes a centre and half size, cylinders the */
+/* axis (0, 1 or 2), the centre in the other two coordinates and the radius. */
+struct SdfInstruction{
+   SdfOp op;
+   float p[6];
+};
+
+/* A signed distance function as a postfix program: shapes push their distance, operations */
+/* combine the top two. An empty program is outside everywhere. */
+struct SdfProgram{
+   std::vector<SdfInstruction> code;
+
+   bool empty(void) const
+   { return code.empty(); }
+
+   float evaluate(float x, float y, float z) const;
+   void evaluate(const float *x, const float *y, const float *z, int n, float *phi) const;
+   void bounds(const float lo[3], const float hi[3], float &low, float &high) const;
+   unsigned long long hash(unsigned long long key) const;
+};
+
+struct Scene{
+   SdfProgram fluid, solid;
+   SdfProgram seeded; // the fluid outside the solids
+
+   bool parse(const char *text, const char *name);
+   bool read(const char *filename);
+   unsigned long long hash(void) const;
+   void voxelize_solid(Grid &grid) const;
+   void seed_particles(Grid &grid, Particles &particles, int na, int nb, int nc, unsigned long long seed) const;
+};
+
+bool read_initial_state(const char *directory, unsigned long long key, Grid &grid, Particles &particles);
+bool write_initial_state(const char *directory, unsigned long long key, const Grid &grid, const Particles &particles);
+
+#endif
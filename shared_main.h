@@ -9,10 +9,49 @@
 #ifndef SHARED_MAIN_H
 #define SHARED_MAIN_H
 
+#include <chrono>
+#include <cstring>
+#include "archive.h"
+#include "checkpoint.h"
+#include "codec.h"
+#include "fields.h"
+#include "output.h"
+#include "scene.h"
+#include "slices.h"
+
 
 #define SIMULATION_TYPE (PIC) // default simtype: APIC, FLIP, or PIC
-#define INIT_DROP_RADIUS (0.05)
-#define INIT_FLOOR_SIZE (0.05)
+#define EXTRAPOLATION_TYPE (BFS_EXTRAPOLATION) // SWEEP_EXTRAPOLATION or BFS_EXTRAPOLATION
+#define EXTRAPOLATION_LAYERS (4) // faces filled outward from the fluid by BFS_EXTRAPOLATION
+#define SORT_INTERVAL (20) // steps between reordering the particles by cell
+#define SORT_LOCALITY_THRESHOLD (0.3) // reorder sooner when more of the particles than this are out of place
+#define CACHE_STENCILS (false) // keep the transfer stencils for the gather (12 bytes per particle) instead of recomputing them
+#define ADVECTION_SUBSTEPS (5) // most Runge-Kutta 2 substeps a particle takes in a time step
+#define ADVECTION_CFL (0.5) // cells a particle may cross in one substep
+#define ADVECTION_TOLERANCE (0.05) // cells a substep may stray from the path through the velocity change along it
+#define ADVECTION_AFFINE (false) // substep through each particle's local affine model of the grid velocity instead of sampling the grid
+#define ADVECTION_AFFINE_RADIUS (0.5) // cells a particle may stray from where its affine model was sampled
+#define TRANSFER_KERNEL (LINEAR_KERNEL) // LINEAR_KERNEL, QUADRATIC_KERNEL or CUBIC_KERNEL (B-splines)
+#define TRANSFER_ENGINE (STAGGERED_ENGINE) // or MLS_ENGINE: APIC transfers through the cell centres, one stencil for all components
+#define INIT_SEED (0) // the initial particles' random jitter (and velocities) are a function of this, their cell and sample
+#define SCENE_CACHE_DIR "scene_cache" // initial states of the scenes seeded before, by what they depend on ("" to always seed)
+#define FRAME_FORMAT (BINARY_FRAMES) // BINARY_FRAMES (3D, every particle column, see frame.h), COMPRESSED_FRAMES (codec.h) or TEXT_FRAMES (x and y as text)
+#define FRAME_PRECISION (1./256) // compressed frames: the position step in cells (positions are within half of it)...
+#define FRAME_VELOCITY_STEP (4) // ...and the velocity step in position steps per frame
+#define FRAME_KEYFRAME_INTERVAL (30) // compressed frames: most frames between keyframes, which decode on their own
+#define FRAME_ARCHIVE "frames.archive" // binary and compressed frames all go into this archive in the output directory (see archive.h), "" for a file per frame
+#define FIELD_INTERVAL (10) // frames between dumps of the grid fields near the fluid (0 for none, see fields.h)
+#define FIELD_OUTPUT (FIELD_U | FIELD_V | FIELD_W | FIELD_PRESSURE | FIELD_PHI | FIELD_MARKER) // the fields dumped
+#define SLICES "pressure z 0.5; u z 0.5; v z 0.5; marker x 0.5" // cross-sections taken every step, "field axis position; ..." (see slices.h), "" for none; a phi slice costs computing phi each step unless the extrapolation sweeps
+#define SLICE_STREAM "slices.stream" // the rolling stream of the slices, in the output directory
+#define SLICE_CAPACITY (1024) // steps the slice stream keeps
+#define CHECKPOINT_INTERVAL (25) // frames between checkpoints of the whole state, to carry on from with --resume (0 for none)
+#define CHECKPOINT_FILE "checkpoint.state" // the latest checkpoint, in the output directory
+#define CHECKPOINT_FORK (true) // write checkpoints from a forked copy of the process while the simulation carries on
+#define CHECKPOINT_SNAPSHOTS (2) // forked checkpoints being written at once, at most
+#define CHECKPOINT_HEADROOM (1.5) // memory available to fork, in multiples of the process's resident memory
+#define ASYNC_OUTPUT (true) // write binary frames on a background thread while the simulation goes on
+#define OUTPUT_BUFFERS (2) // frames the writer may hold before the simulation waits for it
 #define USE_SPHERICAL_GRAV (false)
 // the following only matter when USE_SPHERICAL_GRAV is true
 #define INIT_VEL_MAGNITUDE (0.55)
@@ -22,91 +61,185 @@
 #define GRAV_FACTOR (0.01)
 
 using namespace std;
-/* This sets the signed distance function phi of the fluid. You can selectively uncomment a line to decide */
-/* which example to run. This is used in initializing the water. */
-float fluidphi(Grid &grid, float x, float y, float z) // TODO : need to fix this for 3D
+/* The scene run when none is given on the command line: a drop falling into a pool (see scene.h */
+/* for the format, and scenes/ for more examples). */
+static const char DEFAULT_SCENE[]=
+   "fluid\n"
+   "plane 0 1 0 0.05 # the pool's surface\n"
+   "cylinder z 0.5 0.7 0.05 # the drop\n";
+
+/* Sets up the scene's solids in the grid and seeds its fluid with na*nb*nc particles per cell. */
+/* The result is cached under SCENE_CACHE_DIR, keyed by everything it depends on, so running a */
+/* scene again reads its initial state instead of seeding it. */
+void init_scene(Grid &grid, Particles &particles, const Scene &scene, int na, int nb, int nc)
+{
+   unsigned long long key=scene.hash();
+   const int setup[]={SCENE_CACHE_VERSION, grid.marker.nx, grid.marker.ny, grid.marker.nz, na, nb, nc, INIT_SEED, USE_SPHERICAL_GRAV};
+   for(unsigned int a=0; a<sizeof setup/sizeof setup[0]; ++a)
+      key=hash64(key^(unsigned int)setup[a]);
+   const float scales[]={grid.lx, (float)INIT_VEL_MAGNITUDE};
+   for(unsigned int a=0; a<sizeof scales/sizeof scales[0]; ++a){
+      unsigned int bits;
+      memcpy(&bits, &scales[a], sizeof bits);
+      key=hash64(key^bits);
+   }
+   if(SCENE_CACHE_DIR[0] && read_initial_state(SCENE_CACHE_DIR, key, grid, particles)){
+      printf("read the initial state from %s/%016llx.state\n", SCENE_CACHE_DIR, key);
+      return;
+   }
+
+   scene.voxelize_solid(grid);
+   int first=particles.np;
+   scene.seed_particles(grid, particles, na, nb, nc, INIT_SEED);
+   if(USE_SPHERICAL_GRAV){
+      // random velocities, keyed on the particle like the positions are on the sample
+      for(int p=first; p<particles.np; ++p){
+         const unsigned long long counter=3*((unsigned long long)INIT_SEED*particles.np+p);
+         particles.vx[p]=INIT_VEL_MAGNITUDE*grid.lx*(2*random_unit(counter)+0.5);
+         particles.vy[p]=INIT_VEL_MAGNITUDE*grid.ly*(2*random_unit(counter+1)-1.0);
+         particles.vz[p]=INIT_VEL_MAGNITUDE*grid.lz*(2*random_unit(counter+2)+0.5);
+      }
+   }
+   if(SCENE_CACHE_DIR[0] && !write_initial_state(SCENE_CACHE_DIR, key, grid, particles))
+      printf("couldn't cache the initial state in %s\n", SCENE_CACHE_DIR);
+}
+
+/* The archive for the frames of the run in outputpath, new or, for a resumed run, the one it */
+/* appends to (its frames from the checkpoint on replace those there); null to write a file per */
+/* frame. */
+ArchiveWriter *open_frame_archive(const char *outputpath, bool append)
 {
-   //return y-0.5*grid.ly; // no drop
-   //return min(sqrt(sqr(x-0.5*grid.lx)+sqr(y-0.625*grid.ly))-0.02*grid.ly, y-0.6*grid.ly); // tiny drop
-//   return min(sqrt(sqr(x-0.3333*grid.lx)+sqr(y-0.71*grid.ly))-0.3*grid.ly, y-0.2*grid.ly); // large drop
-   //return max(y-0.8*grid.ly, -sqrt(sqr(x-0.5*grid.lx)+sqr(y-0.2*grid.ly))+0.1*grid.lx); // bubble
-   //return sqrt(sqr(x-0.5*grid.lx)+sqr(y-0.75*grid.ly))-0.15*grid.lx; // large drop without bottom
-   return min(y-INIT_FLOOR_SIZE*grid.ly, sqrt(sqr(x-0.5*grid.lx)+sqr(y-0.7*grid.ly))-INIT_DROP_RADIUS*grid.lx); // medium drop
-   //return 0.75*grid.lx-x; // vertical column
-   //return max( max(x-0.75*grid.lx, 0.25*grid.lx-x), max(y-0.75*grid.ly, 0.25*grid.ly-y)); // small box
+   if(!FRAME_ARCHIVE[0] || FRAME_FORMAT==TEXT_FRAMES) return 0;
+   string filename=string(outputpath)+"/"+FRAME_ARCHIVE;
+   ArchiveWriter *archive=new ArchiveWriter;
+   if(archive->open(filename.c_str(), append)) return archive;
+   printf("couldn't create %s: writing a file per frame\n", filename.c_str());
+   delete archive;
+   return 0;
 }
 
-/* Helper function for initializing the water */
-void project(Grid &grid, float &x, float &y, float &z, float current, float target)
+/* The stream of the SLICES of the run in outputpath, starting at the given time: new or, for a */
+/* resumed run, the one it carries on; null for none or if it can't be written. */
+SliceStream *open_slice_stream(const Grid &grid, const char *outputpath, double time, bool append)
 {
-   float dpdx=(fluidphi(grid, x+1e-4, y, z)-fluidphi(grid, x-1e-4, y, z))/2e-4;
-   float dpdy=(fluidphi(grid, x, y+1e-4, z)-fluidphi(grid, x, y-1e-4, z))/2e-4;
-   float dpdz=(fluidphi(grid, x, y, z+1e-4)-fluidphi(grid, x, y, z-1e-4))/2e-4;
-   float scale=(target-current)/sqrt(dpdx*dpdx+dpdy*dpdy+dpdz*dpdz);
-   x+=scale*dpdx;
-   y+=scale*dpdy;
-   z+=scale*dpdz;
+   if(!SLICES[0]) return 0;
+   string filename=string(outputpath)+"/"+SLICE_STREAM;
+   SliceStream *slices=new SliceStream;
+   if(slices->open(filename.c_str(), grid, SLICES, SLICE_CAPACITY, append)){
+      slices->time=time;
+      return slices;
+   }
+   printf("couldn't create %s: no slices\n", filename.c_str());
+   delete slices;
+   return 0;
 }
 
-/* This function allocates particles based on the phi function. */
-void init_water_drop(Grid &grid, Particles &particles, int na, int nb, int nc)
+/* Writes frame number frame, at the given time, in the FRAME_FORMAT: binary and compressed */
+/* frames go into the archive if there is one and to outputpath/frameparticles%04d.bin if not, */
+/* text frames to outputpath/frameparticles%04d. Compressed frames need the encoder, which carries */
+/* the previous frame. Given a writer (appending to the same archive), a binary frame is copied */
+/* (or compressed) into one of its buffers and written in the background, and the time the */
+/* simulation was held up for it is printed. */
+void output_frame(Particles &particles, AsyncWriter *writer, ArchiveWriter *archive, FrameEncoder *encoder,
+                  const char *outputpath, int frame, double time)
 {
-   int i, j, k, a, b, c;
-   float x, y, z, phi;
-   float vx, vy, vz;
-   vx = 0;
-   vy = 0;
-   vz = 0;
-
-   for(i=1; i<grid.marker.nx-1; ++i){
-      for(j=1; j<grid.marker.ny-1; ++j){
-          for(k=1;k<grid.marker.nz;++k){
-              for (a = 0; a < na; ++a) {
-                  for (b = 0; b < nb; ++b) {
-                      for (c = 0; c < nc; ++c) {
-                          x = (i + (a + 0.1 + 0.8 * rand() / (double) RAND_MAX) / na) * grid.h;
-                          y = (j + (b + 0.1 + 0.8 * rand() / (double) RAND_MAX) / nb) * grid.h;
-                          z = (k + (c + 0.1 + 0.8 * rand() / (double) RAND_MAX) / nc) * grid.h;
-                          if (USE_SPHERICAL_GRAV) {
-                              vx = INIT_VEL_MAGNITUDE * grid.lx * (rand() * 2.0 / (double) RAND_MAX + 0.5);
-                              vy = INIT_VEL_MAGNITUDE * grid.ly * (rand() * 2.0 / (double) RAND_MAX - 1.0);
-                              vz = INIT_VEL_MAGNITUDE * grid.lz * (rand() * 2.0 / (double) RAND_MAX + 0.5);
-                          }
-                          phi = fluidphi(grid, x, y, z);
-                          if (phi > -0.25 * grid.h / na)
-                              continue;
-                          else if (phi > -1.5 * grid.h / na) {
-                              project(grid, x, y, z, phi, -0.75 * grid.h / na);
-                              phi = fluidphi(grid, x, y, z);
-                              project(grid, x, y, z, phi, -0.75 * grid.h / na);
-                              phi = fluidphi(grid, x, y, z);
-                          }
-                          particles.add_particle(Vec3f(x, y, z), Vec3f(vx, vy, vz));
-                      }
-                  }
-              }
-          }
-      }
+   if(FRAME_FORMAT==TEXT_FRAMES){
+      particles.write_to_file("%s/frameparticles%04d", outputpath, frame);
+      return;
    }
+   if(!writer && !archive && FRAME_FORMAT==BINARY_FRAMES){
+      particles.write_frame(frame, time, "%s/frameparticles%04d.bin", outputpath, frame);
+      return;
+   }
+   chrono::steady_clock::time_point start=chrono::steady_clock::now();
+   double waited=writer ? writer->waited_ms : 0;
+   OutputBuffer local, *buffer=writer ? writer->acquire() : &local;
+   char name[32];
+   snprintf(name, sizeof name, "/frameparticles%04d.bin", frame);
+   buffer->filename=string(outputpath)+name;
+   buffer->archived=true;
+   if(FRAME_FORMAT==COMPRESSED_FRAMES)
+      encoder->encode(particles, frame, time, buffer->data);
+   else
+      particles.snapshot_frame(buffer->data, frame, time);
+   if(writer){
+      writer->submit(buffer);
+      printf("frame %d output held up the simulation %.2f ms (%.2f ms waiting for the writer)\n", frame,
+             chrono::duration<double, milli>(chrono::steady_clock::now()-start).count(), writer->waited_ms-waited);
+   }else if(archive ? !archive->append(buffer->data.data(), buffer->data.size())
+                    : !write_whole_file(buffer->filename.c_str(), buffer->data.data(), buffer->data.size()))
+      printf("couldn't write frame %d\n", frame);
+}
+
+/* Brings grid.phi up to date if the GridFields in fields include it: only the sweep */
+/* extrapolation computes it each step, and with the BFS extrapolation it would stay zero. */
+/* Nothing else reads phi, so computing it doesn't change the simulation. */
+void update_phi_for(Grid &grid, int fields)
+{
+   if((fields&FIELD_PHI) && grid.extrapolation!=SWEEP_EXTRAPOLATION)
+      grid.compute_distance_to_fluid();
+}
+
+/* Dumps the FIELD_OUTPUT fields of the grid at the end of frame number frame to */
+/* outputpath/fields%04d.bin, encoded into one of the writer's buffers and written in the */
+/* background if there is a writer. Bringing phi up to date and encoding read the grid, so they */
+/* hold up the simulation (around 15 ms on a 50^3 grid with the BFS extrapolation, most of it */
+/* phi, every FIELD_INTERVAL frames); only the write is left to the writer. The time is printed. */
+void output_fields(Grid &grid, AsyncWriter *writer, FieldEncoder &encoder, const char *outputpath, int frame, double time)
+{
+   chrono::steady_clock::time_point start=chrono::steady_clock::now();
+   update_phi_for(grid, FIELD_OUTPUT);
+   OutputBuffer local, *buffer=writer ? writer->acquire() : &local;
+   char name[32];
+   snprintf(name, sizeof name, "/fields%04d.bin", frame);
+   buffer->filename=string(outputpath)+name;
+   buffer->archived=false;
+   encoder.encode(grid, FIELD_OUTPUT, frame, time, buffer->data);
+   printf("fields of frame %d held up the simulation %.2f ms\n", frame,
+          chrono::duration<double, milli>(chrono::steady_clock::now()-start).count());
+   if(writer)
+      writer->submit(buffer);
+   else if(!write_whole_file(buffer->filename.c_str(), buffer->data.data(), buffer->data.size()))
+      printf("couldn't write %s\n", buffer->filename.c_str());
+}
+
+/* Writes the checkpoint of the end of frame number frame over the last one in outputpath, */
+/* through the checkpointer's snapshots if there is one. */
+void save_checkpoint(const Grid &grid, const Particles &particles, ForkCheckpointer *checkpointer, const char *outputpath,
+                     int frame, double time)
+{
+   string filename=string(outputpath)+"/"+CHECKPOINT_FILE;
+   if(checkpointer){
+      checkpointer->checkpoint(filename.c_str(), grid, particles, frame, time);
+      return;
+   }
+   chrono::steady_clock::time_point start=chrono::steady_clock::now();
+   if(write_checkpoint(filename.c_str(), grid, particles, frame, time))
+      printf("checkpoint of frame %d written to %s in %.1f ms\n", frame, filename.c_str(),
+             chrono::duration<double, milli>(chrono::steady_clock::now()-start).count());
+   else
+      printf("couldn't write the checkpoint of frame %d to %s\n", frame, filename.c_str());
 }
 
 void advance_one_step(Grid &grid, Particles &particles, double dt)
 {
-   for(int i=0; i<5; ++i)
-      particles.move_particles_in_grid(0.2*dt);
+   particles.update_sorting();
    particles.transfer_to_grid();
-   grid.save_velocities();
+   grid.save_velocities(); // these two do nothing unless the scheme tracks the velocity change (FLIP)
    grid.add_gravity(dt, USE_SPHERICAL_GRAV, GRAV_CENTER_X * grid.lx, GRAV_CENTER_Y  * grid.ly, GRAV_CENTER_Z * grid.lz);
-   grid.compute_distance_to_fluid();
+   if(grid.extrapolation==SWEEP_EXTRAPOLATION) // the BFS extrapolation doesn't need phi
+      grid.compute_distance_to_fluid();
    grid.extend_velocity();
    grid.apply_boundary_conditions();
    grid.make_incompressible();
    grid.extend_velocity();
    grid.get_velocity_update();
-   particles.update_from_grid();
+   particles.update_and_move(dt, ADVECTION_SUBSTEPS);
 }
 
-void advance_one_frame(Grid &grid, Particles &particles, double frametime)
+/* Advances a frame of frametime in steps of up to twice the CFL time, recording the slices */
+/* after each if there is a stream. */
+void advance_one_frame(Grid &grid, Particles &particles, double frametime, SliceStream *slices=0)
 {
    double t=0;
    double dt;
@@ -120,8 +253,14 @@ void advance_one_frame(Grid &grid, Particles &particles, double frametime)
          dt=0.5*(frametime-t);
       printf("advancing %g (to %f%% of frame)\n", dt, 100.0*(t+dt)/frametime);
       advance_one_step(grid, particles, dt);
+      if(slices){
+         update_phi_for(grid, slices->fields);
+         if(!slices->record(grid, dt))
+            printf("couldn't write the slices of step %lld\n", slices->step-1);
+      }
       t+=dt;
    }
+   particles.report_substeps();
 }
 
 
@@ -0,0 +1,252 @@
+/**
+ * Taking slices of the grid and streaming them (the format is in slices.h).
+ */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "slices.h"
+
+using namespace std;
+
+static size_t slice_padded(size_t bytes)
+{ return (bytes+FRAME_ALIGN-1)/FRAME_ALIGN*FRAME_ALIGN; }
+
+/* the size of the field's array of the grid */
+static void field_size(const Grid &grid, GridField field, int *size)
+{
+   size[0]=grid.marker.nx+(field==FIELD_U);
+   size[1]=grid.marker.ny+(field==FIELD_V);
+   size[2]=grid.marker.nz+(field==FIELD_W);
+}
+
+/* copies the plane index across axis of the array into slice, the other two axes in order */
+template<class T>
+static void take_slice(const Array3<T> &a, int axis, int index, Array2f &slice)
+{
+   if(axis==0){
+      for(int k=0; k<a.nz; ++k) for(int j=0; j<a.ny; ++j)
+         slice(j, k)=(float)a(index, j, k);
+   }else if(axis==1){
+      for(int k=0; k<a.nz; ++k) for(int i=0; i<a.nx; ++i)
+         slice(i, k)=(float)a(i, index, k);
+   }else{
+      for(int j=0; j<a.ny; ++j) for(int i=0; i<a.nx; ++i)
+         slice(i, j)=(float)a(i, j, index);
+   }
+}
+
+/* Reads slices described as "field axis position", separated by semicolons, such as */
+/* "pressure z 0.5; u x 0.25": the field one of u, v, w, pressure, phi and marker, the axis one */
+/* of x, y and z and the position the fraction of the way along it. Returns false, saying why, */
+/* if the description doesn't read. */
+bool parse_slices(const char *spec, const Grid &grid, vector<SliceInfo> &info)
+{
+   static const char *names[FIELD_COUNT]={"u", "v", "w", "pressure", "phi", "marker"};
+   static const GridField fields[FIELD_COUNT]={FIELD_U, FIELD_V, FIELD_W, FIELD_PRESSURE, FIELD_PHI, FIELD_MARKER};
+   info.clear();
+   const char *p=spec;
+   while(*p){
+      char name[16], axis;
+      float position;
+      int n=0;
+      if(sscanf(p, " %15[a-z] %c %f %n", name, &axis, &position, &n)<3 || n==0){
+         printf("couldn't read the slice at \"%s\"\n", p);
+         return false;
+      }
+      p+=n;
+      if(*p==';') ++p;
+      else if(*p){
+         printf("expected ; before \"%s\"\n", p);
+         return false;
+      }
+      SliceInfo slice;
+      memset(&slice, 0, sizeof slice);
+      slice.field=0;
+      for(int f=0; f<FIELD_COUNT; ++f)
+         if(!strcmp(name, names[f])) slice.field=fields[f];
+      if(!slice.field || axis<'x' || axis>'z' || !(position>=0 && position<=1)){
+         printf("a slice is a field (u, v, w, pressure, phi or marker), an axis (x, y or z) and a position from 0 to 1, not %s %c %g\n",
+                name, axis, position);
+         return false;
+      }
+      int size[3];
+      field_size(grid, (GridField)slice.field, size);
+      slice.axis=axis-'x';
+      slice.position=position;
+      slice.index=min((int)(position*size[slice.axis]), size[slice.axis]-1);
+      slice.width=size[slice.axis==0 ? 1 : 0];
+      slice.height=size[slice.axis==2 ? 1 : 2];
+      info.push_back(slice);
+   }
+   return true;
+}
+
+/* Creates the stream of the slices spec describes (see parse_slices), keeping the last */
+/* capacity steps, at least 2 so a reader can tell a record is whole. With append, an existing */
+/* stream of the same slices is carried on from its latest step instead (a resumed run keeps */
+/* its history); one of other slices is started again. Returns false if the description */
+/* doesn't read or the file can't be written. */
+bool SliceStream::
+open(const char *filename, const Grid &grid, const char *spec, int capacity_, bool append)
+{
+   close();
+   if(capacity_<2 || !parse_slices(spec, grid, info)) return false;
+   capacity=capacity_;
+   fields=0;
+   for(unsigned int s=0; s<info.size(); ++s)
+      fields|=info[s].field;
+   slices=new Array2f[info.size()];
+   record_bytes=sizeof(SliceRecord);
+   for(unsigned int s=0; s<info.size(); ++s){
+      slices[s].init(info[s].width, info[s].height);
+      record_bytes+=slice_padded(slices[s].size*sizeof(float));
+   }
+   records_at=sizeof(SliceStreamHeader)+slice_padded(info.size()*sizeof(SliceInfo));
+   step=0;
+   if(append && access(filename, F_OK)==0){
+      if(reopen(filename, grid)) return true;
+      printf("%s holds other slices or isn't a slice stream: starting it again\n", filename);
+   }
+   fd=::open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+   if(fd<0){
+      close();
+      return false;
+   }
+   SliceStreamHeader header;
+   memset(&header, 0, sizeof header);
+   memcpy(header.magic, SLICE_MAGIC, 8);
+   header.nslices=info.size();
+   header.capacity=capacity;
+   header.record_bytes=record_bytes;
+   header.latest=-1;
+   header.nx=grid.marker.nx;
+   header.ny=grid.marker.ny;
+   header.nz=grid.marker.nz;
+   header.lx=grid.lx;
+   struct iovec io[2]={{&header, sizeof header}, {info.data(), info.size()*sizeof(SliceInfo)}};
+   if(!write_all(fd, io, 2) || ftruncate(fd, records_at+capacity*record_bytes)!=0){
+      close();
+      return false;
+   }
+   return true;
+}
+
+/* Opens the stream in filename to carry on after its latest step, if it holds the slices, */
+/* ring and grid this one was opened for. */
+bool SliceStream::
+reopen(const char *filename, const Grid &grid)
+{
+   fd=::open(filename, O_RDWR);
+   if(fd<0) return false;
+   SliceStreamHeader header;
+   vector<SliceInfo> stored(info.size());
+   const ssize_t bytes=stored.size()*sizeof(SliceInfo);
+   bool ok=pread(fd, &header, sizeof header, 0)==sizeof header && !memcmp(header.magic, SLICE_MAGIC, 8)
+           && header.nslices==(int)info.size() && header.capacity==capacity && header.record_bytes==record_bytes
+           && header.nx==grid.marker.nx && header.ny==grid.marker.ny && header.nz==grid.marker.nz
+           && pread(fd, stored.data(), bytes, sizeof header)==bytes && !memcmp(stored.data(), info.data(), bytes);
+   if(!ok){
+      ::close(fd);
+      fd=-1;
+      return false;
+   }
+   step=header.latest+1;
+   return true;
+}
+
+/* Takes the slices of the grid after a step of dt and writes them over the oldest record, then */
+/* makes it the latest. The stream isn't flushed to the disk: it's for watching, not keeping. */
+bool SliceStream::
+record(const Grid &grid, double dt)
+{
+   if(fd<0) return false;
+   time+=dt;
+   static const char padding[FRAME_ALIGN]={0};
+   SliceRecord header;
+   memset(&header, 0, sizeof header);
+   header.step=step;
+   header.time=time;
+   header.dt=dt;
+   vector<struct iovec> io(1+2*info.size());
+   io[0].iov_base=&header;
+   io[0].iov_len=sizeof header;
+   for(unsigned int s=0; s<info.size(); ++s){
+      switch(info[s].field){
+         case FIELD_U: take_slice(grid.u, info[s].axis, info[s].index, slices[s]); break;
+         case FIELD_V: take_slice(grid.v, info[s].axis, info[s].index, slices[s]); break;
+         case FIELD_W: take_slice(grid.w, info[s].axis, info[s].index, slices[s]); break;
+         case FIELD_PRESSURE: take_slice(grid.pressure, info[s].axis, info[s].index, slices[s]); break;
+         case FIELD_PHI: take_slice(grid.phi, info[s].axis, info[s].index, slices[s]); break;
+         default: take_slice(grid.marker, info[s].axis, info[s].index, slices[s]);
+      }
+      const size_t bytes=slices[s].size*sizeof(float);
+      io[1+2*s].iov_base=slices[s].data;
+      io[1+2*s].iov_len=bytes;
+      io[2+2*s].iov_base=(void *)padding;
+      io[2+2*s].iov_len=slice_padded(bytes)-bytes;
+   }
+   const off_t at=records_at+(step%capacity)*record_bytes;
+   const long long latest=step++;
+   return lseek(fd, at, SEEK_SET)==at && write_all(fd, io.data(), io.size())
+          && pwrite(fd, &latest, sizeof latest, offsetof(SliceStreamHeader, latest))==sizeof latest;
+}
+
+void SliceStream::
+close(void)
+{
+   if(fd>=0) ::close(fd);
+   fd=-1;
+   delete[] slices;
+   slices=0;
+}
+
+/* Reads the latest record of a stream, which may be being written, into record and the values */
+/* of its slices, one after the other. Returns false if it isn't a stream or has no whole record. */
+bool read_latest_slices(const char *filename, SliceStreamHeader &header, vector<SliceInfo> &info,
+                        SliceRecord &record, vector<float> &values)
+{
+   memset(&header, 0, sizeof header);
+   int fd=::open(filename, O_RDONLY);
+   if(fd<0) return false;
+   bool ok=pread(fd, &header, sizeof header, 0)==sizeof header && !memcmp(header.magic, SLICE_MAGIC, 8)
+           && header.nslices>=0 && header.capacity>0;
+   if(ok){
+      info.resize(header.nslices);
+      ok=pread(fd, info.data(), info.size()*sizeof(SliceInfo), sizeof header)==(ssize_t)(info.size()*sizeof(SliceInfo));
+   }
+   const size_t records_at=sizeof header+slice_padded(header.nslices*sizeof(SliceInfo));
+   vector<char> data;
+   // retried while the ring comes round to the record as it's read
+   for(int attempt=0; ok && attempt<8; ++attempt){
+      long long latest, after;
+      ok=pread(fd, &latest, sizeof latest, offsetof(SliceStreamHeader, latest))==sizeof latest && latest>=0;
+      if(!ok) break;
+      data.resize(header.record_bytes);
+      ok=pread(fd, data.data(), data.size(), records_at+(latest%header.capacity)*header.record_bytes)==(ssize_t)data.size()
+         && pread(fd, &after, sizeof after, offsetof(SliceStreamHeader, latest))==sizeof after;
+      if(!ok) break;
+      memcpy(&record, data.data(), sizeof record);
+      if(record.step==latest && after-latest<header.capacity-1){
+         values.clear();
+         size_t at=sizeof record;
+         for(unsigned int s=0; s<info.size(); ++s){
+            const size_t n=(size_t)info[s].width*info[s].height;
+            if(at+n*sizeof(float)>data.size()){
+               ok=false;
+               break;
+            }
+            values.insert(values.end(), (const float *)&data[at], (const float *)&data[at]+n);
+            at+=slice_padded(n*sizeof(float));
+         }
+         ::close(fd);
+         return ok;
+      }
+   }
+   ::close(fd);
+   return false;
+}
@@ -0,0 +1,88 @@
+/**
+ * Slice streams: axis-aligned cross-sections of grid fields taken after every step, to watch a
+ * run as it goes without the I/O of frames or field dumps. A slice is the plane of one field (a
+ * GridField of fields.h) across an axis, a fraction of the way along it, copied into an Array2 as
+ * floats, so a step costs the memory traffic of its slices rather than of the volumes.
+ *
+ * The stream is a file of fixed size holding the last capacity steps, overwritten in a ring: a
+ * SliceStreamHeader, a SliceInfo per slice, padded to FRAME_ALIGN, then capacity records, step s
+ * in record s%capacity. A record is a SliceRecord and each slice's values (width*height floats,
+ * first index fastest), each padded to FRAME_ALIGN. The header's latest is the newest step
+ * written whole; a reader copies that record and checks latest again afterwards, since the ring
+ * may have come round to it meanwhile.
+ */
+
+#ifndef SLICES_H
+#define SLICES_H
+
+#include <vector>
+#include "array2.h"
+#include "fields.h"
+#include "frame.h"
+#include "grid.h"
+
+#define SLICE_MAGIC "FLIPSLC1"
+
+struct SliceStreamHeader{
+   char magic[8];
+   int nslices;
+   int capacity; // records in the ring
+   unsigned long long record_bytes; // a record with its slices and padding
+   long long latest; // the newest step written whole, or -1 before the first
+   int nx, ny, nz; // grid cells
+   float lx; // width of the grid
+   char reserved[16];
+};
+
+static_assert(sizeof(SliceStreamHeader)==FRAME_ALIGN, "the slice stream header is one aligned block");
+
+struct SliceInfo{
+   int field; // the GridField
+   int axis; // 0, 1 or 2 for x, y or z
+   int index; // of the plane along the axis, in the field's array
+   int width, height; // the slice's size: the field's array along the other two axes in order
+   float position; // the fraction of the way along the axis asked for
+   char reserved[8];
+};
+
+struct SliceRecord{
+   long long step;
+   double time; // after the step
+   double dt; // of the step
+   char reserved[40];
+};
+
+static_assert(sizeof(SliceRecord)==FRAME_ALIGN, "the slice record header is one aligned block");
+
+/* Takes the slices of a run after each step and writes them to a stream. */
+struct SliceStream{
+   double time; // of the grid the next slices are taken from, less the step's dt
+   long long step; // steps recorded
+   int fields; // the GridFields sliced
+
+   SliceStream()
+      :time(0), step(0), fields(0), fd(-1), capacity(0), slices(0)
+   {}
+
+   ~SliceStream()
+   { close(); }
+
+   bool open(const char *filename, const Grid &grid, const char *spec, int capacity_, bool append);
+   bool record(const Grid &grid, double dt);
+   void close(void);
+
+   private:
+   int fd;
+   int capacity;
+   unsigned long long record_bytes, records_at; // a record's size, and where the first starts
+   std::vector<SliceInfo> info;
+   Array2f *slices; // one per info
+
+   bool reopen(const char *filename, const Grid &grid);
+};
+
+bool parse_slices(const char *spec, const Grid &grid, std::vector<SliceInfo> &info);
+bool read_latest_slices(const char *filename, SliceStreamHeader &header, std::vector<SliceInfo> &info,
+                        SliceRecord &record, std::vector<float> &values);
+
+#endif
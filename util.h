@@ -63,4 +63,18 @@ template<class T>
 void zero(std::vector<T> &v)
 { for(int i=v.size()-1; i>=0; --i) v[i]=0; }
 
+/* Counter-based random numbers: the SplitMix64 hash of a counter, e.g. built from a cell index and */
+/* a sample number, so a value doesn't depend on what was drawn before it or on which thread draws it. */
+inline unsigned long long hash64(unsigned long long counter)
+{
+   unsigned long long x=counter*0x9e3779b97f4a7c15ULL;
+   x=(x^(x>>30))*0xbf58476d1ce4e5b9ULL;
+   x=(x^(x>>27))*0x94d049bb133111ebULL;
+   return x^(x>>31);
+}
+
+/* a uniform random number in [0, 1) for the counter */
+inline float random_unit(unsigned long long counter)
+{ return (hash64(counter)>>40)*(1.f/16777216); }
+
 #endif
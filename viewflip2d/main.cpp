@@ -11,28 +11,60 @@
 #include <fstream>
 #include "gluvi.h"
 #include "vec2.h"
+#include "../archive.h"
+#include "../frame.h"
 
 using namespace std;
 
 char frame_number[100]="frame 0";
 const char *file_format;
+FrameArchive archive; // when the argument is an archive (archive.h) rather than a file name format
+bool archived=false;
 unsigned int frame=0;
 vector<Vec2f> x;
 
+/* Reads a frame from the archive, straight from its map, or from its own file: a binary frame */
+/* (frame.h) if the file is one, and the text format otherwise. Compressed frames aren't shown. */
 bool read_frame(int newframe)
 {
    if(newframe<0) return false;
 
+   if(archived){
+      int e=archive.find(newframe);
+      const float *px=(e<0) ? 0 : archive.column(e, 0), *py=(e<0) ? 0 : archive.column(e, 1);
+      if(!px || !py){
+         if(e>=0) cerr<<"frame "<<newframe<<" is compressed or damaged: the viewer shows whole raw frames only"<<endl;
+         return false;
+      }
+      x.resize(archive.entries[e].np);
+      for(unsigned int i=0; i<x.size(); ++i)
+         x[i]=Vec2f(px[i], py[i]);
+      frame=newframe;
+      sprintf(frame_number, "frame %d", frame);
+      return true;
+   }
+
    char filename[100];
    sprintf(filename, file_format, newframe);
-   ifstream in(filename);
-   if(!in.good())
-      return false;
-   int n;
-   in>>n;
-   x.resize(n);
-   for(int i=0; i<n; ++i)
-      in>>x[i];
+   FrameHeader header;
+   vector<float> px, py;
+   vector<float> *columns[2]={&px, &py};
+   if(read_frame_file(filename, header, columns, 2)){
+      x.resize(header.np);
+      for(int i=0; i<header.np; ++i)
+         x[i]=Vec2f(px[i], py[i]);
+   }else{
+      ifstream in(filename);
+      if(!in.good())
+         return false;
+      int n;
+      in>>n;
+      if(!in.good())
+         return false;
+      x.resize(n);
+      for(int i=0; i<n; ++i)
+         in>>x[i];
+   }
    frame=newframe;
    sprintf(frame_number, "frame %d", frame);
    return true;
@@ -90,6 +122,14 @@ void special_key_handler(int key, int x, int y)
          if(read_frame(frame+1))
             glutPostRedisplay();
          break;
+      case GLUT_KEY_HOME: // an archive can jump straight to its first and last frames
+         if(archived && !archive.entries.empty() && read_frame(archive.entries.front().frame))
+            glutPostRedisplay();
+         break;
+      case GLUT_KEY_END:
+         if(archived && !archive.entries.empty() && read_frame(archive.entries.back().frame))
+            glutPostRedisplay();
+         break;
       default:
          ;
    }
@@ -100,12 +140,15 @@ int main(int argc, char **argv)
    Gluvi::init("viewflip2d", &argc, argv);
 
    if(argc!=2){
-      cerr<<"Expecting one argument: format for particle filenames"<<endl;
+      cerr<<"Expecting one argument: a frame archive, or format for particle filenames"<<endl;
       return 1;
    }
 
    file_format=argv[1];   
-   if(!read_frame(0))
+   archived=archive.open(argv[1]);
+   if(archived && archive.recovered)
+      cerr<<argv[1]<<" was cut short: showing its "<<archive.entries.size()<<" whole frames"<<endl;
+   if(!read_frame(archived && !archive.entries.empty() ? archive.entries.front().frame : 0))
       return 1;
 
    glutSpecialFunc(special_key_handler);